@@ -421,15 +421,23 @@ class LabelAndScaleGUI(QMainWindow):
         if interval is None:
             interval = POLL_INTERVAL
         def poll():
+            # One streaming connection; the server pushes a raw count every interval
+            spec = f"XC_RDRAWCT,{int(interval * 1000)}\n"
             while self.polling:
                 try:
                     with socket.create_connection((self.server_host, PORT), timeout=3) as s:
-                        s.sendall(b"MODE:WEIGHT\nXC_RDRAWCT\n")
-                        d = s.recv(1024).decode().strip()
-                        self.raw_data.emit(d or "<no response>")
+                        s.sendall(b"MODE:WEIGHT_STREAM\n" + spec.encode())
+                        f = s.makefile('rb')
+                        if not f.readline().startswith(b"OK:WEIGHT_STREAM"):
+                            raise ConnectionError("stream refused")
+                        while self.polling:
+                            d = f.readline()
+                            if not d:
+                                break
+                            self.raw_data.emit(d.decode().strip() or "<no response>")
+                        s.sendall(b"STOP\n")
                 except:
-                    pass
-                time.sleep(interval)
+                    time.sleep(interval)
         threading.Thread(target=poll, daemon=True).start()
 
     def toggle_connection(self):
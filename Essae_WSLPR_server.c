@@ -3,6 +3,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -18,20 +19,44 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdatomic.h>
 
 // Networking headers
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <signal.h>
 #include <sqlite3.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define PORT 8888
 #define BUFFER_SIZE 2048
 #define MAX_PATH 512
 #define INITIAL_CAP 16384
 
+// Event-driven server sizing
+#define LISTEN_BACKLOG  128     // kernel accept queue length
+#define MAX_CLIENTS     64      // connections served at once; extra ones are refused
+#define WORKER_THREADS  4       // threads for blocking scale / printer work (>= lanes + 1)
+#define MAX_EVENTS      32      // epoll events handled per wakeup
+
+// Scale sampler
+#define SCALE_POLL_MS        100     // default poll period (env ESSAE_SCALE_POLL_MS, 0 = off)
+#define WEIGHT_MAX_AGE_FLOOR_MS 1000 // cached samples are trusted for 3 polls, at least this long
+#define STREAM_MIN_PERIOD_MS 50      // fastest rate MODE:WEIGHT_STREAM can ask for
+#define SCALE_REPLY_TIMEOUT_MS 700   // give up on a scale reply after this long
+
 #define LFT_DB_PATH "SQL_LFT_Files.db"
+#define SCALE_PORT   "/dev/ttyUSB1"
+#define PRINTER_PORT "/dev/ttyUSB0"
 
 
 #define ESC 0x1B
@@ -47,77 +72,64 @@
 #define DEFAULT_LINE_SPACING_MM 3.0f
 #define MAX_BITMAP_SIZE 4096
 
-char raw[4096];           // Temporary buffer for reading image or skipping line
-
 #define MAX_ING_LINES 10
 #define MAX_ING_LINE_LEN 128
 
 int lbl_wtgrams = 1;
-int uom_type = 0;
 #define WEIGH 1
 #define PCS   0
 
-double unit_price = 0.0;          // 5 – Unit Price
-double actual_unit_price = 0.0;   // 73 – Actual Unit Price
-char uom[32] = "";
-char guom[32] = "";
-char spl_up[32] = "";
-
-// ─── Globals ──────────────────────────────────────────────────────
-static float lbl_width_mm;    // full label width in mm (from ~S)
-static float lbl_height_mm;   // full label height in mm (from ~S)
-static float lbl_x_offset = 0.0f;      // tune this so x=0 lines up
-static float lbl_y_offset = 0.0f;      // tune this so y=0 lines up
-float last_text_y = 0.0f;
-static int gui_data_id = 0;
-static int num_json_barcodes = 0;
-
-extern double actual_unit_price;
-extern double unit_price;
-extern int uom_type;
-
 // ─── Helpers ──────────────────────────────────────────────────────
 static inline uint8_t lo(int v) { return v & 0xFF; }
 static inline uint8_t hi(int v) { return (v >> 8) & 0xFF; }
 
-// Store label dimensions (from ~S) so send_text() can use them:
-static float label_width_mm;
-static float label_height_mm;
-
-static struct json_object *json_root = NULL;
-
-int weight_fd;
-pthread_mutex_t weight_mutex = PTHREAD_MUTEX_INITIALIZER;
+int weight_fd = -1;
 
 // Forward declarations
+struct client_conn;
+struct printer_port;
+struct render_context;
+struct product;
+
 int setup_server_socket(int port);
-void handle_client(int client_fd);
+bool handle_client(struct client_conn *conn);
 ssize_t write_all(int fd, const void *buf, size_t len);
+ssize_t prn_write(struct render_context *ctx, const void *buf, size_t len);
+ssize_t prn_write_fixed(struct render_context *ctx, const void *buf, size_t len);
+ssize_t prn_position(struct render_context *ctx, const void *buf, size_t len);
+void prn_set(struct render_context *ctx, uint8_t c0, uint8_t c1, uint8_t n);
+void prn_window(struct render_context *ctx, int x, int y, int dx, int dy, bool home);
+void prn_write_opaque(struct render_context *ctx, const void *buf, size_t len);
+int printer_stats(char *out, size_t cap);
 void process_weight_line(int client_fd, const char *cmd);
-int convert_label(const char *config_path, const char *lft_path);
+bool reply_cached_weight(int client_fd, const char *cmd);
+void stream_subscribe(struct client_conn *c, const char *spec);
+void stream_command(struct client_conn *c, const char *cmd);
+void stream_unsubscribe(struct client_conn *c);
+void stream_writable(struct client_conn *c);
+int stream_stats(char *out, size_t cap);
+int scale_rx_stats(char *out, size_t cap);
+int lft_cache_stats(char *out, size_t cap);
+int lft_db_open(void);
+int print_plu(long plu, const char *lft_path, int barcode_no, struct printer_port *pp);
+long plu_load_db(void);
+long plu_load_json(const char *path);
+void plu_import(const char *path, char *reply, size_t cap);
+void plu_update(const char *path, char *reply, size_t cap);
+int plu_stats(char *out, size_t cap);
+int convert_label(const char *config_path, const char *lft_path, int barcode_no,
+                  struct printer_port *pp);
+int printer_open(struct printer_port *pp);
 ssize_t read_line(int fd, char *buf, size_t max);
 char *trim_whitespace(char *str);
 
-void set_printer_rotation(int fd, int angle);
-void select_font(int fd, int font);
-void set_text_size(int fd, float h, float w);
-void set_absolute_position(int prn, int x_dots, int y_dots);
-
-unsigned char CheckPrintStatus(char prnstatus);
+void set_printer_rotation(struct render_context *ctx, int angle);
+void select_font(struct render_context *ctx, int font);
+void set_text_size(struct render_context *ctx, float h, float w);
+void set_absolute_position(struct render_context *ctx, int x_dots, int y_dots);
 
+unsigned char CheckPrintStatus(const struct render_context *ctx, char prnstatus);
 
-unsigned char CheckPrintStatus(char prnstatus) {
-    if (prnstatus == '0') return 0;  // Never print
-    if (prnstatus == '1') return 1;  // Always print
-
-    if (prnstatus == '2') return (uom_type == WEIGH); // Only for weighing items
-    if (prnstatus == '3') return (uom_type == PCS);   // Only for PCS
-
-    if (prnstatus == '4') return (uom_type == WEIGH && unit_price == actual_unit_price);
-    if (prnstatus == '5') return (uom_type == PCS && unit_price == actual_unit_price);
-
-    return 1; // Default: print
-}
 
 //*******************************************************
 
@@ -159,12 +171,400 @@ ssize_t write_all(int fd, const void *buf, size_t len) {
     const char *ptr = buf;
     while (total < len) {
         ssize_t n = write(fd, ptr + total, len - total);
-        if (n < 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Non-blocking client socket is full: wait for room
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                if (poll(&pfd, 1, 2000) > 0) continue;
+            }
+            return -1;
+        }
         total += n;
     }
     return total;
 }
 
+// ─── ESC/POS state tracker ────────────────────────────────────────
+// Mode commands (ESC T, GS !, ESC E, ESC W ...) only record the state the
+// next output needs. The difference to what the printer already has is
+// sent just before the next byte that is not a tracked mode command, so
+// set/reset pairs between two elements cost nothing on the wire.
+// Anything we cannot model (ESC @, ESC S, ~c raw codes) makes the state
+// unknown again and the following commands are sent in full.
+//
+// ESC W and ESC T also move the print position to the area's origin.
+// When one is dropped after something was printed, that move is owed
+// and paid (by resending ESC W) before the next output that prints at
+// the current position. Output is written with one of:
+//   prn_write()       prints at the current position (text, barcodes, raw)
+//   prn_write_fixed() does not use the position (FS R, FS c, CAN, GS FF ...)
+//   prn_position()    sets both X and Y explicitly
+
+enum {
+    PR_ESC_T, PR_ESC_M, PR_GS_SIZE, PR_ESC_3, PR_ESC_E, PR_ESC_UL, PR_GS_B,
+    PR_ESC_a, PR_GS_w, PR_GS_h, PR_GS_f, PR_GS_H, PR_NUM
+};
+
+// One-byte-argument commands in the order they are emitted
+static const uint8_t prn_reg_cmd[PR_NUM][2] = {
+    { ESC, 'T' }, { ESC, 'M' }, { GS, '!' }, { ESC, '3' }, { ESC, 'E' }, { ESC, '-' },
+    { GS, 'B' },  { ESC, 'a' }, { GS, 'w' }, { GS, 'h' },  { GS, 'f' },  { GS, 'H' },
+};
+
+struct prn_tracker {
+    int16_t  cur[PR_NUM];       // value the printer holds, -1 = unknown
+    int16_t  want[PR_NUM];      // value the next output needs, -1 = no change asked
+    uint16_t win_cur[4];        // ESC W x, y, dx, dy
+    uint16_t win_want[4];
+    bool     win_known, win_pending;
+    bool     win_home;          // ESC W must be sent: output relies on it homing the position
+    bool     moved;             // something printed since the position was last homed
+    bool     home_owed;         // a dropped ESC W / ESC T still has to home the position
+    bool     pending;
+    size_t   suppressed;        // bytes asked for but not sent (this job)
+};
+
+// ─── Printer-resident images ──────────────────────────────────────
+// With ESSAE_PRN_IMAGE_KB set, ~d rasters are uploaded once into the
+// printer's download graphics memory (GS ( L / GS 8 L fn 83, RAM, so no
+// NV flash wear) and labels print them by key (fn 85). This table is
+// what the server believes the printer holds. Anything that may reset
+// the printer (ESC @, ~c raw codes, a reconnect) clears it, and the next
+// job uploads its images again.
+
+#define PRN_IMAGE_SLOTS 32      // key codes 'E' '0' .. 'E' 'O'
+
+struct prn_image {
+    uint64_t key;               // ~d element's image hash, 0 = free
+    uint32_t bytes;             // raster size held by the printer
+    unsigned long used;         // last job that needed it (LRU)
+};
+
+struct prn_images {
+    size_t   budget, bytes;     // download memory we may use / use now
+    unsigned epoch;             // bumped whenever residency changes
+    unsigned long job;          // job counter, the LRU clock
+    struct prn_image slot[PRN_IMAGE_SLOTS];
+};
+
+static atomic_ulong prn_img_uploads, prn_img_upload_bytes, prn_img_refs, prn_img_resets;
+
+// The printer may have dropped everything
+static void prn_images_forget(struct prn_images *im) {
+    if (!im || !im->bytes) return;
+    memset(im->slot, 0, sizeof(im->slot));
+    im->bytes = 0;
+    im->epoch++;
+    atomic_fetch_add(&prn_img_resets, 1);
+}
+
+static int prn_image_find(const struct prn_images *im, uint64_t key) {
+    for (int i = 0; i < PRN_IMAGE_SLOTS; i++)
+        if (im->slot[i].key == key) return i;
+    return -1;
+}
+
+// ─── Printer macro ────────────────────────────────────────────────
+// With ESSAE_PRN_MACRO_BYTES set (the printer's macro buffer, 2048 on
+// most ESC/POS firmware), the largest static segment of a label that
+// fits is stored as the printer's macro: the first time it is sent
+// wrapped in GS : ... GS : (printed as it is recorded), later as GS ^.
+// The printer holds one macro and never acknowledges it, so a segment
+// that does not fit is simply sent in full. ESC @, ~c raw codes and a
+// reconnect make the macro unknown.
+
+struct prn_macro {
+    size_t   cap;               // macro buffer size, 0 = off
+    size_t   len;               // bytes of the defined macro, 0 = none known
+    uint64_t hash;              // FNV-1a of those bytes
+};
+
+static atomic_ulong prn_macro_defines, prn_macro_runs, prn_macro_saved;
+
+// ─── Software raster ──────────────────────────────────────────────
+// Slots named in ESSAE_RASTER_SLOTS ("1,7", or "all") are drawn by the
+// server into a label-sized 1bpp framebuffer instead of being sent as
+// page-mode text, barcode and drawing commands. Each ~P then sends the
+// frame as GS v 0 bands: rows with no black dot are skipped and every
+// band is cropped to its inked bytes. A label's static layer is drawn
+// once and kept per program, so a repeat print only draws ~V and ~B.
+// Labels with a QR code, a ~Y delay or a ~e read-back stay on the
+// page-mode path.
+
+struct raster {
+    int      w, h, bpr;         // dots, bytes per row
+    uint8_t *bits;              // h rows, MSB = leftmost dot, 1 = black
+    size_t   cap;
+};
+
+static atomic_ulong raster_jobs, raster_fallbacks, raster_frame_hits, raster_bytes;
+
+// Whether slot is in an ESSAE_RASTER_SLOTS list
+static bool raster_slot(const char *list, int slot) {
+    if (!list || !*list) return false;
+    if (!strcmp(list, "all") || !strcmp(list, "*")) return true;
+    for (const char *p = list; *p; ) {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p) {
+            p++;
+            continue;
+        }
+        if (v == slot) return true;
+        p = end;
+    }
+    return false;
+}
+
+// ─── Render context ───────────────────────────────────────────────
+// Everything a label render reads or writes besides the program and the
+// product itself. One per printer port, used under that port's lane, so
+// jobs on different ports render side by side and each port keeps its
+// buffer between jobs. Renderers emit through prn_write(); the bytes
+// collect in buf and go to the O_SYNC port in one write at each flush
+// point (~P, ~Y, ~e, end of job). Hot fields (buffer, tracker) come first.
+
+struct render_context {
+    uint8_t *buf;                       // job output not yet written
+    size_t   len, cap;
+    int      fd;                        // printer fd, -1 = no job open
+    int      barcode_no;                // barcodes[] entry used by ~B (1-based)
+    const struct product *prod;         // product being printed
+    struct prn_images *imgs;            // port's resident images, NULL = off
+    struct prn_macro *macro;            // port's macro, NULL = off
+    struct raster *fb;                  // port's framebuffer, NULL = page mode
+    struct prn_tracker prn;
+    float    lbl_w_mm, lbl_h_mm;        // full label size in mm (last ~S on this port)
+    float    x_off, y_off;              // tune these so x=0 / y=0 line up
+    struct {
+        size_t bytes;                   // bytes sent this job
+        double flush_ms;                // time spent in write()
+        int    flushes;
+        bool   failed;
+    } stats;
+};
+_Static_assert(sizeof(struct render_context) <= 192, "render_context should stay within three cache lines");
+
+static bool ensure_capacity(struct render_context *ctx, size_t more) {
+    if (ctx->len + more > ctx->cap) {
+        size_t newcap = ctx->cap ? ctx->cap * 2 : INITIAL_CAP;
+        while (newcap < ctx->len + more) newcap *= 2;
+        uint8_t *nb = realloc(ctx->buf, newcap);
+        if (!nb) return false;
+        ctx->buf = nb;
+        ctx->cap = newcap;
+    }
+    return true;
+}
+
+static bool buffer_data(struct render_context *ctx, const void *data, size_t len) {
+    if (!ensure_capacity(ctx, len)) return false;
+    memcpy(ctx->buf + ctx->len, data, len);
+    ctx->len += len;
+    return true;
+}
+
+// Send everything buffered so far
+static bool job_flush(struct render_context *ctx) {
+    if (ctx->fd < 0 || ctx->len == 0) return !ctx->stats.failed;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (write_all(ctx->fd, ctx->buf, ctx->len) < 0) {
+        perror("printer write");
+        ctx->stats.failed = true;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    ctx->stats.bytes += ctx->len;
+    ctx->stats.flushes++;
+    ctx->stats.flush_ms += (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    ctx->len = 0;
+    return !ctx->stats.failed;
+}
+
+// Append to the job
+static ssize_t job_emit(struct render_context *ctx, const void *buf, size_t len) {
+    if (!buffer_data(ctx, buf, len)) {
+        // Out of memory: send what we have and write this piece directly
+        job_flush(ctx);
+        return write_all(ctx->fd, buf, len);
+    }
+    return len;
+}
+
+static atomic_ulong prn_bytes_total, prn_suppressed_total;
+
+int printer_stats(char *out, size_t cap) {
+    return snprintf(out, cap, " prn_bytes=%lu prn_suppressed=%lu"
+                    " img_uploads=%lu img_upload_bytes=%lu img_refs=%lu img_resets=%lu"
+                    " macro_defines=%lu macro_runs=%lu macro_saved=%lu"
+                    " raster_jobs=%lu raster_fallbacks=%lu raster_frame_hits=%lu raster_bytes=%lu",
+                    atomic_load(&prn_bytes_total), atomic_load(&prn_suppressed_total),
+                    atomic_load(&prn_img_uploads), atomic_load(&prn_img_upload_bytes),
+                    atomic_load(&prn_img_refs), atomic_load(&prn_img_resets),
+                    atomic_load(&prn_macro_defines), atomic_load(&prn_macro_runs),
+                    atomic_load(&prn_macro_saved),
+                    atomic_load(&raster_jobs), atomic_load(&raster_fallbacks),
+                    atomic_load(&raster_frame_hits), atomic_load(&raster_bytes));
+}
+
+static void prn_state_invalidate(struct prn_tracker *ps) {
+    for (int i = 0; i < PR_NUM; i++) ps->cur[i] = ps->want[i] = -1;
+    ps->win_known = ps->win_pending = ps->win_home = false;
+    ps->pending = ps->home_owed = false;
+    ps->moved = true;
+}
+
+// Same printer and request state (the suppressed count is not state)
+static bool prn_state_same(const struct prn_tracker *a, const struct prn_tracker *b) {
+    return memcmp(a->cur, b->cur, sizeof(a->cur)) == 0 &&
+           memcmp(a->want, b->want, sizeof(a->want)) == 0 &&
+           memcmp(a->win_cur, b->win_cur, sizeof(a->win_cur)) == 0 &&
+           memcmp(a->win_want, b->win_want, sizeof(a->win_want)) == 0 &&
+           a->win_known == b->win_known && a->win_pending == b->win_pending &&
+           a->win_home == b->win_home && a->moved == b->moved &&
+           a->home_owed == b->home_owed && a->pending == b->pending;
+}
+
+// A homing command was dropped (owed = position may have moved) or sent
+static void prn_homed(struct prn_tracker *ps, bool sent) {
+    if (sent) ps->moved = ps->home_owed = false;
+    else if (ps->moved) ps->home_owed = true;
+}
+
+// Send whatever differs from the printer's state, registers before the window
+static void prn_commit(struct render_context *ctx) {
+    struct prn_tracker *ps = &ctx->prn;
+    if (!ps->pending) return;
+    ps->pending = false;
+
+    for (int i = 0; i < PR_NUM; i++) {
+        int16_t v = ps->want[i];
+        if (v < 0) continue;
+        ps->want[i] = -1;
+        bool same = (ps->cur[i] == v);
+        if (same) {
+            ps->suppressed += 3;
+        } else {
+            job_emit(ctx, (uint8_t[]){ prn_reg_cmd[i][0], prn_reg_cmd[i][1], (uint8_t)v }, 3);
+            ps->cur[i] = v;
+        }
+        if (i == PR_ESC_T) prn_homed(ps, !same);
+    }
+
+    if (ps->win_pending) {
+        const uint16_t *w = ps->win_want;
+        bool same = ps->win_known && !ps->win_home &&
+                    memcmp(w, ps->win_cur, sizeof(ps->win_cur)) == 0;
+        if (same) {
+            ps->suppressed += 10;
+        } else {
+            job_emit(ctx, (uint8_t[]){ ESC, 'W', lo(w[0]), hi(w[0]), lo(w[1]), hi(w[1]),
+                                       lo(w[2]), hi(w[2]), lo(w[3]), hi(w[3]) }, 10);
+            memcpy(ps->win_cur, w, sizeof(ps->win_cur));
+            ps->win_known = true;
+        }
+        prn_homed(ps, !same);
+        ps->win_pending = ps->win_home = false;
+    }
+}
+
+// Pay a dropped homing move before printing at the current position
+static void prn_pay_home(struct render_context *ctx) {
+    struct prn_tracker *ps = &ctx->prn;
+    if (!ps->home_owed) return;
+    size_t paid = ps->win_known ? 10 : 3;
+    ps->suppressed -= (ps->suppressed < paid) ? ps->suppressed : paid;
+    if (ps->win_known) {
+        const uint16_t *w = ps->win_cur;
+        job_emit(ctx, (uint8_t[]){ ESC, 'W', lo(w[0]), hi(w[0]), lo(w[1]), hi(w[1]),
+                                   lo(w[2]), hi(w[2]), lo(w[3]), hi(w[3]) }, 10);
+    } else {
+        job_emit(ctx, (uint8_t[]){ ESC, 'T', (uint8_t)ps->cur[PR_ESC_T] }, 3);
+    }
+    prn_homed(ps, true);
+}
+
+// Request a one-byte mode command; untracked commands go straight out
+void prn_set(struct render_context *ctx, uint8_t c0, uint8_t c1, uint8_t n) {
+    struct prn_tracker *ps = &ctx->prn;
+    for (int i = 0; i < PR_NUM; i++) {
+        if (prn_reg_cmd[i][0] == c0 && prn_reg_cmd[i][1] == c1) {
+            if (ps->want[i] >= 0) ps->suppressed += 3;   // overridden before use
+            ps->want[i] = n;
+            ps->pending = true;
+            return;
+        }
+    }
+    prn_write(ctx, (uint8_t[]){ c0, c1, n }, 3);
+}
+
+// Request a page-mode print area. home = the caller prints at the
+// area's start position, so ESC W is sent even if the area is unchanged.
+void prn_window(struct render_context *ctx, int x, int y, int dx, int dy, bool home) {
+    struct prn_tracker *ps = &ctx->prn;
+    if (ps->win_pending) ps->suppressed += 10;
+    ps->win_want[0] = x;  ps->win_want[1] = y;
+    ps->win_want[2] = dx; ps->win_want[3] = dy;
+    ps->win_pending = true;
+    ps->win_home |= home;
+    ps->pending = true;
+}
+
+// Raw bytes that reset or change printer state in ways we do not model
+void prn_write_opaque(struct render_context *ctx, const void *buf, size_t len) {
+    prn_write(ctx, buf, len);
+    prn_state_invalidate(&ctx->prn);
+}
+
+static void job_begin(struct render_context *ctx, int fd, const struct product *prod,
+                      int barcode_no) {
+    ctx->fd = fd;
+    ctx->len = 0;
+    ctx->prod = prod;
+    ctx->barcode_no = barcode_no;   // label size carries over, as for a label without ~S
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    prn_state_invalidate(&ctx->prn);
+    ctx->prn.suppressed = 0;
+}
+
+// Flush the tail and stop buffering; false if any write failed
+static bool job_end(struct render_context *ctx) {
+    prn_commit(ctx);            // leave the printer in the state the label asked for
+    bool ok = job_flush(ctx);
+    atomic_fetch_add(&prn_bytes_total, ctx->stats.bytes);
+    atomic_fetch_add(&prn_suppressed_total, ctx->prn.suppressed);
+    ctx->fd = -1;
+    ctx->prod = NULL;
+    if (ctx->cap > 4 * INITIAL_CAP) {   // don't pin a huge image buffer per port
+        free(ctx->buf);
+        ctx->buf = NULL;
+        ctx->cap = 0;
+    }
+    return ok;
+}
+
+ssize_t prn_write(struct render_context *ctx, const void *buf, size_t len) {
+    prn_commit(ctx);
+    prn_pay_home(ctx);
+    ctx->prn.moved = true;
+    return job_emit(ctx, buf, len);
+}
+
+ssize_t prn_write_fixed(struct render_context *ctx, const void *buf, size_t len) {
+    prn_commit(ctx);
+    return job_emit(ctx, buf, len);
+}
+
+ssize_t prn_position(struct render_context *ctx, const void *buf, size_t len) {
+    prn_commit(ctx);
+    ctx->prn.home_owed = false;         // both axes are set explicitly
+    ctx->prn.moved = true;
+    return job_emit(ctx, buf, len);
+}
+
 // Read a line (up to '\n') from socket
 ssize_t read_line(int fd, char *buf, size_t maxlen) {
     size_t i = 0;
@@ -204,833 +604,1857 @@ int setup_server_socket(int port) {
         close(sfd);
         exit(1);
     }
-    if (listen(sfd, 5) < 0) {
+    if (listen(sfd, LISTEN_BACKLOG) < 0) {
         perror("listen");
         close(sfd);
         exit(1);
     }
+    // The event loop drains accept() until EAGAIN
+    fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
     return sfd;
 }
 
-static void *client_thread(void *arg) {
-    int client_fd = *(int *)arg;
-    free(arg);
-
-    handle_client(client_fd);
+// ─── Worker pool ──────────────────────────────────────────────────
+// Blocking device work (scale round trips, label printing) runs on a
+// small fixed set of threads so the event loop never waits on a port.
+
+struct pool_task {
+    void (*run)(struct pool_task *task);
+    struct pool_task *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    struct pool_task *head, *tail;
+    unsigned depth;             // tasks waiting for a worker
+    unsigned depth_peak;
+    unsigned long tasks_run;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void pool_submit(struct pool_task *task) {
+    task->next = NULL;
+    pthread_mutex_lock(&pool.lock);
+    if (pool.tail) pool.tail->next = task;
+    else           pool.head = task;
+    pool.tail = task;
+    if (++pool.depth > pool.depth_peak) pool.depth_peak = pool.depth;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
 
+static void *pool_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.head)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        struct pool_task *task = pool.head;
+        pool.head = task->next;
+        if (!pool.head) pool.tail = NULL;
+        pool.depth--;
+        pool.tasks_run++;
+        pthread_mutex_unlock(&pool.lock);
+
+        task->run(task);
+    }
     return NULL;
 }
 
-// Revised handle_client() that also handles printer mode
-void handle_client(int client_fd) {
-    char buf[BUFFER_SIZE];
-    ssize_t cnt;
-
-    while ((cnt = recv(client_fd, buf, sizeof(buf) - 1, 0)) > 0) {
-        buf[cnt] = '\0';
-        pthread_mutex_lock(&weight_mutex);
-
-        char *saveptr = NULL;
-        char *line = strtok_r(buf, "\n", &saveptr);
-        while (line) {
-            char *cmd = trim_whitespace(line);
-            if (cmd[0] == '\0') {
-                line = strtok_r(NULL, "\n", &saveptr);
-                continue;
-            }
+static void pool_start(int nthreads) {
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, pool_worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+}
 
-            if (strcmp(cmd, "MODE:PRINTER") == 0) {
-                char *json_path = strtok_r(NULL, "\n", &saveptr);
-                char *slot_str  = strtok_r(NULL, "\n", &saveptr);
-                char *sel_id    = strtok_r(NULL, "\n", &saveptr);
+// ─── Execution lanes ──────────────────────────────────────────────
+// One serialized lane per device: the scale and each printer port.
+// A lane runs its jobs one at a time on a pool worker, so a slow label
+// print only ever delays other prints, never weight reads.
+
+struct lane_job {
+    void (*run)(struct lane_job *job);
+    struct lane_job *next;
+};
+
+struct exec_lane {
+    struct pool_task task;              // must stay first (drains the lane)
+    const char *name;
+    pthread_mutex_t lock;               // guards the queue below
+    struct lane_job *head, *tail;
+    bool running;                       // a worker is draining this lane
+    unsigned depth, depth_peak;
+    unsigned long jobs_run;
+    pthread_mutex_t io_lock;            // held while the lane's device is in use
+};
+
+static void lane_task(struct pool_task *task);
+
+#define LANE_INIT(label) {                                         \
+    .task = { .run = lane_task }, .name = (label),                 \
+    .lock = PTHREAD_MUTEX_INITIALIZER,                             \
+    .io_lock = PTHREAD_MUTEX_INITIALIZER }
+
+static struct exec_lane scale_lane = LANE_INIT("scale");
+static struct exec_lane catalog_lane = LANE_INIT("catalog");  // product master loads/imports
+
+static struct printer_port {
+    const char *path;
+    struct exec_lane lane;
+    // Session kept open across jobs; only touched under lane.io_lock
+    int    fd;                  // -1 = closed, reopened by the next job
+    dev_t  rdev;                // device the fd was opened on (unplug check)
+    bool   state_known;         // last job left the printer in standard mode
+    unsigned long opens;
+    struct prn_images images;   // resident ~d images (budget 0 = off)
+    struct prn_macro macro;     // static segment held as the printer's macro
+    const char *raster_slots;   // ESSAE_RASTER_SLOTS, NULL = none
+    struct raster raster;       // framebuffer of rastered jobs
+    struct render_context ctx;  // render state of this port's jobs
+} printer_ports[] = {
+    { .path = PRINTER_PORT, .lane = LANE_INIT("printer0"), .fd = -1, .ctx.fd = -1 },
+};
+#define NUM_PRINTER_PORTS (int)(sizeof(printer_ports) / sizeof(printer_ports[0]))
+
+static void lane_submit(struct exec_lane *lane, struct lane_job *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&lane->lock);
+    if (lane->tail) lane->tail->next = job;
+    else            lane->head = job;
+    lane->tail = job;
+    if (++lane->depth > lane->depth_peak) lane->depth_peak = lane->depth;
+    bool start = !lane->running;
+    lane->running = true;
+    pthread_mutex_unlock(&lane->lock);
+
+    if (start) pool_submit(&lane->task);
+}
 
-                if (json_path && slot_str && sel_id) {
-                    json_path = trim_whitespace(json_path);
-                    slot_str  = trim_whitespace(slot_str);
-                    gui_data_id = atoi(trim_whitespace(sel_id));
+static void lane_task(struct pool_task *task) {
+    struct exec_lane *lane = (struct exec_lane *)task;
 
-                    int rc = convert_label(json_path, slot_str);
-                    write_all(client_fd, rc == 0 ? "OK\n" : "Error printing\n",
-                              rc == 0 ? 3 : 15);
-                } else {
-                    write_all(client_fd, "Error: printer args missing\n", 28);
-                }
-                break;  // End of MODE:PRINTER block
-            } else {
-                process_weight_line(client_fd, cmd);
-            }
+    pthread_mutex_lock(&lane->lock);
+    while (lane->head) {
+        struct lane_job *job = lane->head;
+        lane->head = job->next;
+        if (!lane->head) lane->tail = NULL;
+        lane->depth--;
+        pthread_mutex_unlock(&lane->lock);
 
-            line = strtok_r(NULL, "\n", &saveptr);
-        }
+        pthread_mutex_lock(&lane->io_lock);
+        job->run(job);
+        pthread_mutex_unlock(&lane->io_lock);
 
-        pthread_mutex_unlock(&weight_mutex);
+        pthread_mutex_lock(&lane->lock);
+        lane->jobs_run++;
     }
+    lane->running = false;
+    pthread_mutex_unlock(&lane->lock);
+}
 
-    close(client_fd);
+static int lane_stats(struct exec_lane *lane, char *out, size_t cap) {
+    pthread_mutex_lock(&lane->lock);
+    int n = snprintf(out, cap, " lane_%s=%u/%u/%lu",
+                     lane->name, lane->depth, lane->depth_peak, lane->jobs_run);
+    pthread_mutex_unlock(&lane->lock);
+    return n;
 }
 
+// ─── Client connections ───────────────────────────────────────────
+// The event loop owns the socket and splits input into lines; complete
+// lines are handed to one worker at a time, so replies keep their order.
+// Device commands park the connection on a lane until the job is done.
+
+struct client_conn {
+    struct pool_task task;              // must stay first (pool queue link)
+    int    fd;
+    pthread_mutex_t lock;               // guards pending/plen/busy/hangup
+    char   rbuf[BUFFER_SIZE];           // partial line (event loop only)
+    size_t rlen;
+    char   pending[2 * BUFFER_SIZE];    // complete lines for the worker
+    size_t plen;
+    char   work[2 * BUFFER_SIZE + 1];   // lines being run (worker only)
+    size_t wpos, wlen;
+    bool   busy;                        // queued, running or parked on a lane
+    bool   hangup;                      // peer closed; free once idle
+    bool   in_printer;                  // collecting MODE:PRINTER / PRINT_PLU args
+    bool   printer_plu;                 // first arg is a PLU, not a json path
+    int    printer_argc;
+    char   printer_args[3][MAX_PATH];   // json path or PLU, slot, barcode number
+    int    plu_cmd;                     // next line is the file for MODE:PLU_LOAD/IMPORT/UPDATE
+    struct lane_job job;                // the device command in flight
+    const char *cmd;                    // scale command (points into work)
+    // MODE:WEIGHT_STREAM subscription; frames are pushed by the sampler
+    bool   in_stream_setup;             // next line is the stream spec
+    bool   streaming;
+    int    stream_kind;
+    int    stream_interval_ms;          // 0 = every sample
+    bool   stream_on_change;            // push only when the reading changes
+    long long stream_last_ms;
+    char   stream_last[128];            // last frame pushed (change detection)
+    char   stream_tail[512];            // unsent bytes, flushed on EPOLLOUT
+    size_t stream_tail_len;             // guarded by stream_lock
+    struct client_conn *stream_next;
+};
+
+static int listen_fd = -1;
+static int event_ep = -1;               // epoll set of the event loop
+
+static struct {
+    pthread_mutex_t lock;
+    unsigned long accepted;
+    unsigned long rejected;             // refused because of MAX_CLIENTS
+    unsigned long accept_errors;
+    unsigned active;
+    unsigned active_peak;
+    unsigned accept_queue_peak;         // deepest kernel accept queue seen
+} srv_stats = { PTHREAD_MUTEX_INITIALIZER };
+
+// Current and maximum length of the listen socket's accept queue
+static void accept_queue_depth(unsigned *qlen, unsigned *qmax) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    *qlen = *qmax = 0;
+    if (getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0) {
+        *qlen = ti.tcpi_unacked;        // listen sockets: queued connections
+        *qmax = ti.tcpi_sacked;         // listen sockets: backlog
+    }
+}
 
+// snprintf returns the untruncated length; keep the running offset inside out[]
+static int stats_clamp(int n, size_t cap) {
+    return n < (int)cap ? n : (int)cap - 1;
+}
 
-// Handle exactly one command (no trailing newline), including MODE header.
-void process_weight_line(int client_fd, const char *cmd) {
-    char response[BUFFER_SIZE] = {0};
-    unsigned char c;
+static void send_server_stats(int fd) {
+    char out[1024];
+    unsigned qlen, qmax;
+    accept_queue_depth(&qlen, &qmax);
+
+    pthread_mutex_lock(&pool.lock);
+    unsigned depth = pool.depth, depth_peak = pool.depth_peak;
+    unsigned long tasks_run = pool.tasks_run;
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_lock(&srv_stats.lock);
+    int n = snprintf(out, sizeof(out),
+        "OK:STATS clients=%u/%d peak=%u accepted=%lu rejected=%lu accept_errors=%lu"
+        " accept_queue=%u/%u accept_queue_peak=%u"
+        " workers=%d work_queue=%u work_queue_peak=%u tasks=%lu",
+        srv_stats.active, MAX_CLIENTS, srv_stats.active_peak,
+        srv_stats.accepted, srv_stats.rejected, srv_stats.accept_errors,
+        qlen, qmax, srv_stats.accept_queue_peak,
+        WORKER_THREADS, depth, depth_peak, tasks_run);
+    pthread_mutex_unlock(&srv_stats.lock);
+
+    n = stats_clamp(n, sizeof(out));
+
+    int (*const parts[])(char *, size_t) = {
+        stream_stats, scale_rx_stats, printer_stats, lft_cache_stats, plu_stats,
+    };
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+        n = stats_clamp(n + parts[i](out + n, sizeof(out) - n), sizeof(out));
+
+    // Per lane: queued/peak/jobs run
+    n = stats_clamp(n + lane_stats(&scale_lane, out + n, sizeof(out) - n), sizeof(out));
+    n = stats_clamp(n + lane_stats(&catalog_lane, out + n, sizeof(out) - n), sizeof(out));
+    for (int i = 0; i < NUM_PRINTER_PORTS; i++)
+        n = stats_clamp(n + lane_stats(&printer_ports[i].lane, out + n, sizeof(out) - n),
+                        sizeof(out));
+    if (n > (int)sizeof(out) - 2) n = sizeof(out) - 2;
+    out[n++] = '\n';
+
+    write_all(fd, out, n);
+}
 
-    // 1) MODE header: drop or ACK
-    if (strcmp(cmd, "MODE:WEIGHT") == 0) {
-        const char *ack = "OK:WEIGHT\n";
-        write_all(client_fd, ack, strlen(ack));
-        return;
-    }
+static void conn_release(struct client_conn *c) {
+    if (c->streaming)
+        stream_unsubscribe(c);
+    if (c->in_printer)
+        write_all(c->fd, "Error: printer args missing\n", 28);
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+
+    pthread_mutex_lock(&srv_stats.lock);
+    srv_stats.active--;
+    pthread_mutex_unlock(&srv_stats.lock);
+}
 
-    // 2) Real scale commands
-    if (strcmp(cmd, "RD_WEIGHT") == 0) {
-        c = 0x05;
-        write(weight_fd, &c, 1);
-        usleep(200000);
-        int r = read(weight_fd, response, sizeof(response) - 1);
-        if (r <= 0) {
-            strcpy(response, "Error: No response from weight machine.");
+// Worker side: run queued lines until the connection has none left.
+// Returns early while a device job is parked on a lane; the lane
+// resubmits the connection when the job finishes.
+static void client_task(struct pool_task *task) {
+    struct client_conn *c = (struct client_conn *)task;
+
+    for (;;) {
+        if (c->wpos >= c->wlen) {
+            pthread_mutex_lock(&c->lock);
+            if (c->plen == 0) {
+                bool done = c->hangup;
+                c->busy = false;
+                pthread_mutex_unlock(&c->lock);
+                if (done) conn_release(c);
+                return;
+            }
+            memcpy(c->work, c->pending, c->plen);
+            c->work[c->plen] = '\0';
+            c->wpos = 0;
+            c->wlen = c->plen;
+            c->plen = 0;
+            pthread_mutex_unlock(&c->lock);
         }
+        if (handle_client(c)) return;
     }
-    else if (strcmp(cmd, "XC_TARE") == 0) {
-        unsigned char tcmds[2] = {'T','t'};
-        write(weight_fd, tcmds, 2);
-        strcpy(response, "XC_TARE: Tare command sent.");
+}
+
+// Event-loop side: move complete lines from rbuf to the worker queue.
+// A full buffer without a newline, or leftovers at hangup, count as a line.
+static void queue_lines(struct client_conn *c, bool final) {
+    size_t take = 0;
+    for (size_t i = c->rlen; i > 0; i--) {
+        if (c->rbuf[i - 1] == '\n') { take = i; break; }
     }
-    else if (strcmp(cmd, "XC_REZERO") == 0) {
-        c = 0x10; write(weight_fd, &c, 1);
-        strcpy(response, "XC_REZERO sent.");
+    if (take == 0 && c->rlen > 0 && (final || c->rlen == sizeof(c->rbuf)))
+        take = c->rlen;
+    if (take == 0) return;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->plen + take + 1 <= sizeof(c->pending)) {
+        memcpy(c->pending + c->plen, c->rbuf, take);
+        c->plen += take;
+        if (c->rbuf[take - 1] != '\n') c->pending[c->plen++] = '\n';
+    } else {
+        write_all(c->fd, "Error: too many queued commands\n", 32);
     }
-    else if (strcmp(cmd, "XC_SON") == 0) {
-        c = 0x12; write(weight_fd, &c, 1);
-        strcpy(response, "XC_SON: Calibration start.");
+    if (c->plen > 0 && !c->busy) {
+        c->busy = true;
+        pool_submit(&c->task);
     }
-    else if (strncmp(cmd, "XC_KEYCAL", 9) == 0) {
-        c = 0x13; write(weight_fd, &c, 1);
-        int payload_len = strlen(cmd) - 9;
-        if (payload_len > 0) {
-            write(weight_fd, cmd + 9, payload_len);
+    pthread_mutex_unlock(&c->lock);
+
+    memmove(c->rbuf, c->rbuf + take, c->rlen - take);
+    c->rlen -= take;
+}
+
+static void conn_readable(int ep, struct client_conn *c) {
+    bool eof = false;
+    for (;;) {
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+        if (n > 0) {
+            c->rlen += n;
+            queue_lines(c, false);
+            continue;
         }
-        strcpy(response, "XC_KEYCAL sent with weight payload.");
-    }
-    else if (strcmp(cmd, "XC_CALZERO") == 0) {
-        c = 0x14; write(weight_fd, &c, 1);
-        strcpy(response, "XC_CALZERO: Zero point set.");
-    }
-    else if (strcmp(cmd, "XC_CALSPAN") == 0) {
-        c = 0x15; write(weight_fd, &c, 1);
-        strcpy(response, "XC_CALSPAN: Span set.");
-    }
-    else if (strcmp(cmd, "XC_CALIBRATE") == 0) {
-        c = 0x16; write(weight_fd, &c, 1);
-        strcpy(response, "XC_CALIBRATE: Calibration finalize.");
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) eof = true;
+        break;
     }
-    else if (strcmp(cmd, "XC_RDRAWCT") == 0) {
-        c = 0x11; write(weight_fd, &c, 1);
-        usleep(200000);
-        int r = read(weight_fd, response, sizeof(response) - 1);
-        if (r <= 0) {
-            strcpy(response, "Error: No raw data response.");
+    if (!eof) return;
+
+    queue_lines(c, true);
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+
+    pthread_mutex_lock(&c->lock);
+    c->hangup = true;
+    bool idle = !c->busy;
+    pthread_mutex_unlock(&c->lock);
+    if (idle) conn_release(c);
+}
+
+static void accept_clients(int ep) {
+    unsigned qlen, qmax;
+    accept_queue_depth(&qlen, &qmax);
+    pthread_mutex_lock(&srv_stats.lock);
+    if (qlen > srv_stats.accept_queue_peak) srv_stats.accept_queue_peak = qlen;
+    pthread_mutex_unlock(&srv_stats.lock);
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+                pthread_mutex_lock(&srv_stats.lock);
+                srv_stats.accept_errors++;
+                pthread_mutex_unlock(&srv_stats.lock);
+            }
+            return;
         }
-    }
-    else if (strcmp(cmd, "XC_LOAD_DEFAULTS") == 0) {
-        c = 0x17; write(weight_fd, &c, 1);
-        strcpy(response, "XC_LOAD_DEFAULTS sent.");
-    }
-    else if (strcmp(cmd, "WR_TECHSPEC") == 0) {
-    c = 0x18; 
-    write(weight_fd, &c, 1);
-    strcpy(response, "WR_TECHSPEC sent.");
-  }
-   else if (strcmp(cmd, "WR_CUSSPEC") == 0) {
-    c = 0x1A; 
-    write(weight_fd, &c, 1);
-    strcpy(response, "WR_CUSSPEC sent.");
- }
-   else if (strcmp(cmd, "RD_CUSSPEC") == 0) {
-        unsigned char c = 0x1B;
-        write(weight_fd, &c, 1);
-        usleep(200000);
 
-        int r = read(weight_fd, response, sizeof(response) - 1);
-        if (r <= 0) {
-            strcpy(response, "Error: no data from scale");
+        pthread_mutex_lock(&srv_stats.lock);
+        bool full = srv_stats.active >= MAX_CLIENTS;
+        if (full) {
+            srv_stats.rejected++;
         } else {
-            response[r] = '\0';
+            srv_stats.accepted++;
+            if (++srv_stats.active > srv_stats.active_peak)
+                srv_stats.active_peak = srv_stats.active;
         }
-    }
-    else if (strcmp(cmd, "RD_TECHSPEC") == 0) {
-        unsigned char c = 0x19;
-        write(weight_fd, &c, 1);
-        usleep(200000);
+        pthread_mutex_unlock(&srv_stats.lock);
 
-        // Read whatever ASCII the scale sends (e.g. "03 05 03 00 ...\r\n")
-        int r = read(weight_fd, response, sizeof(response) - 1);
-        if (r <= 0) {
-            strcpy(response, "Error: no data from scale");
-        } else {
-            // Just null-terminate the ASCII string exactly as received:
-            response[r] = '\0';
+        if (full) {
+            write_all(fd, "Error: server busy\n", 19);
+            close(fd);
+            continue;
+        }
+
+        struct client_conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            perror("calloc");
+            close(fd);
+            pthread_mutex_lock(&srv_stats.lock);
+            srv_stats.active--;
+            pthread_mutex_unlock(&srv_stats.lock);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        c->fd = fd;
+        c->task.run = client_task;
+        pthread_mutex_init(&c->lock, NULL);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            conn_release(c);
         }
     }
+}
 
-    else if (strcmp(cmd, "XC_RESTART") == 0) {
-        c = 0x1C; write(weight_fd, &c, 1);
-        strcpy(response, "XC_RESTART sent.");
+// Single thread owning the listen socket and every client socket
+static void run_event_loop(int server_fd) {
+    listen_fd = server_fd;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        perror("epoll_create1");
+        exit(1);
     }
-    else {
-        strcpy(response, "Error: Unknown command");
+    event_ep = ep;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };  // NULL = listener
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
     }
 
-    // 3) Send response back
-    write_all(client_fd, response, strlen(response));
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(ep, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            struct client_conn *c = events[i].data.ptr;
+            if (!c) {
+                accept_clients(ep);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) stream_writable(c);
+            if (events[i].events & ~EPOLLOUT) conn_readable(ep, c);
+        }
+    }
 }
 
+// Lane jobs: run the device command, then let the connection continue
+static void print_job(struct lane_job *job) {
+    struct client_conn *conn = (struct client_conn *)
+        ((char *)job - offsetof(struct client_conn, job));
+
+    int barcode_no = atoi(conn->printer_args[2]);
+    int rc = conn->printer_plu
+        ? print_plu(strtol(conn->printer_args[0], NULL, 10), conn->printer_args[1],
+                    barcode_no, &printer_ports[0])
+        : convert_label(conn->printer_args[0], conn->printer_args[1], barcode_no,
+                        &printer_ports[0]);
+    write_all(conn->fd, rc == 0 ? "OK\n" : "Error printing\n",
+              rc == 0 ? 3 : 15);
+    pool_submit(&conn->task);
+}
 
-// --- Live data globals (with Data ID and Description) ---
-
-// Group 1–15: PLU & Basic Info
-static int    plu_id              = 0;   // 1  – PLU No (Unique product number)
-static char   plu_name[64]        = ""; // 2  – PLU Name (Product name)
-static char   plu_code[32]        = ""; // 3  – PLU Code (Internal product code)
-// static char   guom[8]             = ""; // 4  – GUOM (Unit) (General Unit of Measure)
-// static double unit_price          = 0.0; // 5  – Unit Price (Normal unit rate)
-// static char   spl_up[32]          = ""; // 6  – Special Unit Price (Promotional price)
-static int    quantity            = 0;   // 7  – Quantity (Number of units)
-static double tare_wt             = 0.0; // 8  – Tare Weight (Packaging weight)
-static double fixed_price         = 0.0; // 9  – Fixed Price (Any fixed price override)
-static char   packed_date[16]     = ""; // 10 – Packed Date (Packaging date string)
-static char   packed_time[16]     = ""; // 11 – Packed Time (Packaging time string)
-static char   sellby_date[16]     = ""; // 12 – Sell By Date (Recommended sell-before date)
-static char   sellby_time[16]     = ""; // 13 – Sell By Time (Recommended sell-before time)
-static char   useby_date[16]      = ""; // 14 – Use By Date (Expiry date)
-static char   useby_time[16]      = ""; // 15 – Use By Time (Expiry time)
-
-// Group 16–40: Classification & Header/Footer
-static double plu_minimum         = 0.0; // 16 – PLU Minimum (Minimum stock/weight)
-static double plu_target          = 0.0; // 17 – PLU Target (Target stock/weight)
-static double plu_maximum         = 0.0; // 18 – PLU Maximum (Maximum stock/weight)
-static int    group_no            = 0;   // 19 – Group No (Product group ID)
-static char   group_name[64]      = ""; // 20 – Group Name (Product group name)
-static int    department_no       = 0;   // 21 – Department No (Department ID)
-static char   department_name[64] = ""; // 22 – Department Name (Department label)
-static int    tax_no              = 0;   // 23 – Tax No (Tax scheme ID)
-static char   tax_name[64]        = ""; // 24 – Tax Name (Tax label, e.g. GST)
-static char   tax_type[32]        = ""; // 25 – Tax Type (Inclusive/Exclusive)
-static double tax_rate            = 0.0; // 26 – Tax Rate (Percentage)
-static int    operator_no         = 0;   // 27 – Operator No (User/operator ID)
-static char   operator_name[64]   = ""; // 28 – Operator Name (User/operator name)
-static char   operator_password[32] = ""; // 29 – Operator Password (Not displayed)
-
-static char   header1[64]         = ""; // 30 – Header1 (Custom header line 1)
-static char   header2[64]         = ""; // 31 – Header2 (Custom header line 2)
-static char   header3[64]         = ""; // 32 – Header3 (Custom header line 3)
-static char   header4[64]         = ""; // 33 – Header4 (Custom header line 4)
-static char   header5[64]         = ""; // 34 – Header5 (Custom header line 5)
-static char   footer1[64]         = ""; // 35 – Footer1 (Custom footer line 1)
-static char   footer2[64]         = ""; // 36 – Footer2 (Custom footer line 2)
-static char   footer3[64]         = ""; // 37 – Footer3 (Custom footer line 3)
-static char   footer4[64]         = ""; // 38 – Footer4 (Custom footer line 4)
-static char   footer5[64]         = ""; // 39 – Footer5 (Custom footer line 5)
-static int    discount_no         = 0;   // 40 – Discount No (Applied discount ID)
-
-// Group 41–60: Promotion, Packaging, Barcode, Discount Info
-static char   discount_name[64]   = ""; // 41 – Discount Name (Discount description)
-static char   discount_type[16]   = ""; // 42 – Discount Type (Flat or Percentage)
-static double discount_first_target  = 0.0; // 43 – Discount First Target (Threshold)
-static double discount_first_value   = 0.0; // 44 – Discount First Value (Amount)
-static double discount_second_target = 0.0; // 45 – Discount Second Target (Threshold)
-static double discount_second_value  = 0.0; // 46 – Discount Second Value (Amount)
-static char   discount_days[32]   = ""; // 47 – Discount Days (Applicable days)
-static char   discount_start[32]  = ""; // 48 – Discount Start (Begin time/date)
-static char   discount_end[32]    = ""; // 49 – Discount End (End time/date)
-static char   package_type[32]    = ""; // 50 – Package Type (Packaging style)
-static char   tare_name[64]       = ""; // 51 – Tare Name (Container name)
-static double tare_value          = 0.0; // 52 – Tare Value (Container weight)
-static char   storage_temp[32]    = ""; // 53 – Storage Temperature (Recommended storage)
-static char   barcode_name[64]    = ""; // 54 – Barcode Name (Label name)
-static char   barcode_type[32]    = ""; // 55 – Barcode Type (EAN13, CODE128, etc.)
-static char   barcode_data[64]    = ""; // 56 – Barcode Data (Encoded string)
-static char   bc_field1[32]       = ""; // 57 – BC Field1 (Barcode field 1 value)
-static char   bc_field1_con[32]   = ""; // 58 – BC Field1 Concat (Concatenation rule)
-static char   bc_field1_shift[32] = ""; // 59 – BC Field1 Shift (Shift rule)
-static char   bc_field2[32]       = ""; // 60 – BC Field2 (Barcode field 2 value)
-
-// Group 61–80: Ingredients, Label, Image, Billing
-static char   bc_field2_con[32]   = ""; // 61 – BC Field2 Condition (Condition rule)
-static char   bc_field2_shift[32] = ""; // 62 – BC Field2 Shift (Shift rule)
-static int    ingredient_no       = 0;   // 63 – Ingredient No (Ingredient ID)
-static char   ingredient_name[64] = ""; // 64 – Ingredient Name (Description)
-static char   ingredients_text[512] = ""; // 65 – Ingredients Text (List)
-static int    message_no          = 0;   // 66 – Message No (Message ID)
-static char   message_name[64]    = ""; // 67 – Message Name (Title)
-static char   message_text[512]   = ""; // 68 – Message Text (Content)
-static double current_net_weight  = 0.0; // 69 – Current Net Weight (Net weight)
-static double current_tare_weight = 0.0; // 70 – Current Tare Weight (Tare weight)
-static double current_gross_weight= 0.0; // 71 – Current Gross Weight (Gross weight)
-static double weight_or_quantity  = 0.0; // 72 – Weight or Quantity (Auto choose)
-// static double actual_unit_price   = 0.0; // 73 – Actual Unit Price (Final rate)
-static int    image_no            = 0;   // 74 – Image No (Image reference)
-static char   image_file_name[32] = ""; // 75 – Image File Name (Filename)
-static char   label_date_time[32] = ""; // 76 – Label DateTime (Timestamp)
-static int    label_design_no     = 0;   // 77 – Label Design No (Template ID)
-static char   label_file_name[32] = ""; // 78 – Label File Name (Filename)
-static int    bill_no              = 0;   // 79 – Bill No (Transaction ID)
-static char   scale_no[32]         = ""; // 80 – Scale No (Scale ID)
-
-// Group 81–96: Final Totals, Output Info
-static char   scale_name[64]      = ""; // 81 – Scale Name (Model name)
-static double scale_capacity      = 0.0; // 82 – Scale Capacity (Max weight)
-static double scale_accuracy      = 0.0; // 83 – Scale Accuracy (Precision)
-static char   current_datetime[32]= ""; // 84 – Current DateTime (Timestamp)
-static int    no_of_items         = 0;   // 85 – No of Items (Item count)
-static double total_amount        = 0.0; // 86 – Total Amount (Sum amount)
-static double total_quantity      = 0.0; // 87 – Total Quantity (Sum units)
-static double total_weight        = 0.0; // 88 – Total Weight (Sum weight)
-static double total_qty_or_weight = 0.0; // 89 – Total Qty/Weight (Best fit)
-static double total_tax           = 0.0; // 90 – Total Tax (Tax amount)
-static double total_discount      = 0.0; // 91 – Total Discount (Discount amount)
-static int    today_bill_no        = 0;   // 92 – Today Bill No (Daily bill count)
-static double total_price         = 0.0; // 93 – Total Price (Net price)
-// static char   uom[8]              = ""; // 94 – Unit of Measure (e.g. KG, PCS)
-static char   barcode_flag[32]    = ""; // 95 – Barcode Flag (Encoded flag)
-static char   bill_text[128]      = ""; // 96 – Bill Text (Payment note)
-
-
-// ─── Helper Prototypes ───────────────────────────────────────
-static void LoadJSONBarcodeRecord(int bcnum,
-    char *out_data,
-    char *out_type,
-    char *out_name,
-    char *out_fld1,   char *out_cond1,   char *out_shift1,
-    char *out_fld2,   char *out_cond2,   char *out_shift2);
-
-// ─── LoadJSONBarcodeRecord ───────────────────────────────────
-static void LoadJSONBarcodeRecord(int bcnum,
-    char *out_data,
-    char *out_type,
-    char *out_name,
-    char *out_fld1,   char *out_cond1,   char *out_shift1,
-    char *out_fld2,   char *out_cond2,   char *out_shift2)
-{
-    struct json_object *arr = NULL, *entry = NULL, *val = NULL;
-    if (!( json_root
-         && json_object_object_get_ex(json_root, "barcodes", &arr)
-         && json_object_get_type(arr)==json_type_array ))
-        return;
+static void scale_job(struct lane_job *job) {
+    struct client_conn *conn = (struct client_conn *)
+        ((char *)job - offsetof(struct client_conn, job));
 
-    int n = json_object_array_length(arr);
-    for (int i = 0; i < n; i++) {
-        entry = json_object_array_get_idx(arr, i);
-        if (!entry) continue;
-        if (json_object_object_get_ex(entry, "barcode_number", &val)
-         && json_object_get_int(val) == bcnum)
-        {
-            #define GET_STR(k,b,s) \
-              do { \
-                if (json_object_object_get_ex(entry, k, &val) \
-                 && json_object_get_type(val)==json_type_string) \
-                  strncpy(b, json_object_get_string(val), (s)-1), b[(s)-1]='\0'; \
-              } while(0)
-
-            GET_STR("barcode_data",   out_data,   64);
-            GET_STR("barcode_type",   out_type,   16);
-            GET_STR("barcode_name",   out_name,   16);
-            GET_STR("barcode_fld1",   out_fld1,   16);
-            GET_STR("fld1_condition", out_cond1,   8);
-            GET_STR("fld1_shift",     out_shift1,  4);
-            GET_STR("barcode_fld2",   out_fld2,   16);
-            GET_STR("fld2_condition", out_cond2,   8);
-            GET_STR("fld2_shift",     out_shift2,  4);
-
-            #undef GET_STR
-            break;
+    process_weight_line(conn->fd, conn->cmd);
+    pool_submit(&conn->task);
+}
+
+enum { PLU_CMD_NONE, PLU_CMD_LOAD, PLU_CMD_IMPORT, PLU_CMD_UPDATE };
+
+// MODE:PLU_LOAD replaces the product master from a JSON file (or from
+// the plu_master table when the source line is DB); MODE:PLU_IMPORT
+// stores a JSON or CSV catalog in the database and makes it live;
+// MODE:PLU_UPDATE adds or replaces single records
+static void catalog_job(struct lane_job *job) {
+    struct client_conn *conn = (struct client_conn *)
+        ((char *)job - offsetof(struct client_conn, job));
+    char reply[MAX_PATH + 64];
+    int len;
+
+    if (conn->plu_cmd == PLU_CMD_IMPORT) {
+        plu_import(conn->cmd, reply, sizeof(reply));
+        len = strlen(reply);
+    } else if (conn->plu_cmd == PLU_CMD_UPDATE) {
+        plu_update(conn->cmd, reply, sizeof(reply));
+        len = strlen(reply);
+    } else {
+        long n = strcmp(conn->cmd, "DB") == 0 ? plu_load_db() : plu_load_json(conn->cmd);
+        len = n >= 0 ? snprintf(reply, sizeof(reply), "OK:PLU_LOADED %ld\n", n)
+                     : snprintf(reply, sizeof(reply), "Error: product master not loaded\n");
+    }
+    conn->plu_cmd = PLU_CMD_NONE;
+    write_all(conn->fd, reply, len);
+    pool_submit(&conn->task);
+}
+
+// Run the complete lines received on a connection (worker thread).
+// Returns true when a command was handed to a device lane.
+bool handle_client(struct client_conn *conn) {
+    while (conn->wpos < conn->wlen) {
+        char *line = conn->work + conn->wpos;
+        char *nl = strchr(line, '\n');
+        if (nl) *nl = '\0';
+        conn->wpos = nl ? (size_t)(nl + 1 - conn->work) : conn->wlen;
+
+        char *cmd = trim_whitespace(line);
+        if (cmd[0] == '\0') continue;
+
+        if (conn->in_stream_setup) {
+            conn->in_stream_setup = false;
+            stream_subscribe(conn, cmd);
+            continue;
+        }
+        if (conn->streaming) {
+            stream_command(conn, cmd);
+            continue;
+        }
+        if (conn->plu_cmd != PLU_CMD_NONE) {
+            conn->cmd = cmd;
+            conn->job.run = catalog_job;
+            lane_submit(&catalog_lane, &conn->job);
+            return true;
+        }
+
+        // The three lines after MODE:PRINTER are json path, slot and barcode
+        // number; after MODE:PRINT_PLU they are PLU, slot and barcode number
+        if (conn->in_printer) {
+            snprintf(conn->printer_args[conn->printer_argc], MAX_PATH, "%s", cmd);
+            if (++conn->printer_argc < 3) continue;
+            conn->in_printer = false;
+
+            conn->job.run = print_job;
+            lane_submit(&printer_ports[0].lane, &conn->job);
+            return true;
+        } else if (strcmp(cmd, "MODE:PRINTER") == 0 || strcmp(cmd, "MODE:PRINT_PLU") == 0) {
+            conn->in_printer = true;
+            conn->printer_plu = (cmd[10] == '_');
+            conn->printer_argc = 0;
+        } else if (strcmp(cmd, "MODE:PLU_LOAD") == 0) {
+            conn->plu_cmd = PLU_CMD_LOAD;
+        } else if (strcmp(cmd, "MODE:PLU_IMPORT") == 0) {
+            conn->plu_cmd = PLU_CMD_IMPORT;
+        } else if (strcmp(cmd, "MODE:PLU_UPDATE") == 0) {
+            conn->plu_cmd = PLU_CMD_UPDATE;
+        } else if (strcmp(cmd, "MODE:STATS") == 0) {
+            send_server_stats(conn->fd);
+        } else if (strcmp(cmd, "MODE:WEIGHT_STREAM") == 0) {
+            conn->in_stream_setup = true;
+        } else if (strcmp(cmd, "MODE:WEIGHT") == 0) {
+            process_weight_line(conn->fd, cmd);     // just the ACK
+        } else if (reply_cached_weight(conn->fd, cmd)) {
+            continue;                               // answered from the sampler
+        } else {
+            conn->cmd = cmd;
+            conn->job.run = scale_job;
+            lane_submit(&scale_lane, &conn->job);
+            return true;
         }
     }
+    return false;
 }
 
 
-void load_json_data(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) { perror("fopen"); exit(EXIT_FAILURE); }
 
-    struct stat st;
-    if (fstat(fileno(f), &st) != 0) { perror("fstat"); fclose(f); exit(EXIT_FAILURE); }
+// ─── Scale sampler ────────────────────────────────────────────────
+// A background thread polls the scale and publishes the latest reading
+// through a seqlock, so RD_WEIGHT and print jobs read it without a
+// round trip to the port.
 
-    char *data = malloc(st.st_size + 1);
-    if (!data) { perror("malloc"); fclose(f); exit(EXIT_FAILURE); }
+struct weight_sample {
+    bool   valid;
+    int    fields;              // numbers found in the frame (1 or 3)
+    double net, tare, gross;    // kg
+    long long taken_ms;         // CLOCK_MONOTONIC
+    char   raw[128];            // frame exactly as the scale sent it
+};
 
-    fread(data, 1, st.st_size, f);
-    data[st.st_size] = '\0';
-    fclose(f);
+struct sample_cache {
+    atomic_uint seq;            // odd while a writer is updating
+    struct weight_sample s;
+};
 
-    // Parse JSON once
-    json_root = json_tokener_parse(data);
-       if (!json_root) {
-        fprintf(stderr, "JSON parse error\n");
-        exit(1);
-    }
+static struct sample_cache weight_cache;    // RD_WEIGHT frames
+static struct sample_cache rawct_cache;     // XC_RDRAWCT frames (while streamed)
 
-    // If there’s a "data" object, work on that; otherwise stick to top-level
-    struct json_object *dataobj = NULL;
-    struct json_object *root = json_root;
-    
-    if (json_object_object_get_ex(json_root, "data", &dataobj)
-        && json_object_get_type(dataobj) == json_type_object)
-    {
-        root = dataobj;
-    }
+static int scale_poll_ms = SCALE_POLL_MS;
 
-    // 1) Loop through basic fields
-    json_object_object_foreach(root, key, val) {
-    
-        // Group 1–15: PLU & Basic Info
-        if (strcmp(key, "plu_id") == 0)                                 // 1  plu_id – PLU No
-            plu_id = json_object_get_int(val);
-        else if (strcmp(key, "plu_name") == 0) {                       // 2  plu_name – PLU Name
-            const char *s = json_object_get_string(val);
-            if (s) { strncpy(plu_name, s, sizeof(plu_name)-1); plu_name[sizeof(plu_name)-1]='\0'; }
-        }
-        else if (strcmp(key, "plu_code") == 0)                          // 3  plu_code – PLU Code
-            strncpy(plu_code, json_object_get_string(val), sizeof(plu_code)-1);
-        else if (strcmp(key, "guom") == 0)                              // 4  guom – GUOM (Unit)
-            strncpy(guom, json_object_get_string(val), sizeof(guom)-1);
-        else if (strcmp(key, "unit_price") == 0) {                        // 5 – Unit Price
-	    unit_price = json_object_get_double(val);
-	}
-	else if (strcmp(key, "spl_up") == 0) {                            // 6 – Special Unit Price
-	    const char *s = json_object_get_string(val);
-	    if (s) {
-		strncpy(spl_up, s, sizeof(spl_up) - 1);
-		spl_up[sizeof(spl_up) - 1] = '\0';  // Ensure null-termination
-	    }
-	}
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        else if (strcmp(key, "quantity") == 0)                          // 7  quantity – Quantity
-            quantity = json_object_get_int(val);
-        else if (strcmp(key, "tare_wt") == 0)                           // 8  tare_wt – Tare Weight
-            tare_wt = json_object_get_double(val);
-        else if (strcmp(key, "fixed_price") == 0)                       // 9  fixed_price – Fixed Price
-            fixed_price = json_object_get_double(val);
-        else if (strcmp(key, "packed_date") == 0)                       // 10 packed_date – Packed Date
-            strncpy(packed_date, json_object_get_string(val), sizeof(packed_date)-1);
-        else if (strcmp(key, "packed_time") == 0)                       // 11 packed_time – Packed Time
-            strncpy(packed_time, json_object_get_string(val), sizeof(packed_time)-1);
-        else if (strcmp(key, "sellby_date") == 0)                       // 12 sellby_date – Sell By Date
-            strncpy(sellby_date, json_object_get_string(val), sizeof(sellby_date)-1);
-        else if (strcmp(key, "sellby_time") == 0)                       // 13 sellby_time – Sell By Time
-            strncpy(sellby_time, json_object_get_string(val), sizeof(sellby_time)-1);
-        else if (strcmp(key, "useby_date") == 0)                        // 14 useby_date – Use By Date
-            strncpy(useby_date, json_object_get_string(val), sizeof(useby_date)-1);
-        else if (strcmp(key, "useby_time") == 0)                        // 15 useby_time – Use By Time
-            strncpy(useby_time, json_object_get_string(val), sizeof(useby_time)-1);
-
-        // Group 16–40: Classification & Header/Footer
-        else if (strcmp(key, "plu_minimum") == 0)                       // 16 plu_minimum – PLU Minimum
-            plu_minimum = json_object_get_double(val);
-        else if (strcmp(key, "plu_target") == 0)                        // 17 plu_target – PLU Target
-            plu_target = json_object_get_double(val);
-        else if (strcmp(key, "plu_maximum") == 0)                       // 18 plu_maximum – PLU Maximum
-            plu_maximum = json_object_get_double(val);
-        else if (strcmp(key, "group_no") == 0)                          // 19 group_no – Group No
-            group_no = json_object_get_int(val);
-        else if (strcmp(key, "group_name") == 0)                        // 20 group_name – Group Name
-            strncpy(group_name, json_object_get_string(val), sizeof(group_name)-1);
-        else if (strcmp(key, "department_no") == 0)                     // 21 department_no – Department No
-            department_no = json_object_get_int(val);
-        else if (strcmp(key, "department_name") == 0)                   // 22 department_name – Department Name
-            strncpy(department_name, json_object_get_string(val), sizeof(department_name)-1);
-        else if (strcmp(key, "tax_no") == 0)                            // 23 tax_no – Tax No
-            tax_no = json_object_get_int(val);
-        else if (strcmp(key, "tax_name") == 0)                          // 24 tax_name – Tax Name
-            strncpy(tax_name, json_object_get_string(val), sizeof(tax_name)-1);
-        else if (strcmp(key, "tax_type") == 0)                          // 25 tax_type – Tax Type
-            strncpy(tax_type, json_object_get_string(val), sizeof(tax_type)-1);
-        else if (strcmp(key, "tax_rate") == 0)                          // 26 tax_rate – Tax Rate
-            tax_rate = json_object_get_double(val);
-        else if (strcmp(key, "operator_no") == 0)                       // 27 operator_no – Operator No
-            operator_no = json_object_get_int(val);
-        else if (strcmp(key, "operator_name") == 0)                     // 28 operator_name – Operator Name
-            strncpy(operator_name, json_object_get_string(val), sizeof(operator_name)-1);
-        else if (strcmp(key, "operator_password") == 0)                 // 29 operator_password – Operator Password
-            strncpy(operator_password, json_object_get_string(val), sizeof(operator_password)-1);
-        else if (strcmp(key, "header1") == 0)                           // 30 header1 – Header1
-            strncpy(header1, json_object_get_string(val), sizeof(header1)-1);
-        else if (strcmp(key, "header2") == 0)                           // 31 header2 – Header2
-            strncpy(header2, json_object_get_string(val), sizeof(header2)-1);
-        else if (strcmp(key, "header3") == 0)                           // 32 header3 – Header3
-            strncpy(header3, json_object_get_string(val), sizeof(header3)-1);
-        else if (strcmp(key, "header4") == 0)                           // 33 header4 – Header4
-            strncpy(header4, json_object_get_string(val), sizeof(header4)-1);
-        else if (strcmp(key, "header5") == 0)                           // 34 header5 – Header5
-            strncpy(header5, json_object_get_string(val), sizeof(header5)-1);
-        else if (strcmp(key, "footer1") == 0)                           // 35 footer1 – Footer1
-            strncpy(footer1, json_object_get_string(val), sizeof(footer1)-1);
-        else if (strcmp(key, "footer2") == 0)                           // 36 footer2 – Footer2
-            strncpy(footer2, json_object_get_string(val), sizeof(footer2)-1);
-        else if (strcmp(key, "footer3") == 0)                           // 37 footer3 – Footer3
-            strncpy(footer3, json_object_get_string(val), sizeof(footer3)-1);
-        else if (strcmp(key, "footer4") == 0)                           // 38 footer4 – Footer4
-            strncpy(footer4, json_object_get_string(val), sizeof(footer4)-1);
-        else if (strcmp(key, "footer5") == 0)                           // 39 footer5 – Footer5
-            strncpy(footer5, json_object_get_string(val), sizeof(footer5)-1);
-        else if (strcmp(key, "discount_no") == 0)                       // 40 discount_no – Discount No
-            discount_no = json_object_get_int(val);
-
-        // Group 41–60: Promotion, Packaging, Barcode, Discount
-        else if (strcmp(key, "discount_name") == 0)                     // 41 discount_name – Discount Name
-            strncpy(discount_name, json_object_get_string(val), sizeof(discount_name)-1);
-        else if (strcmp(key, "discount_type") == 0)                     // 42 discount_type – Discount Type
-            strncpy(discount_type, json_object_get_string(val), sizeof(discount_type)-1);
-        else if (strcmp(key, "discount_first_target") == 0)             // 43 discount_first_target – Discount First Target
-            discount_first_target = json_object_get_double(val);
-        else if (strcmp(key, "discount_first_value") == 0)              // 44 discount_first_value – Discount First Value
-            discount_first_value = json_object_get_double(val);
-        else if (strcmp(key, "discount_second_target") == 0)            // 45 discount_second_target – Discount Second Target
-            discount_second_target = json_object_get_double(val);
-        else if (strcmp(key, "discount_second_value") == 0)             // 46 discount_second_value – Discount Second Value
-            discount_second_value = json_object_get_double(val);
-        else if (strcmp(key, "discount_days") == 0)                     // 47 discount_days – Discount Days
-            strncpy(discount_days, json_object_get_string(val), sizeof(discount_days)-1);
-        else if (strcmp(key, "discount_start") == 0)                    // 48 discount_start – Discount Start Date/Time
-            strncpy(discount_start, json_object_get_string(val), sizeof(discount_start)-1);
-        else if (strcmp(key, "discount_end") == 0)                      // 49 discount_end – Discount End Date/Time
-            strncpy(discount_end, json_object_get_string(val), sizeof(discount_end)-1);
-        else if (strcmp(key, "package_type") == 0)                      // 50 package_type – Package Type
-            strncpy(package_type, json_object_get_string(val), sizeof(package_type)-1);
-        else if (strcmp(key, "tare_name") == 0)                         // 51 tare_name – Tare Name
-            strncpy(tare_name, json_object_get_string(val), sizeof(tare_name)-1);
-        else if (strcmp(key, "tare_value") == 0)                        // 52 tare_value – Tare Value
-            tare_value = json_object_get_double(val);
-        else if (strcmp(key, "storage_temp") == 0)                      // 53 storage_temp – Storage Temperature
-            strncpy(storage_temp, json_object_get_string(val), sizeof(storage_temp)-1);
-        else if (strcmp(key, "barcode_name") == 0)                      // 54 barcode_name – Barcode Name
-            strncpy(barcode_name, json_object_get_string(val), sizeof(barcode_name)-1);
-        else if (strcmp(key, "barcode_type") == 0)                      // 55 barcode_type – Barcode Type
-            strncpy(barcode_type, json_object_get_string(val), sizeof(barcode_type)-1);
-        else if (strcmp(key, "barcode_data") == 0)                      // 56 barcode_data – Barcode Data
-            strncpy(barcode_data, json_object_get_string(val), sizeof(barcode_data)-1);
-        else if (strcmp(key, "bc_field1") == 0)                         // 57 bc_field1 – Barcode Field 1
-            strncpy(bc_field1, json_object_get_string(val), sizeof(bc_field1)-1);
-        else if (strcmp(key, "bc_field1_con") == 0)                     // 58 bc_field1_con – Barcode Field 1 Constant
-            strncpy(bc_field1_con, json_object_get_string(val), sizeof(bc_field1_con)-1);
-        else if (strcmp(key, "bc_field1_shift") == 0)                   // 59 bc_field1_shift – Barcode Field 1 Shift
-            strncpy(bc_field1_shift, json_object_get_string(val), sizeof(bc_field1_shift)-1);
-        else if (strcmp(key, "bc_field2") == 0)                         // 60 bc_field2 – Barcode Field 2
-            strncpy(bc_field2, json_object_get_string(val), sizeof(bc_field2)-1);
-
-        // Group 61–80: Ingredients, Label, Image, Billing
-        else if (strcmp(key, "barcode_field2_condition") == 0)         // 61 bc_field2_con – Barcode Field 2 Constant
-            strncpy(bc_field2_con, json_object_get_string(val), sizeof(bc_field2_con)-1);
-        else if (strcmp(key, "barcode_field2_shift") == 0)             // 62 bc_field2_shift – Barcode Field 2 Shift
-            strncpy(bc_field2_shift, json_object_get_string(val), sizeof(bc_field2_shift)-1);
-        else if (strcmp(key, "ingredient_no") == 0)                    // 63 ingredient_no – Ingredient No
-            ingredient_no = json_object_get_int(val);
-        else if (strcmp(key, "ingredient_name") == 0)                  // 64 ingredient_name – Ingredient Name
-            strncpy(ingredient_name, json_object_get_string(val), sizeof(ingredient_name)-1);
-	else if (strcmp(key, "ingredients_text") == 0)  // 65 – Ingredient Text
-    strncpy(ingredients_text, json_object_get_string(val), sizeof(ingredients_text) - 1);
-
-
-        else if (strcmp(key, "message_no") == 0)                       // 66 message_no – Message No
-            message_no = json_object_get_int(val);
-        else if (strcmp(key, "message_name") == 0)                     // 67 message_name – Message Name
-            strncpy(message_name, json_object_get_string(val), sizeof(message_name)-1);
-        else if (strcmp(key, "message_text") == 0)                     // 68 message_text – Message Text
-            strncpy(message_text, json_object_get_string(val), sizeof(message_text)-1);
-        else if (strcmp(key, "current_net_weight") == 0)               // 69 current_net_weight – Current Net Weight
-            current_net_weight = json_object_get_double(val);
-        else if (strcmp(key, "current_tare_weight") == 0)              // 70 current_tare_weight – Current Tare Weight
-            current_tare_weight = json_object_get_double(val);
-        else if (strcmp(key, "current_gross_weight") == 0)             // 71 current_gross_weight – Current Gross Weight
-            current_gross_weight = json_object_get_double(val);
-        else if (strcmp(key, "weight_or_quantity") == 0)               // 72 weight_or_quantity – Weight or Quantity
-            weight_or_quantity = json_object_get_double(val);
-        else if (strcmp(key, "actual_unit_price") == 0)                // 73 actual_unit_price – Actual Unit Price
-            actual_unit_price = json_object_get_double(val);
-        else if (strcmp(key, "image_no") == 0)                         // 74 image_no – Image No
-            image_no = json_object_get_int(val);
-        else if (strcmp(key, "image_file_name") == 0)                  // 75 image_file_name – Image File Name
-            strncpy(image_file_name, json_object_get_string(val), sizeof(image_file_name)-1);
-        else if (strcmp(key, "label_datetime") == 0)                   // 76 label_date_time – Label DateTime
-            strncpy(label_date_time, json_object_get_string(val), sizeof(label_date_time)-1);
-        else if (strcmp(key, "label_design_no") == 0)                  // 77 label_design_no – Label Design No
-            label_design_no = json_object_get_int(val);
-        else if (strcmp(key, "label_file_name") == 0)                  // 78 label_file_name – Label File Name
-            strncpy(label_file_name, json_object_get_string(val), sizeof(label_file_name)-1);
-        else if (strcmp(key, "bill_no") == 0)                          // 79 bill_no – Bill No
-            bill_no = json_object_get_int(val);
-        else if (strcmp(key, "scale_no") == 0)                         // 80 scale_no – Scale No
-            strncpy(scale_no, json_object_get_string(val), sizeof(scale_no)-1);
-
-        // Group 81–96: Final Totals & Output Info
-        else if (strcmp(key, "scale_name") == 0)                       // 81 scale_name – Scale Name
-            strncpy(scale_name, json_object_get_string(val), sizeof(scale_name)-1);
-        else if (strcmp(key, "scale_capacity") == 0)                   // 82 scale_capacity – Scale Capacity
-            scale_capacity = json_object_get_double(val);
-        else if (strcmp(key, "scale_accuracy") == 0)                   // 83 scale_accuracy – Scale Accuracy
-            scale_accuracy = json_object_get_double(val);
-        else if (strcmp(key, "current_datetime") == 0)                 // 84 current_datetime – Current DateTime
-            strncpy(current_datetime, json_object_get_string(val), sizeof(current_datetime)-1);
-        else if (strcmp(key, "no_of_items") == 0)                      // 85 no_of_items – No of Items
-            no_of_items = json_object_get_int(val);
-        else if (strcmp(key, "total_amount") == 0)                     // 86 total_amount – Total Amount
-            total_amount = json_object_get_double(val);
-        else if (strcmp(key, "total_quantity") == 0)                   // 87 total_quantity – Total Quantity
-            total_quantity = json_object_get_double(val);
-        else if (strcmp(key, "total_weight") == 0)                     // 88 total_weight – Total Weight
-            total_weight = json_object_get_double(val);
-        else if (strcmp(key, "total_qty_or_weight") == 0)              // 89 total_qty_or_weight – Total Qty/Weight
-            total_qty_or_weight = json_object_get_double(val);
-        else if (strcmp(key, "total_tax") == 0)                        // 90 total_tax – Total Tax
-            total_tax = json_object_get_double(val);
-        else if (strcmp(key, "total_discount") == 0)                   // 91 total_discount – Total Discount
-            total_discount = json_object_get_double(val);
-        else if (strcmp(key, "today_bill_no") == 0)                    // 92 today_bill_no – Today's Bill No
-            today_bill_no = json_object_get_int(val);
-        else if (strcmp(key, "total_price") == 0)                      // 93 total_price – Total Price
-            total_price = json_object_get_double(val);
-        else if (strcmp(key, "uom") == 0) {                             // 94 uom – Unit of Measure
-            const char *s = json_object_get_string(val);
-            if (s) { strncpy(uom, s, sizeof(uom)-1); uom[sizeof(uom)-1]='\0'; }
-        }
-        else if (strcmp(key, "barcode_flag") == 0) {                   // 95 barcode_flag – Barcode Flag
-            const char *s = json_object_get_string(val);
-            if (s) { strncpy(barcode_flag, s, sizeof(barcode_flag)-1); barcode_flag[sizeof(barcode_flag)-1]='\0'; }
-        }
-        else if (strcmp(key, "bill_text") == 0) {                      // 96 bill_text – Bill Text
-            const char *s = json_object_get_string(val);
-            if (s) { strncpy(bill_text, s, sizeof(bill_text)-1); bill_text[sizeof(bill_text)-1]='\0'; }
-        }
-        }
-        
-         if (
-        strcasecmp(uom, "kg") == 0 || strcasecmp(uom, "g") == 0 ||
-        strcasecmp(guom, "kg") == 0 || strcasecmp(guom, "g") == 0
-    ) {
-        uom_type = WEIGH;
-    } else {
-        uom_type = PCS;
-    }
-        
- // 2) Handle the "barcodes" array at the original top level
-struct json_object *barcodes_obj = NULL;
-if (json_root
-    && json_object_object_get_ex(json_root, "barcodes", &barcodes_obj)
-    && json_object_get_type(barcodes_obj) == json_type_array)
-{
-        size_t bc_count = json_object_array_length(barcodes_obj);
-        for (size_t i = 0; i < bc_count; i++) {
-            struct json_object *bc = json_object_array_get_idx(barcodes_obj, i);
-
-            json_object_object_foreach(bc, bk, bv) {
-                if (strcmp(bk, "barcode_number") == 0) {
-                    int num = json_object_get_int(bv);
-                    // store num in your array
-                }
-                else if (strcmp(bk, "barcode_name") == 0) {
-                    const char *s = json_object_get_string(bv);
-                    if (s) {
-                        // strncpy into your struct
-                    }
-                }
-                // … handle the rest of your barcode fields …
-            }
-        }
-    }
+static long long weight_max_age_ms(void) {
+    long long age = 3LL * scale_poll_ms;
+    return age > WEIGHT_MAX_AGE_FLOOR_MS ? age : WEIGHT_MAX_AGE_FLOOR_MS;
+}
 
-    // Clean up JSON and buffer exactly once
-    free(data);
+// Writers hold scale_lane.io_lock, so there is only ever one at a time
+static void sample_publish(struct sample_cache *cache, const struct weight_sample *ws) {
+    unsigned seq = atomic_load_explicit(&cache->seq, memory_order_relaxed);
+    atomic_store_explicit(&cache->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    cache->s = *ws;
+    atomic_store_explicit(&cache->seq, seq + 2, memory_order_release);
 }
 
-//-----------GetVariableText--------------------------------------------------------------------------------
+// Lock-free read of the latest sample; false if none has been taken yet
+static bool sample_snapshot(struct sample_cache *cache,
+                            struct weight_sample *out, long long *age_ms) {
+    unsigned s1, s2;
+    do {
+        s1 = atomic_load_explicit(&cache->seq, memory_order_acquire);
+        *out = cache->s;
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(&cache->seq, memory_order_relaxed);
+    } while ((s1 & 1) || s1 != s2);
+
+    if (!out->valid) return false;
+    *age_ms = monotonic_ms() - out->taken_ms;
+    return true;
+}
 
-int GetVariableText(unsigned short data_id, char *buf) {
+// Outcome of a scale round trip; only SCALE_RX_OK is positive
+enum {
+    SCALE_RX_OK      =  1,      // complete CR/LF-terminated frame
+    SCALE_RX_TIMEOUT =  0,      // nothing arrived before the deadline
+    SCALE_RX_ERROR   = -1,      // port write/read failed
+    SCALE_RX_PARTIAL = -2,      // bytes arrived but the frame never ended
+};
+
+static atomic_ulong scale_rx_timeouts, scale_rx_partials;
+
+int scale_rx_stats(char *out, size_t cap) {
+    return snprintf(out, cap, " scale_timeouts=%lu scale_partials=%lu",
+                    atomic_load(&scale_rx_timeouts), atomic_load(&scale_rx_partials));
+}
+
+// One scale round trip. Caller holds scale_lane.io_lock.
+// Returns as soon as the reply's line feed arrives instead of sleeping a
+// fixed time; resp is NUL-terminated on every outcome.
+static int scale_query(unsigned char cmd, char *resp, size_t cap) {
+    size_t len = 0;
+    resp[0] = '\0';
+
+    tcflush(weight_fd, TCIFLUSH);   // drop late bytes from an earlier timeout
+    if (write(weight_fd, &cmd, 1) < 0) return SCALE_RX_ERROR;
+
+    long long deadline = monotonic_ms() + SCALE_REPLY_TIMEOUT_MS;
+    for (;;) {
+        long long left = deadline - monotonic_ms();
+        if (left <= 0) break;
+
+        struct pollfd pfd = { .fd = weight_fd, .events = POLLIN };
+        int pr = poll(&pfd, 1, (int)left);
+        if (pr < 0) {
+            if (errno == EINTR) continue;
+            return SCALE_RX_ERROR;
+        }
+        if (pr == 0) break;
+
+        ssize_t r = read(weight_fd, resp + len, cap - 1 - len);
+        if (r < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return SCALE_RX_ERROR;
+        }
+        len += r;
+        resp[len] = '\0';
+        if (len > 0 && resp[len - 1] == '\n') return SCALE_RX_OK;
+        if (len == cap - 1) break;  // no room for the rest of the frame
+    }
+
+    // Some firmware ends frames with a bare CR
+    if (len > 0 && resp[len - 1] == '\r') return SCALE_RX_OK;
+    if (len > 0) {
+        atomic_fetch_add(&scale_rx_partials, 1);
+        return SCALE_RX_PARTIAL;
+    }
+    atomic_fetch_add(&scale_rx_timeouts, 1);
+    return SCALE_RX_TIMEOUT;
+}
+
+// Frame holds either one weight (net) or net, tare and gross
+static void parse_weight_frame(struct weight_sample *ws) {
+    double v[3] = { 0 };
+    int n = 0;
+    const char *p = ws->raw;
+    while (*p && n < 3) {
+        char *end;
+        double d = strtod(p, &end);
+        if (end == p) { p++; continue; }
+        v[n++] = d;
+        p = end;
+    }
+    ws->fields = n;
+    ws->net    = v[0];
+    ws->tare   = (n >= 3) ? v[1] : 0.0;
+    ws->gross  = (n >= 3) ? v[2] : v[0];
+}
+
+// Round trip that also refreshes the matching cache. Caller holds io_lock.
+static int scale_read_sample(unsigned char cmd, struct sample_cache *cache,
+                             struct weight_sample *ws) {
+    memset(ws, 0, sizeof(*ws));
+    int r = scale_query(cmd, ws->raw, sizeof(ws->raw));
+    if (r != SCALE_RX_OK) return r;
+    parse_weight_frame(ws);
+    ws->taken_ms = monotonic_ms();
+    ws->valid = true;
+    sample_publish(cache, ws);
+    return r;
+}
+
+static int scale_read_weight(struct weight_sample *ws) {
+    return scale_read_sample(0x05, &weight_cache, ws);
+}
+
+static void stream_demand(int *period_ms, bool *want_weight, bool *want_raw);
+static void stream_push(void);
+
+// Polls at ESSAE_SCALE_POLL_MS, or faster while a stream asks for it
+static void *scale_sampler(void *arg) {
+    (void)arg;
+    for (;;) {
+        int period = scale_poll_ms;
+        bool want_weight = scale_poll_ms > 0, want_raw = false;
+        stream_demand(&period, &want_weight, &want_raw);
+        if (period <= 0) {
+            usleep(100000);     // nothing to sample; check for subscribers again soon
+            continue;
+        }
+
+        long long start = monotonic_ms();
+        struct weight_sample ws;
+        pthread_mutex_lock(&scale_lane.io_lock);
+        if (want_weight) scale_read_weight(&ws);
+        if (want_raw)    scale_read_sample(0x11, &rawct_cache, &ws);
+        pthread_mutex_unlock(&scale_lane.io_lock);
+        stream_push();
+
+        long long left = period - (monotonic_ms() - start);
+        if (left > 0) usleep(left * 1000);
+    }
+    return NULL;
+}
+
+static void scale_sampler_start(void) {
+    const char *env = getenv("ESSAE_SCALE_POLL_MS");
+    if (env) scale_poll_ms = atoi(env);
+    if (weight_fd < 0) return;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, scale_sampler, NULL) != 0) {
+        perror("pthread_create (scale sampler)");
+        return;
+    }
+    pthread_detach(tid);
+    if (scale_poll_ms > 0)
+        printf("Scale sampler polling every %d ms\n", scale_poll_ms);
+}
+
+// Returns the length written, truncated to cap - 1 (strtod takes "1e300")
+static int format_weight_snapshot(char *out, size_t cap,
+                                  const struct weight_sample *ws, long long age_ms) {
+    int n = snprintf(out, cap, "net=%.3f tare=%.3f gross=%.3f age_ms=%lld",
+                     ws->net, ws->tare, ws->gross, age_ms);
+    return n < (int)cap ? n : (int)cap - 1;
+}
+
+// RD_WEIGHT / RD_WEIGHT_SNAP straight from the cache when it is fresh
+bool reply_cached_weight(int client_fd, const char *cmd) {
+    bool snap = strcmp(cmd, "RD_WEIGHT_SNAP") == 0;
+    if (!snap && strcmp(cmd, "RD_WEIGHT") != 0) return false;
+
+    struct weight_sample ws;
+    long long age_ms;
+    if (!sample_snapshot(&weight_cache, &ws, &age_ms) || age_ms > weight_max_age_ms())
+        return false;
+
+    if (snap) {
+        char out[160];
+        int n = format_weight_snapshot(out, sizeof(out), &ws, age_ms);
+        write_all(client_fd, out, n);
+    } else {
+        write_all(client_fd, ws.raw, strlen(ws.raw));
+    }
+    return true;
+}
+
+// ─── Weight streaming ─────────────────────────────────────────────
+// MODE:WEIGHT_STREAM keeps one connection open and the sampler pushes
+// frames to every subscriber, so any number of displays cost a single
+// poll of the scale. Spec line: <RD_WEIGHT|RD_WEIGHT_SNAP|XC_RDRAWCT>,
+// <interval_ms>[,CHANGE]. STOP ends the stream.
+
+enum { STREAM_WEIGHT, STREAM_WEIGHT_SNAP, STREAM_RAWCOUNT };
+
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct client_conn *stream_subs;     // guarded by stream_lock
+static unsigned stream_count;
+static unsigned long stream_frames, stream_drops;
+
+// Watch the socket for EPOLLOUT only while a tail is queued
+static void stream_arm(struct client_conn *c) {
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLRDHUP | (c->stream_tail_len ? EPOLLOUT : 0),
+        .data.ptr = c,
+    };
+    epoll_ctl(event_ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Non-blocking write under stream_lock; whatever the socket does not
+// take now is queued behind the tail. False if the queue overflowed.
+static bool stream_send(struct client_conn *c, const char *buf, size_t n) {
+    bool was_empty = (c->stream_tail_len == 0);
+    if (was_empty) {
+        ssize_t k = send(c->fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        if (k > 0) {
+            buf += k;
+            n -= k;
+        }
+    }
+    if (n == 0) return true;
+    if (n > sizeof(c->stream_tail) - c->stream_tail_len)
+        return false;
+    memcpy(c->stream_tail + c->stream_tail_len, buf, n);
+    c->stream_tail_len += n;
+    if (was_empty) stream_arm(c);
+    return true;
+}
+
+// Event loop: the socket drained, send what is queued
+void stream_writable(struct client_conn *c) {
+    pthread_mutex_lock(&stream_lock);
+    if (c->stream_tail_len) {
+        ssize_t k = send(c->fd, c->stream_tail, c->stream_tail_len,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            c->stream_tail_len = 0;     // peer gone; EPOLLIN reaps it
+        else if (k > 0) {
+            c->stream_tail_len -= k;
+            memmove(c->stream_tail, c->stream_tail + k, c->stream_tail_len);
+        }
+    }
+    if (!c->stream_tail_len) stream_arm(c);
+    pthread_mutex_unlock(&stream_lock);
+}
+
+void stream_subscribe(struct client_conn *c, const char *spec) {
+    char kind[32] = "", flag[16] = "";
+    int interval = 0;
+    int n = sscanf(spec, "%31[^,],%d,%15s", kind, &interval, flag);
+
+    if (n < 1 || interval < 0 || (n == 3 && strcmp(flag, "CHANGE") != 0)) {
+        write_all(c->fd, "Error: bad stream spec\n", 23);
+        return;
+    }
+    if (strcmp(kind, "RD_WEIGHT") == 0)           c->stream_kind = STREAM_WEIGHT;
+    else if (strcmp(kind, "RD_WEIGHT_SNAP") == 0) c->stream_kind = STREAM_WEIGHT_SNAP;
+    else if (strcmp(kind, "XC_RDRAWCT") == 0)     c->stream_kind = STREAM_RAWCOUNT;
+    else {
+        write_all(c->fd, "Error: bad stream spec\n", 23);
+        return;
+    }
+    if (weight_fd < 0) {
+        write_all(c->fd, "Error: scale not connected\n", 27);
+        return;
+    }
+
+    c->stream_interval_ms = interval;
+    c->stream_on_change = (n == 3);
+    c->stream_last_ms = 0;
+    c->stream_last[0] = '\0';
+
+    pthread_mutex_lock(&stream_lock);
+    stream_send(c, "OK:WEIGHT_STREAM\n", 17);
+    c->streaming = true;
+    c->stream_next = stream_subs;
+    stream_subs = c;
+    stream_count++;
+    pthread_mutex_unlock(&stream_lock);
+}
+
+static void stream_unlink(struct client_conn *c) {
+    for (struct client_conn **pp = &stream_subs; *pp; pp = &(*pp)->stream_next) {
+        if (*pp == c) {
+            *pp = c->stream_next;
+            stream_count--;
+            break;
+        }
+    }
+    c->streaming = false;
+}
+
+void stream_unsubscribe(struct client_conn *c) {
+    pthread_mutex_lock(&stream_lock);
+    stream_unlink(c);
+    pthread_mutex_unlock(&stream_lock);
+}
+
+// Lines received while streaming; replies go behind any queued frame
+// tail so they never interleave with a pushed frame
+void stream_command(struct client_conn *c, const char *cmd) {
+    if (strcmp(cmd, "STOP") != 0) {
+        pthread_mutex_lock(&stream_lock);
+        if (!stream_send(c, "Error: stream active, send STOP\n", 32))
+            shutdown(c->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&stream_lock);
+        return;
+    }
+
+    // Later replies are written directly, so take the tail back and
+    // finish it here on the worker rather than on the event loop
+    char out[sizeof(c->stream_tail) + 18];
+    pthread_mutex_lock(&stream_lock);
+    stream_unlink(c);
+    size_t n = c->stream_tail_len;
+    memcpy(out, c->stream_tail, n);
+    c->stream_tail_len = 0;
+    if (n) stream_arm(c);
+    pthread_mutex_unlock(&stream_lock);
+
+    memcpy(out + n, "OK:STREAM_STOPPED\n", 18);
+    write_all(c->fd, out, n + 18);
+}
+
+static void stream_demand(int *period_ms, bool *want_weight, bool *want_raw) {
+    pthread_mutex_lock(&stream_lock);
+    for (struct client_conn *c = stream_subs; c; c = c->stream_next) {
+        int p = c->stream_interval_ms < STREAM_MIN_PERIOD_MS
+              ? STREAM_MIN_PERIOD_MS : c->stream_interval_ms;
+        if (*period_ms <= 0 || p < *period_ms) *period_ms = p;
+        if (c->stream_kind == STREAM_RAWCOUNT) *want_raw = true;
+        else                                   *want_weight = true;
+    }
+    pthread_mutex_unlock(&stream_lock);
+}
+
+// Frame text without the scale's trailing CR/LF
+static int trimmed_frame(char *out, size_t cap, const char *raw) {
+    int n = snprintf(out, cap, "%s", raw);
+    if (n >= (int)cap) n = cap - 1;
+    while (n > 0 && (out[n - 1] == '\r' || out[n - 1] == '\n')) n--;
+    out[n] = '\0';
+    return n;
+}
+
+int stream_stats(char *out, size_t cap) {
+    pthread_mutex_lock(&stream_lock);
+    int n = snprintf(out, cap, " streams=%u stream_frames=%lu stream_drops=%lu",
+                     stream_count, stream_frames, stream_drops);
+    pthread_mutex_unlock(&stream_lock);
+    return n;
+}
+
+// Called by the sampler after each poll
+static void stream_push(void) {
+    pthread_mutex_lock(&stream_lock);
+    if (!stream_subs) {
+        pthread_mutex_unlock(&stream_lock);
+        return;
+    }
+
+    struct weight_sample w, r;
+    long long wage = 0, rage = 0;
+    bool have_w = sample_snapshot(&weight_cache, &w, &wage);
+    bool have_r = sample_snapshot(&rawct_cache, &r, &rage);
+    long long now = monotonic_ms(), max_age = weight_max_age_ms();
+
+    for (struct client_conn *c = stream_subs; c; c = c->stream_next) {
+        bool raw = (c->stream_kind == STREAM_RAWCOUNT);
+        const struct weight_sample *src = raw ? &r : &w;
+        if (!(raw ? have_r : have_w)) continue;
+        if (now - c->stream_last_ms < c->stream_interval_ms) continue;
+
+        // The scale stopped answering: say so rather than repeat the last reading
+        bool stale = (raw ? rage : wage) > max_age;
+        char key[128], frame[192];
+        if (stale)
+            snprintf(key, sizeof(key), "Error: scale not responding");
+        else
+            trimmed_frame(key, sizeof(key), src->raw);
+        if (c->stream_on_change && strcmp(key, c->stream_last) == 0) continue;
+
+        int n;
+        if (c->stream_kind == STREAM_WEIGHT_SNAP && !stale)
+            n = format_weight_snapshot(frame, sizeof(frame) - 1, src, wage);
+        else
+            n = snprintf(frame, sizeof(frame) - 1, "%s", key);
+        frame[n++] = '\n';
+
+        // Never block the sampler on a slow reader: while the end of the
+        // previous frame is still queued, drop new frames instead
+        if (c->stream_tail_len || !stream_send(c, frame, n)) {
+            stream_drops++;
+            continue;
+        }
+        stream_frames++;
+        c->stream_last_ms = now;
+        strcpy(c->stream_last, key);
+    }
+    pthread_mutex_unlock(&stream_lock);
+}
+
+// Handle exactly one command (no trailing newline), including MODE header.
+void process_weight_line(int client_fd, const char *cmd) {
+    char response[BUFFER_SIZE] = {0};
+    unsigned char c;
+
+    // 1) MODE header: drop or ACK
+    if (strcmp(cmd, "MODE:WEIGHT") == 0) {
+        const char *ack = "OK:WEIGHT\n";
+        write_all(client_fd, ack, strlen(ack));
+        return;
+    }
+
+    // 2) Real scale commands
+    if (strcmp(cmd, "RD_WEIGHT") == 0 || strcmp(cmd, "RD_WEIGHT_SNAP") == 0) {
+        struct weight_sample ws;
+        int rx = scale_read_weight(&ws);
+        if (rx == SCALE_RX_PARTIAL) {
+            strcpy(response, "Error: Incomplete frame from weight machine.");
+        } else if (rx != SCALE_RX_OK) {
+            strcpy(response, "Error: No response from weight machine.");
+        } else if (strcmp(cmd, "RD_WEIGHT_SNAP") == 0) {
+            format_weight_snapshot(response, sizeof(response), &ws, 0);
+        } else {
+            strcpy(response, ws.raw);
+        }
+    }
+    else if (strcmp(cmd, "XC_TARE") == 0) {
+        unsigned char tcmds[2] = {'T','t'};
+        write(weight_fd, tcmds, 2);
+        strcpy(response, "XC_TARE: Tare command sent.");
+    }
+    else if (strcmp(cmd, "XC_REZERO") == 0) {
+        c = 0x10; write(weight_fd, &c, 1);
+        strcpy(response, "XC_REZERO sent.");
+    }
+    else if (strcmp(cmd, "XC_SON") == 0) {
+        c = 0x12; write(weight_fd, &c, 1);
+        strcpy(response, "XC_SON: Calibration start.");
+    }
+    else if (strncmp(cmd, "XC_KEYCAL", 9) == 0) {
+        c = 0x13; write(weight_fd, &c, 1);
+        int payload_len = strlen(cmd) - 9;
+        if (payload_len > 0) {
+            write(weight_fd, cmd + 9, payload_len);
+        }
+        strcpy(response, "XC_KEYCAL sent with weight payload.");
+    }
+    else if (strcmp(cmd, "XC_CALZERO") == 0) {
+        c = 0x14; write(weight_fd, &c, 1);
+        strcpy(response, "XC_CALZERO: Zero point set.");
+    }
+    else if (strcmp(cmd, "XC_CALSPAN") == 0) {
+        c = 0x15; write(weight_fd, &c, 1);
+        strcpy(response, "XC_CALSPAN: Span set.");
+    }
+    else if (strcmp(cmd, "XC_CALIBRATE") == 0) {
+        c = 0x16; write(weight_fd, &c, 1);
+        strcpy(response, "XC_CALIBRATE: Calibration finalize.");
+    }
+    else if (strcmp(cmd, "XC_RDRAWCT") == 0) {
+        struct weight_sample ws;
+        int rx = scale_read_sample(0x11, &rawct_cache, &ws);
+        if (rx == SCALE_RX_PARTIAL) {
+            strcpy(response, "Error: Incomplete raw data frame.");
+        } else if (rx != SCALE_RX_OK) {
+            strcpy(response, "Error: No raw data response.");
+        } else {
+            strcpy(response, ws.raw);
+        }
+    }
+    else if (strcmp(cmd, "XC_LOAD_DEFAULTS") == 0) {
+        c = 0x17; write(weight_fd, &c, 1);
+        strcpy(response, "XC_LOAD_DEFAULTS sent.");
+    }
+    else if (strcmp(cmd, "WR_TECHSPEC") == 0) {
+    c = 0x18; 
+    write(weight_fd, &c, 1);
+    strcpy(response, "WR_TECHSPEC sent.");
+  }
+   else if (strcmp(cmd, "WR_CUSSPEC") == 0) {
+    c = 0x1A; 
+    write(weight_fd, &c, 1);
+    strcpy(response, "WR_CUSSPEC sent.");
+ }
+   else if (strcmp(cmd, "RD_CUSSPEC") == 0 || strcmp(cmd, "RD_TECHSPEC") == 0) {
+        // ASCII spec frame (e.g. "03 05 03 00 ...\r\n"), passed through as received
+        int rx = scale_query(cmd[3] == 'C' ? 0x1B : 0x19, response, sizeof(response));
+        if (rx == SCALE_RX_PARTIAL) {
+            strcpy(response, "Error: incomplete frame from scale");
+        } else if (rx != SCALE_RX_OK) {
+            strcpy(response, "Error: no data from scale");
+        }
+    }
+
+    else if (strcmp(cmd, "XC_RESTART") == 0) {
+        c = 0x1C; write(weight_fd, &c, 1);
+        strcpy(response, "XC_RESTART sent.");
+    }
+    else {
+        strcpy(response, "Error: Unknown command");
+    }
+
+    // 3) Send response back
+    write_all(client_fd, response, strlen(response));
+}
+
+
+// ─── Fixed-point amounts ──────────────────────────────────────────
+// Prices and weights are held as integers with a fixed number of
+// decimals: money in paise, weights (kg) in milligrams and other
+// decimal quantities in thousandths. They are parsed once from the
+// record's text and printed with integer arithmetic only, so a barcode
+// carries exactly the price that was loaded.
+
+#define FX_MONEY  2             // decimals held: paise
+#define FX_WEIGHT 6             // kg in milligrams
+#define FX_QTY    3
+
+static const int64_t fx_pow10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+// v (from decimals) at `to` decimals, rounded half away from zero
+static int64_t fx_round(int64_t v, int from, int to) {
+    if (to >= from) return v * fx_pow10[to - from];
+    int64_t d = fx_pow10[from - to];
+    return v >= 0 ? (v + d / 2) / d : -((-v + d / 2) / d);
+}
+
+static int64_t fx_from_double(double x, int dp) {
+    return llround(x * fx_pow10[dp]);
+}
+
+// Parse a decimal ("12.345", "-0.5", "7") into v with dp decimals, rounding
+// half away from zero. Returns the end of the number (s if there is none).
+static const char *fx_parse(const char *s, int dp, int64_t *v) {
+    if (!s) {
+        *v = 0;
+        return "";
+    }
+    const char *p = s;
+    while (isspace((unsigned char)*p)) p++;
+    bool neg = (*p == '-');
+    if (*p == '-' || *p == '+') p++;
+
+    int64_t n = 0;
+    int frac = 0, digits = 0;
+    bool point = false, up = false, rounded = false;
+    for (;; p++) {
+        if (isdigit((unsigned char)*p)) {
+            int d = *p - '0';
+            digits++;
+            if (!point) {
+                if (n < 1000000000000LL) n = n * 10 + d;
+            } else if (frac < dp) {
+                n = n * 10 + d;
+                frac++;
+            } else if (!rounded) {
+                up = (d >= 5);
+                rounded = true;
+            }
+        } else if (*p == '.' && !point) {
+            point = true;
+        } else {
+            break;
+        }
+    }
+    if (!digits) {
+        *v = 0;
+        return s;
+    }
+    if (*p == 'e' || *p == 'E') {       // exponent: rare enough for strtod
+        char *end;
+        *v = fx_from_double(strtod(s, &end), dp);
+        return end;
+    }
+    n = n * fx_pow10[dp - frac] + up;
+    *v = neg ? -n : n;
+    return p;
+}
+
+// Decimal text of v (from decimals) with dp decimals; returns the length
+static int fx_format(char *out, int64_t v, int from, int dp) {
+    int64_t r = fx_round(v, from, dp);
+    uint64_t u = r < 0 ? -(uint64_t)r : (uint64_t)r;
+    char tmp[24];
+    int n = 0, len = 0;
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u || n <= dp);
+    if (r < 0) out[len++] = '-';
+    while (n > dp) out[len++] = tmp[--n];
+    if (dp) {
+        out[len++] = '.';
+        while (n) out[len++] = tmp[--n];
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// --- Product record (with Data ID and Description) ---
+// One product's fields, parsed once by product_new() and never changed
+// after that. The catalog and each job printing it hold a reference;
+// the last product_put() frees it, so a catalog can be replaced while
+// jobs still print from the old one.
+
+struct product {
+    atomic_int refs;
+    struct json_object *rec;        // the record (~V by key, barcodes)
+    int    nbarcodes;               // entries in rec's "barcodes"
+    int    nbc;                     // highest barcode_number in barcodes[]
+    struct bc_record *barcodes;     // barcodes[n - 1] = entry number n (1-99)
+    int    uom_type;                // WEIGH or PCS
+    int64_t spl_price;              // spl_up if positive, else unit_price (paise)
+
+    // Group 1–15: PLU & Basic Info
+    int    plu_id;                  // 1  – PLU No (Unique product number)
+    char   plu_name[64];            // 2  – PLU Name (Product name)
+    char   plu_code[32];            // 3  – PLU Code (Internal product code)
+    char   guom[32];                // 4  – GUOM (Unit) (General Unit of Measure)
+    int64_t unit_price;             // 5  – Unit Price (Normal unit rate), paise
+    char   spl_up[32];              // 6  – Special Unit Price (Promotional price)
+    int    quantity;                // 7  – Quantity (Number of units)
+    int64_t tare_wt;                // 8  – Tare Weight (Packaging weight), mg
+    int64_t fixed_price;            // 9  – Fixed Price (Any fixed price override), paise
+    char   packed_date[16];         // 10 – Packed Date (Packaging date string)
+    char   packed_time[16];         // 11 – Packed Time (Packaging time string)
+    char   sellby_date[16];         // 12 – Sell By Date (Recommended sell-before date)
+    char   sellby_time[16];         // 13 – Sell By Time (Recommended sell-before time)
+    char   useby_date[16];          // 14 – Use By Date (Expiry date)
+    char   useby_time[16];          // 15 – Use By Time (Expiry time)
+
+    // Group 16–40: Classification & Header/Footer
+    int64_t plu_minimum;            // 16 – PLU Minimum (Minimum stock/weight), 1/1000
+    int64_t plu_target;             // 17 – PLU Target (Target stock/weight), 1/1000
+    int64_t plu_maximum;            // 18 – PLU Maximum (Maximum stock/weight), 1/1000
+    int    group_no;                // 19 – Group No (Product group ID)
+    char   group_name[64];          // 20 – Group Name (Product group name)
+    int    department_no;           // 21 – Department No (Department ID)
+    char   department_name[64];     // 22 – Department Name (Department label)
+    int    tax_no;                  // 23 – Tax No (Tax scheme ID)
+    char   tax_name[64];            // 24 – Tax Name (Tax label, e.g. GST)
+    char   tax_type[32];            // 25 – Tax Type (Inclusive/Exclusive)
+    int64_t tax_rate;               // 26 – Tax Rate (Percentage), 1/1000
+    int    operator_no;             // 27 – Operator No (User/operator ID)
+    char   operator_name[64];       // 28 – Operator Name (User/operator name)
+    char   operator_password[32];   // 29 – Operator Password (Not displayed)
+
+    char   header1[64];             // 30 – Header1 (Custom header line 1)
+    char   header2[64];             // 31 – Header2 (Custom header line 2)
+    char   header3[64];             // 32 – Header3 (Custom header line 3)
+    char   header4[64];             // 33 – Header4 (Custom header line 4)
+    char   header5[64];             // 34 – Header5 (Custom header line 5)
+    char   footer1[64];             // 35 – Footer1 (Custom footer line 1)
+    char   footer2[64];             // 36 – Footer2 (Custom footer line 2)
+    char   footer3[64];             // 37 – Footer3 (Custom footer line 3)
+    char   footer4[64];             // 38 – Footer4 (Custom footer line 4)
+    char   footer5[64];             // 39 – Footer5 (Custom footer line 5)
+    int    discount_no;             // 40 – Discount No (Applied discount ID)
+
+    // Group 41–60: Promotion, Packaging, Barcode, Discount Info
+    char   discount_name[64];       // 41 – Discount Name (Discount description)
+    char   discount_type[16];       // 42 – Discount Type (Flat or Percentage)
+    int64_t discount_first_target;  // 43 – Discount First Target (Threshold), 1/1000
+    int64_t discount_first_value;   // 44 – Discount First Value (Amount), paise
+    int64_t discount_second_target; // 45 – Discount Second Target (Threshold), 1/1000
+    int64_t discount_second_value;  // 46 – Discount Second Value (Amount), paise
+    char   discount_days[32];       // 47 – Discount Days (Applicable days)
+    char   discount_start[32];      // 48 – Discount Start (Begin time/date)
+    char   discount_end[32];        // 49 – Discount End (End time/date)
+    char   package_type[32];        // 50 – Package Type (Packaging style)
+    char   tare_name[64];           // 51 – Tare Name (Container name)
+    int64_t tare_value;             // 52 – Tare Value (Container weight), mg
+    char   storage_temp[32];        // 53 – Storage Temperature (Recommended storage)
+    char   barcode_name[64];        // 54 – Barcode Name (Label name)
+    char   barcode_type[32];        // 55 – Barcode Type (EAN13, CODE128, etc.)
+    char   barcode_data[64];        // 56 – Barcode Data (Encoded string)
+    char   bc_field1[32];           // 57 – BC Field1 (Barcode field 1 value)
+    char   bc_field1_con[32];       // 58 – BC Field1 Concat (Concatenation rule)
+    char   bc_field1_shift[32];     // 59 – BC Field1 Shift (Shift rule)
+    char   bc_field2[32];           // 60 – BC Field2 (Barcode field 2 value)
+
+    // Group 61–80: Ingredients, Label, Image, Billing
+    char   bc_field2_con[32];       // 61 – BC Field2 Condition (Condition rule)
+    char   bc_field2_shift[32];     // 62 – BC Field2 Shift (Shift rule)
+    int    ingredient_no;           // 63 – Ingredient No (Ingredient ID)
+    char   ingredient_name[64];     // 64 – Ingredient Name (Description)
+    char   ingredients_text[512];   // 65 – Ingredients Text (List)
+    int    message_no;              // 66 – Message No (Message ID)
+    char   message_name[64];        // 67 – Message Name (Title)
+    char   message_text[512];       // 68 – Message Text (Content)
+    int64_t current_net_weight;     // 69 – Current Net Weight (Net weight), mg
+    int64_t current_tare_weight;    // 70 – Current Tare Weight (Tare weight), mg
+    int64_t current_gross_weight;   // 71 – Current Gross Weight (Gross weight), mg
+    int64_t weight_or_quantity;     // 72 – Weight or Quantity (Auto choose), mg
+    int64_t actual_unit_price;      // 73 – Actual Unit Price (Final rate), paise
+    int    image_no;                // 74 – Image No (Image reference)
+    char   image_file_name[32];     // 75 – Image File Name (Filename)
+    char   label_date_time[32];     // 76 – Label DateTime (Timestamp)
+    int    label_design_no;         // 77 – Label Design No (Template ID)
+    char   label_file_name[32];     // 78 – Label File Name (Filename)
+    int    bill_no;                 // 79 – Bill No (Transaction ID)
+    char   scale_no[32];            // 80 – Scale No (Scale ID)
+
+    // Group 81–96: Final Totals, Output Info
+    char   scale_name[64];          // 81 – Scale Name (Model name)
+    int64_t scale_capacity;         // 82 – Scale Capacity (Max weight), 1/1000
+    int64_t scale_accuracy;         // 83 – Scale Accuracy (Precision), mg
+    char   current_datetime[32];    // 84 – Current DateTime (Timestamp)
+    int    no_of_items;             // 85 – No of Items (Item count)
+    int64_t total_amount;           // 86 – Total Amount (Sum amount), paise
+    int64_t total_quantity;         // 87 – Total Quantity (Sum units), 1/1000
+    int64_t total_weight;           // 88 – Total Weight (Sum weight), mg
+    int64_t total_qty_or_weight;    // 89 – Total Qty/Weight (Best fit), mg
+    int64_t total_tax;              // 90 – Total Tax (Tax amount), paise
+    int64_t total_discount;         // 91 – Total Discount (Discount amount), paise
+    int    today_bill_no;           // 92 – Today Bill No (Daily bill count)
+    int64_t total_price;            // 93 – Total Price (Net price), paise
+    char   uom[32];                 // 94 – Unit of Measure (e.g. KG, PCS)
+    char   barcode_flag[32];        // 95 – Barcode Flag (Encoded flag)
+    char   bill_text[128];          // 96 – Bill Text (Payment note)
+};
+
+unsigned char CheckPrintStatus(const struct render_context *ctx, char prnstatus) {
+    const struct product *p = ctx->prod;
+
+    if (prnstatus == '0') return 0;  // Never print
+    if (prnstatus == '1') return 1;  // Always print
+
+    if (prnstatus == '2') return (p->uom_type == WEIGH); // Only for weighing items
+    if (prnstatus == '3') return (p->uom_type == PCS);   // Only for PCS
+
+    if (prnstatus == '4') return (p->uom_type == WEIGH && p->unit_price == p->actual_unit_price);
+    if (prnstatus == '5') return (p->uom_type == PCS && p->unit_price == p->actual_unit_price);
+
+    return 1; // Default: print
+}
+
+// Read and parse a product JSON file; NULL (after saying why) on failure
+struct json_object *read_json_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror("fopen"); return NULL; }
+
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) { perror("fstat"); fclose(f); return NULL; }
+
+    char *data = malloc(st.st_size + 1);
+    if (!data) { perror("malloc"); fclose(f); return NULL; }
+
+    fread(data, 1, st.st_size, f);
+    data[st.st_size] = '\0';
+    fclose(f);
+
+    // Parse JSON once
+    struct json_object *root = json_tokener_parse(data);
+    if (!root)
+        fprintf(stderr, "JSON parse error\n");
+    free(data);
+    return root;
+}
+
+// ─── Data-ID registry ─────────────────────────────────────────────
+// One entry per data ID: the JSON key it is loaded from, where it lives
+// in struct product and how ~V prints it. A NULL format means the value
+// needs more than a printf (see fld_format_special); fixed-point values
+// only use the "%.<n>f" format for its n. product_new() finds
+// keys through fld_index, a perfect hash: the multiplier is picked once,
+// the first time it is needed, so that no two keys share a slot.
+
+enum fld_type { FLD_INT, FLD_FIX, FLD_STR };
+
+struct field_desc {
+    const char    *key;
+    unsigned char  type;        // enum fld_type
+    unsigned char  scale;       // FLD_FIX: decimals held (FX_MONEY, ...)
+    unsigned short off, size;
+    const char    *fmt;
+};
+
+#define FLD_I(k, f, fmt) { k, FLD_INT, 0, offsetof(struct product, f), 0, fmt }
+#define FLD_F(k, f, scale, fmt) { k, FLD_FIX, scale, offsetof(struct product, f), 0, fmt }
+#define FLD_S(k, f, fmt) { k, FLD_STR, 0, offsetof(struct product, f), \
+                           sizeof(((struct product *)0)->f), fmt }
+
+#define FLD_COUNT 97            // data IDs 1–96
+
+static const struct field_desc data_fields[FLD_COUNT] = {
+    [1]  = FLD_I("plu_id",                  plu_id,                  "%04d"),  // PLU No
+    [2]  = FLD_S("plu_name",                plu_name,                "%s"),    // PLU Name
+    [3]  = FLD_S("plu_code",                plu_code,                "%s"),    // PLU Code
+    [4]  = FLD_S("guom",                    guom,                    NULL),    // GUOM (printed as g / kg / PCS)
+    [5]  = FLD_F("unit_price",              unit_price,              FX_MONEY,  "%.2f"),  // Unit Price
+    [6]  = FLD_S("spl_up",                  spl_up,                  NULL),    // Special Unit Price
+    [7]  = FLD_I("quantity",                quantity,                "%02d"),  // Quantity
+    [8]  = FLD_F("tare_wt",                 tare_wt,                 FX_WEIGHT, "%.3f"),  // Tare Weight
+    [9]  = FLD_F("fixed_price",             fixed_price,             FX_MONEY,  "%.2f"),  // Fixed Price
+    [10] = FLD_S("packed_date",             packed_date,             "%s"),    // Packed Date
+    [11] = FLD_S("packed_time",             packed_time,             "%s"),    // Packed Time
+    [12] = FLD_S("sellby_date",             sellby_date,             "%s"),    // Sell By Date
+    [13] = FLD_S("sellby_time",             sellby_time,             "%s"),    // Sell By Time
+    [14] = FLD_S("useby_date",              useby_date,              "%s"),    // Use By Date
+    [15] = FLD_S("useby_time",              useby_time,              "%s"),    // Use By Time
+    [16] = FLD_F("plu_minimum",             plu_minimum,             FX_QTY,    "%.2f"),  // Minimum
+    [17] = FLD_F("plu_target",              plu_target,              FX_QTY,    "%.2f"),  // Target
+    [18] = FLD_F("plu_maximum",             plu_maximum,             FX_QTY,    "%.2f"),  // Maximum
+    [19] = FLD_I("group_no",                group_no,                "%03d"),  // Group No
+    [20] = FLD_S("group_name",              group_name,              "%s"),    // Group Name
+    [21] = FLD_I("department_no",           department_no,           "%02d"),  // Dept No
+    [22] = FLD_S("department_name",         department_name,         "%s"),    // Dept Name
+    [23] = FLD_I("tax_no",                  tax_no,                  "%d"),    // Tax No
+    [24] = FLD_S("tax_name",                tax_name,                "%s"),    // Tax Name
+    [25] = FLD_S("tax_type",                tax_type,                "%s"),    // Tax Type
+    [26] = FLD_F("tax_rate",                tax_rate,                FX_QTY,    "%.2f"),  // Tax Rate
+    [27] = FLD_I("operator_no",             operator_no,             "%02d"),  // Operator No
+    [28] = FLD_S("operator_name",           operator_name,           "%s"),    // Operator Name
+    [29] = FLD_S("operator_password",       operator_password,       NULL),    // Operator Password (never printed)
+    [30] = FLD_S("header1",                 header1,                 "%s"),    // Header1
+    [31] = FLD_S("header2",                 header2,                 "%s"),    // Header2
+    [32] = FLD_S("header3",                 header3,                 "%s"),    // Header3
+    [33] = FLD_S("header4",                 header4,                 "%s"),    // Header4
+    [34] = FLD_S("header5",                 header5,                 "%s"),    // Header5
+    [35] = FLD_S("footer1",                 footer1,                 "%s"),    // Footer1
+    [36] = FLD_S("footer2",                 footer2,                 "%s"),    // Footer2
+    [37] = FLD_S("footer3",                 footer3,                 "%s"),    // Footer3
+    [38] = FLD_S("footer4",                 footer4,                 "%s"),    // Footer4
+    [39] = FLD_S("footer5",                 footer5,                 "%s"),    // Footer5
+    [40] = FLD_I("discount_no",             discount_no,             "%02d"),  // Discount No
+    [41] = FLD_S("discount_name",           discount_name,           "%s"),    // Discount Name
+    [42] = FLD_S("discount_type",           discount_type,           "%s"),    // Discount Type
+    [43] = FLD_F("discount_first_target",   discount_first_target,   FX_QTY,    NULL),    // 1st Target
+    [44] = FLD_F("discount_first_value",    discount_first_value,    FX_MONEY,  NULL),    // 1st Value
+    [45] = FLD_F("discount_second_target",  discount_second_target,  FX_QTY,    NULL),    // 2nd Target
+    [46] = FLD_F("discount_second_value",   discount_second_value,   FX_MONEY,  NULL),    // 2nd Value
+    [47] = FLD_S("discount_days",           discount_days,           "%s"),    // Discount Days
+    [48] = FLD_S("discount_start",          discount_start,          "%s"),    // Discount Start
+    [49] = FLD_S("discount_end",            discount_end,            "%s"),    // Discount End
+    [50] = FLD_S("package_type",            package_type,            "%s"),    // Package Type
+    [51] = FLD_S("tare_name",               tare_name,               "%s"),    // Tare Name
+    [52] = FLD_F("tare_value",              tare_value,              FX_WEIGHT, "%.2f"),  // Tare Value
+    [53] = FLD_S("storage_temp",            storage_temp,            "%s"),    // Storage Temp
+    [54] = FLD_S("barcode_name",            barcode_name,            "%s"),    // Barcode Name
+    [55] = FLD_S("barcode_type",            barcode_type,            "%s"),    // Barcode Type
+    [56] = FLD_S("barcode_data",            barcode_data,            "%s"),    // Barcode Data
+    [57] = FLD_S("bc_field1",               bc_field1,               "%s"),    // BC Field 1
+    [58] = FLD_S("bc_field1_con",           bc_field1_con,           "%s"),    // BC Field1 Con
+    [59] = FLD_S("bc_field1_shift",         bc_field1_shift,         "%s"),    // BC Field1 Shift
+    [60] = FLD_S("bc_field2",               bc_field2,               "%s"),    // BC Field2
+    [61] = FLD_S("barcode_field2_condition", bc_field2_con,           "%s"),    // BC Field2 Con
+    [62] = FLD_S("barcode_field2_shift",    bc_field2_shift,         "%s"),    // BC Field2 Shift
+    [63] = FLD_I("ingredient_no",           ingredient_no,           "%03d"),  // Ingredient No
+    [64] = FLD_S("ingredient_name",         ingredient_name,         "%s"),    // Ingredient Name
+    [65] = FLD_S("ingredients_text",        ingredients_text,        "%s"),    // Ingredients Text
+    [66] = FLD_I("message_no",              message_no,              "%03d"),  // Message No
+    [67] = FLD_S("message_name",            message_name,            "%s"),    // Message Name
+    [68] = FLD_S("message_text",            message_text,            "%s"),    // Message Text
+    [69] = FLD_F("current_net_weight",      current_net_weight,      FX_WEIGHT, "%.3f"),  // Net Wt
+    [70] = FLD_F("current_tare_weight",     current_tare_weight,     FX_WEIGHT, "%.3f"),  // Tare Wt
+    [71] = FLD_F("current_gross_weight",    current_gross_weight,    FX_WEIGHT, "%.3f"),  // Gross Wt
+    [72] = FLD_F("weight_or_quantity",      weight_or_quantity,      FX_WEIGHT, NULL),    // Weight or Quantity
+    [73] = FLD_F("actual_unit_price",       actual_unit_price,       FX_MONEY,  "%.2f"),  // Actual Unit Price
+    [74] = FLD_I("image_no",                image_no,                "%02d"),  // Image No
+    [75] = FLD_S("image_file_name",         image_file_name,         "%s"),    // Image Filename
+    [76] = FLD_S("label_datetime",          label_date_time,         "%s"),    // Label Datetime
+    [77] = FLD_I("label_design_no",         label_design_no,         "%02d"),  // Label Design No
+    [78] = FLD_S("label_file_name",         label_file_name,         "%s"),    // Label Filename
+    [79] = FLD_I("bill_no",                 bill_no,                 "%05d"),  // Bill No
+    [80] = FLD_S("scale_no",                scale_no,                "%s"),    // Scale No
+    [81] = FLD_S("scale_name",              scale_name,              "%s"),    // Scale Name
+    [82] = FLD_F("scale_capacity",          scale_capacity,          FX_QTY,    "%.0f"),  // Capacity
+    [83] = FLD_F("scale_accuracy",          scale_accuracy,          FX_WEIGHT, "%.3f"),  // Accuracy
+    [84] = FLD_S("current_datetime",        current_datetime,        "%s"),    // Current DateTime
+    [85] = FLD_I("no_of_items",             no_of_items,             "%02d"),  // No. of Items
+    [86] = FLD_F("total_amount",            total_amount,            FX_MONEY,  "%.2f"),  // Total Amount
+    [87] = FLD_F("total_quantity",          total_quantity,          FX_QTY,    "%.0f"),  // Total Qty
+    [88] = FLD_F("total_weight",            total_weight,            FX_WEIGHT, "%.3f"),  // Total Weight
+    [89] = FLD_F("total_qty_or_weight",     total_qty_or_weight,     FX_WEIGHT, NULL),    // Total Qty or Wt
+    [90] = FLD_F("total_tax",               total_tax,               FX_MONEY,  "%.2f"),  // Total Tax
+    [91] = FLD_F("total_discount",          total_discount,          FX_MONEY,  "%.2f"),  // Total Discount
+    [92] = FLD_I("today_bill_no",           today_bill_no,           "%05d"),  // Today Bill No
+    [93] = FLD_F("total_price",             total_price,             FX_MONEY,  "%.2f"),  // Final Price
+    [94] = FLD_S("uom",                     uom,                     NULL),    // Unit of Measure (printed as kg / PCS)
+    [95] = FLD_S("barcode_flag",            barcode_flag,            "%s"),    // Barcode Flag
+    [96] = FLD_S("bill_text",               bill_text,               "%s"),    // Bill Text
+};
+
+#define FLD_INDEX_BITS 10
+static uint8_t  fld_index[1 << FLD_INDEX_BITS];     // slot -> data ID, 0 = free
+static uint32_t fld_mult;
+static pthread_once_t fld_once = PTHREAD_ONCE_INIT;
+
+static uint32_t fld_hash(const char *k) {           // FNV-1a
+    uint32_t h = 2166136261u;
+    while (*k) h = (h ^ (uint8_t)*k++) * 16777619u;
+    return h;
+}
+
+static unsigned fld_slot(uint32_t h) {
+    return (h * fld_mult) >> (32 - FLD_INDEX_BITS);
+}
+
+// Try multipliers until every key gets a slot of its own
+static void fld_index_build(void) {
+    for (fld_mult = 0x9E3779B1u; ; fld_mult += 2) {
+        memset(fld_index, 0, sizeof(fld_index));
+        int id;
+        for (id = 1; id < FLD_COUNT; id++) {
+            uint8_t *sl = &fld_index[fld_slot(fld_hash(data_fields[id].key))];
+            if (*sl) break;
+            *sl = id;
+        }
+        if (id == FLD_COUNT) return;
+    }
+}
+
+// Data ID loaded from a JSON key, 0 if none
+static int fld_lookup(const char *key) {
+    int id = fld_index[fld_slot(fld_hash(key))];
+    return id && strcmp(data_fields[id].key, key) == 0 ? id : 0;
+}
+
+static void fld_store(struct product *p, const struct field_desc *f, struct json_object *val) {
+    char *dst = (char *)p + f->off;
+    switch (f->type) {
+    case FLD_INT: *(int *)dst = json_object_get_int(val);       break;
+    case FLD_FIX: {             // the value's text, so "12.35" stays exact
+        const char *s = json_object_get_string(val);
+        int64_t v = 0;
+        if (s && *fx_parse(s, f->scale, &v) != '\0') v = 0;
+        *(int64_t *)dst = v;
+        break;
+    }
+    case FLD_STR: {
+        const char *s = json_object_get_string(val);
+        if (s) { strncpy(dst, s, f->size - 1); dst[f->size - 1] = '\0'; }
+        break;
+    }
+    }
+}
+
+// ─── Barcode records ──────────────────────────────────────────────
+// A product's "barcodes" array is parsed once, when its snapshot is
+// built, into records indexed by barcode_number. Each entry's
+// barcode_data ("2F 13C 5S 5X 1%1") is compiled into a list of ops
+// that GetBarcodeData() runs straight into the output buffer. A change
+// to the barcodes makes a new snapshot, so a record never goes stale.
+
+#define BC_MAX_NUMBER 99
+
+struct bc_op {
+    char     code;              // format letter ('C', 'X', '%', ...)
+    uint8_t  lit_len;           // '%': literal length
+    uint16_t width;             // field width (digits before the letter, min 1)
+    uint16_t lit_off;           // '%': literal offset in lit[]
+    int16_t  arg;               // '*': width of the weight column
+};
+
+struct bc_format {
+    int   nops;
+    char *lit;                  // '%' literals, after ops[]
+    struct bc_op ops[];
+};
+
+// Parse a format string; the same rules the interpreter used to apply per print
+static struct bc_format *bc_compile(const char *src) {
+    size_t n = strlen(src);
+    struct bc_format *f = malloc(sizeof(*f) + n * sizeof(struct bc_op) + n + 1);
+    if (!f) return NULL;
+    f->nops = 0;
+    f->lit = (char *)&f->ops[n];
+    size_t i = 0, lit = 0;
+
+    while (i < n) {
+        if (src[i] == ' ') { i++; continue; }
+        int w = 0;
+        while (isdigit((unsigned char)src[i])) {
+            w = w * 10 + (src[i++] - '0');
+            if (w > 999) w = 999;
+        }
+        struct bc_op *op = &f->ops[f->nops++];
+        memset(op, 0, sizeof(*op));
+        op->width = w ? w : 1;
+        op->code = src[i];
+        if (i < n) i++;             // a trailing width pads with spaces
+
+        if (op->code == '%') {      // literal up to the next space, at most 63 chars
+            while (i < n && src[i] == ' ') i++;
+            op->lit_off = lit;
+            while (i < n && src[i] != ' ' && op->lit_len < 63) {
+                f->lit[lit++] = src[i++];
+                op->lit_len++;
+            }
+        } else if (op->code == '*') {
+            op->arg = i < n ? atoi(&src[i++]) : 0;
+        }
+    }
+    f->lit[lit] = '\0';
+    return f;
+}
+
+enum bc_cond { BC_NEVER, BC_ALWAYS, BC_IF_WEIGHT, BC_IF_QTY };
+
+// Text printed under the bars (barcode_fld1/2 with its condition and shift)
+struct bc_field {
+    char    text[16];
+    uint8_t cond;               // enum bc_cond
+    bool    left;               // shift 'L'eft of the bars, else right
+    int8_t  shift;              // modules
+};
+
+struct bc_record {
+    struct bc_format *fmt;      // compiled barcode_data, NULL = no such entry
+    char   type[16];            // barcode_type
+    struct bc_field fld[2];
+};
+
+// Copy a string member of a barcodes[] entry, truncated to cap
+static void bc_str(struct json_object *entry, const char *key, char *out, size_t cap) {
+    struct json_object *v;
+    if (json_object_object_get_ex(entry, key, &v) && json_object_get_type(v) == json_type_string)
+        snprintf(out, cap, "%s", json_object_get_string(v));
+}
+
+static void bc_field_parse(struct json_object *entry, const char *text, const char *cond,
+                           const char *shift, struct bc_field *fd) {
+    char c[16] = "", sh[4] = "";
+    bc_str(entry, text, fd->text, sizeof(fd->text));
+    bc_str(entry, cond, c, sizeof(c));
+    bc_str(entry, shift, sh, sizeof(sh));
+
+    if (!strcmp(c, "No") || !strcmp(c, "Any")) fd->cond = BC_ALWAYS;
+    else if (!strcmp(c, "Weight"))             fd->cond = BC_IF_WEIGHT;
+    else if (!strcmp(c, "Quantity"))           fd->cond = BC_IF_QTY;
+    else                                       fd->cond = BC_NEVER;
+    fd->left = (sh[0] == 'L');
+    fd->shift = (sh[0] ? sh[1] : 0) - '0';     // "L2" = 2 modules left
+}
+
+// Fill p->barcodes from rec's array; the first entry with a number wins
+static void bc_table_build(struct product *p, struct json_object *arr) {
+    int n = p->nbarcodes;
+    for (int i = 0; i < n; i++) {
+        struct json_object *v, *entry = json_object_array_get_idx(arr, i);
+        if (entry && json_object_object_get_ex(entry, "barcode_number", &v)) {
+            int num = json_object_get_int(v);
+            if (num >= 1 && num <= BC_MAX_NUMBER && num > p->nbc) p->nbc = num;
+        }
+    }
+    if (!p->nbc || !(p->barcodes = calloc(p->nbc, sizeof(*p->barcodes)))) {
+        p->nbc = 0;
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct json_object *v, *entry = json_object_array_get_idx(arr, i);
+        if (!entry || !json_object_object_get_ex(entry, "barcode_number", &v))
+            continue;
+        int num = json_object_get_int(v);
+        if (num < 1 || num > p->nbc || p->barcodes[num - 1].fmt)
+            continue;
+
+        struct bc_record *r = &p->barcodes[num - 1];
+        char *data = NULL;
+        if (json_object_object_get_ex(entry, "barcode_data", &v)
+            && json_object_get_type(v) == json_type_string)
+            data = (char *)json_object_get_string(v);
+        if (!(r->fmt = bc_compile(data ? data : ""))) {
+            fprintf(stderr, "Warning: no memory for barcode %d format\n", num);
+            continue;
+        }
+        bc_str(entry, "barcode_type", r->type, sizeof(r->type));
+        bc_field_parse(entry, "barcode_fld1", "fld1_condition", "fld1_shift", &r->fld[0]);
+        bc_field_parse(entry, "barcode_fld2", "fld2_condition", "fld2_shift", &r->fld[1]);
+    }
+}
+
+static void bc_table_free(struct product *p) {
+    for (int i = 0; i < p->nbc; i++)
+        free(p->barcodes[i].fmt);
+    free(p->barcodes);
+}
+
+// Record of a barcode number; an empty one if the product has no such entry
+static const struct bc_record *bc_record_get(const struct product *p, int number) {
+    static const struct bc_record none;
+    return (number >= 1 && number <= p->nbc) ? &p->barcodes[number - 1] : &none;
+}
+
+// Parse a product record ({"data": {...}, "barcodes": [...]}); the new
+// product takes over the caller's reference to rec. NULL if out of memory.
+static struct product *product_new(struct json_object *rec) {
+    struct product *p = calloc(1, sizeof(*p));
+    if (!p) {
+        json_object_put(rec);
+        return NULL;
+    }
+    atomic_init(&p->refs, 1);
+    p->rec = rec;
+
+    // If there’s a "data" object, work on that; otherwise stick to top-level
+    struct json_object *dataobj = NULL;
+    struct json_object *root = rec;
+
+    if (json_object_object_get_ex(rec, "data", &dataobj)
+        && json_object_get_type(dataobj) == json_type_object)
+    {
+        root = dataobj;
+    }
+
+    // 1) Basic fields, through the registry
+    pthread_once(&fld_once, fld_index_build);
+    json_object_object_foreach(root, key, val) {
+        int id = fld_lookup(key);
+        if (id) fld_store(p, &data_fields[id], val);
+    }
+
+    if (
+        strcasecmp(p->uom, "kg") == 0 || strcasecmp(p->uom, "g") == 0 ||
+        strcasecmp(p->guom, "kg") == 0 || strcasecmp(p->guom, "g") == 0
+    ) {
+        p->uom_type = WEIGH;
+    } else {
+        p->uom_type = PCS;
+    }
+
+    // Printed prices: actual_unit_price, and spl_up as the unit price
+    struct json_object *price = NULL;
+    if (dataobj && json_object_object_get_ex(dataobj, "actual_unit_price", &price))
+        fx_parse(json_object_get_string(price), FX_MONEY, &p->actual_unit_price);
+    if (dataobj && json_object_object_get_ex(dataobj, "spl_up", &price))
+        fx_parse(json_object_get_string(price), FX_MONEY, &p->unit_price);
+    int64_t spl;
+    fx_parse(p->spl_up, FX_MONEY, &spl);
+    p->spl_price = spl > 0 ? spl : p->unit_price;
+
+    // 2) The "barcodes" array, into records indexed by barcode number
+    struct json_object *barcodes_obj = NULL;
+    if (json_object_object_get_ex(rec, "barcodes", &barcodes_obj)
+        && json_object_is_type(barcodes_obj, json_type_array)) {
+        p->nbarcodes = json_object_array_length(barcodes_obj);
+        bc_table_build(p, barcodes_obj);
+    }
+    return p;
+}
+
+static struct product *product_get(struct product *p) {
+    atomic_fetch_add(&p->refs, 1);
+    return p;
+}
+
+static void product_put(struct product *p) {
+    if (p && atomic_fetch_sub(&p->refs, 1) == 1) {
+        json_object_put(p->rec);
+        bc_table_free(p);
+        free(p);
+    }
+}
+
+//-----------GetVariableText--------------------------------------------------------------------------------
+
+// Data IDs whose text is not a plain printf of the stored value
+static void fld_format_special(const struct product *p, unsigned short data_id, char *buf) {
     switch (data_id) {
-        // 1–9: PLU Info
-        case 1:  sprintf(buf, "%04d", plu_id);                         break; // 1 – PLU No
-        case 2:  strcpy(buf, plu_name);                                break; // 2 – PLU Name
-        case 3:  strcpy(buf, plu_code);                                break; // 3 – PLU Code
         case 4: {
-	    double wgt = weight_or_quantity;
-	    if (strcasecmp(uom, "PCS") == 0) {
+	    if (strcasecmp(p->uom, "PCS") == 0) {
 		strcpy(buf, "PCS");
 	    } else {
 		// weighing item → g or kg
-		if (wgt < 1.0) strcpy(buf, "g");
+		if (p->weight_or_quantity < 1000000) strcpy(buf, "g");
 		else strcpy(buf, "kg");
 	    }
 	    break;
 	}
-       case 5:
-            snprintf(buf, 64, "%.2f", unit_price);
-            break;							// 5 – Unit Price
-        case 6:  // Special Unit Price
-        {
-            // Only use spl_up if it parses to a positive non-zero
-            double sp = atof(spl_up);
-            if (sp > 0.0) {
-                snprintf(buf, 64, "%.2f", sp);
+        case 6:  // Special Unit Price (spl_up if positive, else unit_price)
+            fx_format(buf, p->spl_price, FX_MONEY, 2);
+            break;
+        case 29: buf[0] = '\0';                         break; // 29 – Reserved
+        case 43: fx_format(buf, p->discount_first_target, FX_QTY, strcmp(p->guom, "kg") == 0 ? 2 : 0); break; // 43 – 1st Target
+        case 45: fx_format(buf, p->discount_second_target, FX_QTY, strcmp(p->guom, "kg") == 0 ? 2 : 0); break; // 45 – 2nd Target
+        case 44: case 46: { // 44 / 46 – 1st / 2nd Value
+            int64_t v = data_id == 44 ? p->discount_first_value : p->discount_second_value;
+            if (strcmp(p->discount_type, "Flat") == 0) {
+                memcpy(buf, "Rs. ", 4);
+                fx_format(buf + 4, v, FX_MONEY, 2);
             } else {
-                // fallback to unit_price
-                snprintf(buf, 64, "%.2f", unit_price);
+                strcpy(buf + fx_format(buf, v, FX_MONEY, 2), "%");
             }
+            break;
         }
-        break;
-        case 7:  sprintf(buf, "%02d", quantity);                       break; // 7 – Unit Price Quantity
-        case 8:  sprintf(buf, "%.3f", tare_wt);                        break; // 8 – Tare Weight
-        case 9:  sprintf(buf, "%.2f", fixed_price);                    break; // 9 – Fixed Price
-
-        // 10–15: Dates & Times
-        case 10: strcpy(buf, packed_date);     break; // 10 – Packed Date
-        case 11: strcpy(buf, packed_time);     break; // 11 – Packed Time
-        case 12: strcpy(buf, sellby_date);     break; // 12 – Sell By Date
-        case 13: strcpy(buf, sellby_time);     break; // 13 – Sell By Time
-        case 14: strcpy(buf, useby_date);      break; // 14 – Use By Date
-        case 15: strcpy(buf, useby_time);      break; // 15 – Use By Time
-
-        // 16–18: Thresholds
-        case 16: sprintf(buf, "%.2f", plu_minimum); break; // 16 – Minimum
-        case 17: sprintf(buf, "%.2f", plu_target);  break; // 17 – Target
-        case 18: sprintf(buf, "%.2f", plu_maximum); break; // 18 – Maximum
-
-        // 19–22: Group / Department
-        case 19: sprintf(buf, "%03d", group_no);        break; // 19 – Group No
-        case 20: strcpy(buf, group_name);               break; // 20 – Group Name
-        case 21: sprintf(buf, "%02d", department_no);   break; // 21 – Dept No
-        case 22: strcpy(buf, department_name);          break; // 22 – Dept Name
-
-        // 23–26: Tax
-        case 23: sprintf(buf, "%d", tax_no);            break; // 23 – Tax No
-        case 24: strcpy(buf, tax_name);                 break; // 24 – Tax Name
-        case 25: strcpy(buf, tax_type);                 break; // 25 – Tax Type
-        case 26: sprintf(buf, "%.2f", tax_rate);        break; // 26 – Tax Rate
-
-        // 27–29: Operator
-        case 27: sprintf(buf, "%02d", operator_no);     break; // 27 – Operator No
-        case 28: strcpy(buf, operator_name);            break; // 28 – Operator Name
-        case 29: buf[0] = '\0';                         break; // 29 – Reserved
-
-        // 30–39: Header / Footer
-        case 30: strcpy(buf, header1);  break; // 30 – Header1
-        case 31: strcpy(buf, header2);  break; // 31 – Header2
-        case 32: strcpy(buf, header3);  break; // 32 – Header3
-        case 33: strcpy(buf, header4);  break; // 33 – Header4
-        case 34: strcpy(buf, header5);  break; // 34 – Header5
-        case 35: strcpy(buf, footer1);  break; // 35 – Footer1
-        case 36: strcpy(buf, footer2);  break; // 36 – Footer2
-        case 37: strcpy(buf, footer3);  break; // 37 – Footer3
-        case 38: strcpy(buf, footer4);  break; // 38 – Footer4
-        case 39: strcpy(buf, footer5);  break; // 39 – Footer5
-
-        // 40–49: Discount
-        case 40: sprintf(buf, "%02d", discount_no);                      break; // 40 – Discount No
-        case 41: strcpy(buf, discount_name);                            break; // 41 – Discount Name
-        case 42: strcpy(buf, discount_type);                            break; // 42 – Discount Type
-        case 43: sprintf(buf, strcmp(guom, "kg") == 0 ? "%.2f" : "%.0f", discount_first_target); break; // 43 – 1st Target
-        case 44: sprintf(buf, strcmp(discount_type, "Flat") == 0 ? "Rs. %.2f" : "%.2f%%", discount_first_value); break; // 44 – 1st Value
-        case 45: sprintf(buf, strcmp(guom, "kg") == 0 ? "%.2f" : "%.0f", discount_second_target); break; // 45 – 2nd Target
-        case 46: sprintf(buf, strcmp(discount_type, "Flat") == 0 ? "Rs. %.2f" : "%.2f%%", discount_second_value); break; // 46 – 2nd Value
-        case 47: strcpy(buf, discount_days);                            break; // 47 – Discount Days
-        case 48: strcpy(buf, discount_start);                           break; // 48 – Discount Start
-        case 49: strcpy(buf, discount_end);                             break; // 49 – Discount End
-
-        // 50–53: Package & Tare
-        case 50: strcpy(buf, package_type);                             break; // 50 – Package Type
-        case 51: strcpy(buf, tare_name);                                break; // 51 – Tare Name
-        case 52: sprintf(buf, "%.2f", tare_value);                      break; // 52 – Tare Value
-        case 53: strcpy(buf, storage_temp);                             break; // 53 – Storage Temp
-
-        // 54–62: Barcode
-        case 54: strcpy(buf, barcode_name);                             break; // 54 – Barcode Name
-        case 55: strcpy(buf, barcode_type);                             break; // 55 – Barcode Type
-        case 56: strcpy(buf, barcode_data);                             break; // 56 – Barcode Data
-        case 57: strcpy(buf, bc_field1);                                break; // 57 – BC Field 1
-        case 58: strcpy(buf, bc_field1_con);                            break; // 58 – BC Field1 Con
-        case 59: strcpy(buf, bc_field1_shift);                          break; // 59 – BC Field1 Shift
-        case 60: strcpy(buf, bc_field2);                                break; // 60 – BC Field2
-        case 61: strcpy(buf, bc_field2_con);                            break; // 61 – BC Field2 Con
-        case 62: strcpy(buf, bc_field2_shift);                          break; // 62 – BC Field2 Shift
-
-        // 63–68: Ingredients & Messages
-        case 63: sprintf(buf, "%03d", ingredient_no);                   break; // 63 – Ingredient No
-        case 64: strcpy(buf, ingredient_name);                          break; // 64 – Ingredient Name
-	case 65:
-    strcpy(buf, ingredients_text);
-    break;
-
-
-							// 65 – Ingredients Text
-        case 66: sprintf(buf, "%03d", message_no);                      break; // 66 – Message No
-        case 67: strcpy(buf, message_name);                             break; // 67 – Message Name
-        case 68: strcpy(buf, message_text);                             break; // 68 – Message Text
-
-        // 69–73: Weights / Prices
-        case 69: sprintf(buf, "%.3f", current_net_weight);              break; // 69 – Net Wt
-        case 70: sprintf(buf, "%.3f", current_tare_weight);             break; // 70 – Tare Wt
-        case 71: sprintf(buf, "%.3f", current_gross_weight);            break; // 71 – Gross Wt
         case 72: {
-	    double tf = weight_or_quantity;
-	    if (uom_type == WEIGH) {
-		if (lbl_wtgrams && tf <= 1.0) {
-		    int grams = (int)(tf * 1000);
-		    snprintf(buf, 64, "%d", grams);  // grams, integer
-		} else {
-		    snprintf(buf, 64, "%.3f", tf);   // kg, 3 decimal places
-		}
+	    int64_t tf = p->weight_or_quantity;
+	    if (p->uom_type == WEIGH) {
+		if (lbl_wtgrams && tf <= 1000000)
+		    fx_format(buf, tf / 1000, 0, 0);        // grams, integer
+		else
+		    fx_format(buf, tf, FX_WEIGHT, 3);       // kg, 3 decimal places
 	    } else {
-		snprintf(buf, 64, "%.0f", tf);  // non-weighing → quantity, no decimal
+		fx_format(buf, tf, FX_WEIGHT, 0);  // non-weighing → quantity, no decimal
 	    }
 	} break;
-        case 73:
-            snprintf(buf, 64, "%.2f", actual_unit_price);
-            break;				
-
-        // 74–78: Label & Image
-        case 74: sprintf(buf, "%02d", image_no);                        break; // 74 – Image No
-        case 75: strcpy(buf, image_file_name);                          break; // 75 – Image Filename
-        case 76: strcpy(buf, label_date_time);                          break; // 76 – Label Datetime
-        case 77: sprintf(buf, "%02d", label_design_no);                break; // 77 – Label Design No
-        case 78: strcpy(buf, label_file_name);                          break; // 78 – Label Filename
-
-        // 79–80: Bill & Scale
-        case 79: sprintf(buf, "%05d", bill_no);                         break; // 79 – Bill No
-        case 80: strcpy(buf, scale_no);                                 break; // 80 – Scale No
-
-        // 81–83: Scale Info
-        case 81: strcpy(buf, scale_name);                               break; // 81 – Scale Name
-        case 82: sprintf(buf, "%.0f", scale_capacity);                 break; // 82 – Capacity
-        case 83: sprintf(buf, "%.3f", scale_accuracy);                 break; // 83 – Accuracy
-
-        // 84: Current DateTime
-        case 84: strcpy(buf, current_datetime);                         break; // 84 – Current DateTime
-
-        // 85–92: Totals
-        case 85: sprintf(buf, "%02d", no_of_items);                    break; // 85 – No. of Items
-        case 86: sprintf(buf, "%.2f", total_amount);                   break; // 86 – Total Amount
-        case 87: sprintf(buf, "%.0f", total_quantity);                 break; // 87 – Total Qty
-        case 88: sprintf(buf, "%.3f", total_weight);                   break; // 88 – Total Weight
-        case 89: sprintf(buf, total_quantity > 0 ? "%.0f" : "%.3f", total_quantity > 0 ? total_quantity : total_weight); break; // 89 – Total Qty or Wt
-        case 90: sprintf(buf, "%.2f", total_tax);                      break; // 90 – Total Tax
-        case 91: sprintf(buf, "%.2f", total_discount);                 break; // 91 – Total Discount
-        case 92: sprintf(buf, "%05d", today_bill_no);                  break; // 92 – Today Bill No
-
-        // 93–96: Other
-        case 93: sprintf(buf, "%.2f", total_price); break; // 93 – Final Price
+        case 89: // 89 – Total Qty or Wt
+            if (p->total_quantity > 0) fx_format(buf, p->total_quantity, FX_QTY, 0);
+            else fx_format(buf, p->total_weight, FX_WEIGHT, 3);
+            break;
         case 94: {
-	    if (strcasecmp(uom, "PCS") == 0) {
+	    if (strcasecmp(p->uom, "PCS") == 0) {
 		strcpy(buf, "PCS");
 	    } else {
 		strcpy(buf, "kg");
 	    }
 	    break;
 	}
+    }
+}
 
-        case 95: strcpy(buf, barcode_flag);                            break; // 95 – Barcode Flag
-        case 96: if (bill_text[0]) strcpy(buf, bill_text); else buf[0] = '\0'; break; // 96 – Bill Text
+// Text of a data ID for the job's product; -1 (and "") for an unknown ID
+int GetVariableText(const struct render_context *ctx, unsigned short data_id, char *buf) {
+    const struct product *p = ctx->prod;
 
-        default: buf[0] = '\0'; return -1;
+    if (data_id == 0 || data_id >= FLD_COUNT) {
+        buf[0] = '\0';
+        return -1;
+    }
+    const struct field_desc *f = &data_fields[data_id];
+    const char *src = (const char *)p + f->off;
+    if (!f->fmt) {
+        fld_format_special(p, data_id, buf);
+        return 0;
+    }
+    switch (f->type) {
+    case FLD_INT: sprintf(buf, f->fmt, *(const int *)src);    break;
+    case FLD_FIX: fx_format(buf, *(const int64_t *)src, f->scale, f->fmt[2] - '0'); break;
+    case FLD_STR: strcpy(buf, src);                           break;
     }
     return 0;
 }
@@ -1058,13 +2482,6 @@ void GetItemInfoByIndex(int idx, char *out_plu, float *out_qty_wt, int *out_uom)
 }
 float ConvertToGrams(float w) { return w * 1000.0f; }
 
-// External placeholders
-extern char   barcode_data[64];
-extern int    plu_id, department_no, no_of_items, operator_no, group_no;
-extern char plu_code[32], guom[32], scale_no[32], scale_name[64], barcode_flag[32], bill_text[128];
-extern double total_amount, total_weight, total_quantity, total_tax, total_discount, total_price;
-extern double unit_price, weight_or_quantity, tare_wt, current_gross_weight;
-
 // Helper: parse date/time strings
 static void parse_dt(const char *ds, const char *ts, struct tm *out) {
     memset(out, 0, sizeof *out);
@@ -1078,154 +2495,140 @@ static void parse_dt(const char *ds, const char *ts, struct tm *out) {
 
 //------------GetBarcode Data-------------------------------------------------------------------------------------------
 
-int GetBarcodeData(char *bdp, const char *bt) {
-    char t[64]; size_t i = 0;
+// Append to a barcode being built; output past cap is dropped
+static size_t bc_printf(char *buf, size_t cap, size_t pos, const char *fmt, ...) {
+    if (pos + 1 >= cap) return pos;
+    va_list ap;
+    va_start(ap, fmt);
+    int k = vsnprintf(buf + pos, cap - pos, fmt, ap);
+    va_end(ap);
+    if (k < 0) return pos;
+    return (size_t)k < cap - pos ? pos + k : cap - 1;
+}
+
+// Append v zero-padded to width w, as %0*lld would, without printf
+static size_t bc_put_int(char *buf, size_t cap, size_t pos, int64_t v, int w) {
+    char tmp[24];
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    int n = 0;
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    int len = n + (v < 0);
+    if (pos + (len > w ? len : w) >= cap)       // only the truncated tail
+        return bc_printf(buf, cap, pos, "%0*lld", w, (long long)v);
+    if (v < 0) buf[pos++] = '-';
+    for (; len < w; len++) buf[pos++] = '0';
+    while (n) buf[pos++] = tmp[--n];
+    buf[pos] = '\0';
+    return pos;
+}
+
+// Run a compiled format for the job's product into bdp (cap bytes)
+int GetBarcodeData(const struct render_context *ctx, char *bdp, size_t cap,
+                   const struct bc_format *f) {
+    const struct product *p = ctx->prod;
     RTC_CFG rtc;
     struct tm dt;
+    size_t pos = 0;
 
     bdp[0] = '\0';
-    while (i < strlen(barcode_data)) {
-        if (barcode_data[i] == ' ') { i++; continue; }
-        // width (1-99)
-        int w = 0;
-        while (isdigit(barcode_data[i])) w = w*10 + (barcode_data[i++] - '0');
-        if (!w) w = 1;
-        char c = barcode_data[i++];
-        t[0] = '\0';
+    if (!f) return 0;
+    for (int k = 0; k < f->nops; k++) {
+        const struct bc_op *op = &f->ops[k];
+        int w = op->width;
+        char c = op->code;
 
         switch (c) {
-            case 'A': sprintf(t, "%0*.0f", w, total_amount*100); break;  // 86 – TOTAL_AMOUNT
-            case 'B': sprintf(t, "%0*d", w, bill_dd);        break;  // 79 – BILL NO
-            case 'b': sprintf(t, "%0*d", w, bill_mm);        break;  // 92 – Today Bill no
-            case 'C': sprintf(t, "%.*s", w, plu_code);       break;  // 3  – PLU CODE
-            case 'D': sprintf(t, "%0*d", w, department_no);  break;  // 21 – DEPARTMENT NO
-            case 'E': sprintf(t, "%0*.0f", w, total_weight*1000); break; // 88 – TOTAL_WEIGHT
-            case 'F': sprintf(t, "%.*s", w, barcode_flag);   break;  // 95 – FLAG
-            case 'G': sprintf(t, "%0*d", w, group_no);       break;  // 19 – GROUP NO
-            case 'H': sprintf(t, "%0*.0f", w, total_quantity); break; // 87 – TOTAL_QUANTITY
-            case 'I': sprintf(t, "%0*.0f", w, total_tax*100); break; // 90 – TOTAL_TAX
-            case 'J': sprintf(t, "%0*.0f", w, total_discount*100); break; // 91 – TOTAL_DISCOUNT
-            case 'K': RTC_Get(&rtc); sprintf(t, "%02d%02d%02d", rtc.dd, rtc.mm, rtc.yyyy%100); break; // 84 – CURRENT DATE
-            case 'k': sprintf(t, "%02d%02d%02d", bill_dd, bill_mm, bill_yyyy%100); break; // 76 – Label date
-            case 'L': sprintf(t, "%0*d", w, plu_id);        break;  // 1  – PLU NO
-            case 'M': sprintf(t, "%.*s", w, guom);           break;  // 4  – gUOM
-            case 'N': sprintf(t, "%0*d", w, no_of_items);   break;  // 85 – NO OF ITEMS
-            case 'n': sprintf(t, "%*s", w, scale_no);       break;  // 80 – Machine No
-            case 'O': sprintf(t, "%0*d", w, operator_no);   break;  // 27 – OPERATOR NO
-            case 'P': sprintf(t, "%0*.0f", w, total_price*100); break; // 93 – TOTAL PRICE
-            case 'Q': if (!strcmp(guom,"pcs")) sprintf(t, "%0*.0f", w, weight_or_quantity); else sprintf(t, "%0*d", w, 0); break; // 72 – QUANTITY ONLY
-            case 'R': sprintf(t, "%0*d", w, 0);             break;  // 40 – DISCOUNT NO
-            case 'S': {  
-	    double price = unit_price;  
-	    // if spl_up is non‐empty and parses to >0, use it instead  
-	    if (spl_up[0]) {  
-		double sp = atof(spl_up);  
-		if (sp > 0) price = sp;  
-	    }  
-	    // now print price ×100 as integer  
-	    snprintf(t, sizeof t, "%0*.0f", w, price * 100.0);  
-	    break;  
-	}
-	case 's': {  
-	    // same logic but only 4‐digit field  
-	    double price = unit_price;  
-	    if (spl_up[0]) {  
-		double sp = atof(spl_up);  
-		if (sp > 0) price = sp;  
-	    }  
-	    snprintf(t, sizeof t, "%0*.0f", w, price * 100.0);  
-	    break;  
-	}
-
-            case 'T': sprintf(t, "%0*d", w, 0);             break;  // 23 – TAX NO
-            case 't': sprintf(t, "%*.*s", w, w, bill_text);  break;  // 96 – Bill Text
-            case 'U':  // UNIT PRICE always  
-	    snprintf(t, sizeof t, "%0*.0f", w, unit_price * 100.0);  
-	    break;
-
-		    case 'V': case 'v': sprintf(t, "%0*.0f", w, weight_or_quantity*1000); break; // 72 – Special checksum
-            case 'W': if (!strcmp(guom,"kg")) sprintf(t, "%0*.0f", w, weight_or_quantity*1000); else sprintf(t, "%0*d", w, 0); break;  // 72 – WEIGHT ONLY
-            case 'w': sprintf(t, "%0*.0f", w, tare_wt*1000); break;  // 8 – TARE WEIGHT
-            case 'X': sprintf(t, "%0*.0f", w, weight_or_quantity*1000); break; // 72 – WEIGHT OR QUANTITY
-            case 'x': sprintf(t, "%0*.0f", w, current_gross_weight*1000); break; // 71 – GROSS WEIGHT
-            case 'Y': RTC_Get(&rtc); sprintf(t, "%02d%02d%02d", rtc.hr, rtc.min, rtc.sec); break;  // 84 – CURRENT TIME
-            case 'y': sprintf(t, "%02d%02d%02d", bill_hr, bill_min, bill_sec); break; // 76 – LABEL TIME
-            case 'Z': sprintf(t, "%.*s", w, scale_name);     break;  // 81 – MACHINE NAME
-            case 'z': sprintf(t, "%0*d", w, tare_no);       break;  // 52 – TARE LINK NO
-            case '%': {
-    char lit[64];
-    int  p = 0;
-    // skip any spaces
-    while (i < (int)strlen(barcode_data) && barcode_data[i]==' ')
-        i++;
-    // copy up to next space or end
-    while (i < (int)strlen(barcode_data)
-        && barcode_data[i] != ' '
-        && p < (int)(sizeof(lit)-1))
-    {
-        lit[p++] = barcode_data[i++];
-    }
-    lit[p] = '\0';
-    // truncate to w chars of the literal:
-    snprintf(t, sizeof t, "%.*s", w, lit);
-} break;
+            case 'A': pos = bc_put_int(bdp, cap, pos, p->total_amount, w); break;  // 86 – TOTAL_AMOUNT
+            case 'B': pos = bc_put_int(bdp, cap, pos, bill_dd, w);        break;  // 79 – BILL NO
+            case 'b': pos = bc_put_int(bdp, cap, pos, bill_mm, w);        break;  // 92 – Today Bill no
+            case 'C': pos = bc_printf(bdp, cap, pos, "%.*s", w, p->plu_code);       break;  // 3  – PLU CODE
+            case 'D': pos = bc_put_int(bdp, cap, pos, p->department_no, w);  break;  // 21 – DEPARTMENT NO
+            case 'E': pos = bc_put_int(bdp, cap, pos, fx_round(p->total_weight, FX_WEIGHT, 3), w); break; // 88 – TOTAL_WEIGHT
+            case 'F': pos = bc_printf(bdp, cap, pos, "%.*s", w, p->barcode_flag);   break;  // 95 – FLAG
+            case 'G': pos = bc_put_int(bdp, cap, pos, p->group_no, w);       break;  // 19 – GROUP NO
+            case 'H': pos = bc_put_int(bdp, cap, pos, fx_round(p->total_quantity, FX_QTY, 0), w); break; // 87 – TOTAL_QUANTITY
+            case 'I': pos = bc_put_int(bdp, cap, pos, p->total_tax, w); break; // 90 – TOTAL_TAX
+            case 'J': pos = bc_put_int(bdp, cap, pos, p->total_discount, w); break; // 91 – TOTAL_DISCOUNT
+            case 'K': RTC_Get(&rtc); pos = bc_printf(bdp, cap, pos, "%02d%02d%02d", rtc.dd, rtc.mm, rtc.yyyy%100); break; // 84 – CURRENT DATE
+            case 'k': pos = bc_printf(bdp, cap, pos, "%02d%02d%02d", bill_dd, bill_mm, bill_yyyy%100); break; // 76 – Label date
+            case 'L': pos = bc_put_int(bdp, cap, pos, p->plu_id, w);        break;  // 1  – PLU NO
+            case 'M': pos = bc_printf(bdp, cap, pos, "%.*s", w, p->guom);           break;  // 4  – gUOM
+            case 'N': pos = bc_put_int(bdp, cap, pos, p->no_of_items, w);   break;  // 85 – NO OF ITEMS
+            case 'n': pos = bc_printf(bdp, cap, pos, "%*s", w, p->scale_no);       break;  // 80 – Machine No
+            case 'O': pos = bc_put_int(bdp, cap, pos, p->operator_no, w);   break;  // 27 – OPERATOR NO
+            case 'P': pos = bc_put_int(bdp, cap, pos, p->total_price, w); break; // 93 – TOTAL PRICE
+            case 'Q': if (!strcmp(p->guom,"pcs")) pos = bc_put_int(bdp, cap, pos, fx_round(p->weight_or_quantity, FX_WEIGHT, 0), w); else pos = bc_put_int(bdp, cap, pos, 0, w); break; // 72 – QUANTITY ONLY
+            case 'R': pos = bc_put_int(bdp, cap, pos, 0, w);             break;  // 40 – DISCOUNT NO
+            case 'S':   // special unit price when spl_up parses to > 0, else unit price
+            case 's': pos = bc_put_int(bdp, cap, pos, p->spl_price, w); break;  // same, usually a 4-digit field
+            case 'T': pos = bc_put_int(bdp, cap, pos, 0, w);             break;  // 23 – TAX NO
+            case 't': pos = bc_printf(bdp, cap, pos, "%*.*s", w, w, p->bill_text);  break;  // 96 – Bill Text
+            case 'U': pos = bc_put_int(bdp, cap, pos, p->unit_price, w); break; // UNIT PRICE always
+            case 'V': case 'v': pos = bc_put_int(bdp, cap, pos, fx_round(p->weight_or_quantity, FX_WEIGHT, 3), w); break; // 72 – Special checksum
+            case 'W': if (!strcmp(p->guom,"kg")) pos = bc_put_int(bdp, cap, pos, fx_round(p->weight_or_quantity, FX_WEIGHT, 3), w); else pos = bc_put_int(bdp, cap, pos, 0, w); break;  // 72 – WEIGHT ONLY
+            case 'w': pos = bc_put_int(bdp, cap, pos, fx_round(p->tare_wt, FX_WEIGHT, 3), w); break;  // 8 – TARE WEIGHT
+            case 'X': pos = bc_put_int(bdp, cap, pos, fx_round(p->weight_or_quantity, FX_WEIGHT, 3), w); break; // 72 – WEIGHT OR QUANTITY
+            case 'x': pos = bc_put_int(bdp, cap, pos, fx_round(p->current_gross_weight, FX_WEIGHT, 3), w); break; // 71 – GROSS WEIGHT
+            case 'Y': RTC_Get(&rtc); pos = bc_printf(bdp, cap, pos, "%02d%02d%02d", rtc.hr, rtc.min, rtc.sec); break;  // 84 – CURRENT TIME
+            case 'y': pos = bc_printf(bdp, cap, pos, "%02d%02d%02d", bill_hr, bill_min, bill_sec); break; // 76 – LABEL TIME
+            case 'Z': pos = bc_printf(bdp, cap, pos, "%.*s", w, p->scale_name);     break;  // 81 – MACHINE NAME
+            case 'z': pos = bc_put_int(bdp, cap, pos, tare_no, w);       break;  // 52 – TARE LINK NO
+            case '%':   // literal, truncated to w chars
+                pos = bc_printf(bdp, cap, pos, "%.*s", w < op->lit_len ? w : op->lit_len,
+                                f->lit + op->lit_off);
+                break;
 
             case '{': case '/': case '}': case '[': case '\\': case ']': { parse_dt(
-                    (c=='{'?packed_date:(c=='/'?sellby_date:useby_date)),
-                    (c=='['?packed_time:(c=='\\'?sellby_time:useby_time)),
+                    (c=='{'?p->packed_date:(c=='/'?p->sellby_date:p->useby_date)),
+                    (c=='['?p->packed_time:(c=='\\'?p->sellby_time:p->useby_time)),
                     &dt);
+                char t[64];
                 strftime(t, sizeof t,
                     (c=='{'||c=='/'||c=='}')?(lbl_date_format?"%d%m%Y":"%d%m%y"):(lbl_time_format?"%H%M%S":"%H%M"),
                     &dt);
+                pos = bc_printf(bdp, cap, pos, "%s", t);
             } break; // 10–15 – DATE/TIME
             case '*': {
-                int cw=w, xw=atoi(&barcode_data[i++]);
-                for(int m=0; m<no_of_items; m++){
+                for(int m=0; m<p->no_of_items; m++){
                     char pu[32]; float wt; int u;
                     GetItemInfoByIndex(m, pu, &wt, &u);
-                    sprintf(t, "%*s,%0*.0f\r\n", cw, pu, xw,
-                        (!strcmp(guom,"KG")?ConvertToGrams(wt):wt));
-                    strcat(bdp, t);
+                    pos = bc_printf(bdp, cap, pos, "%*s,%0*.0f\r\n", w, pu, op->arg,
+                        (!strcmp(p->guom,"KG")?ConvertToGrams(wt):wt));
                 }
-                continue;
+                break;
             } // 1,72 – PLU*WT/Q
-        default:
-        {
-            // Treat any other character as literal
-            char lit[2] = { c, '\0' };
-            // pad/truncate to width w
-            snprintf(t, sizeof t, "%*s", w, lit);
+            default:
+                // Any other character is a literal, padded to width w
+                pos = bc_printf(bdp, cap, pos, "%*.*s", w, c ? 1 : 0, &c);
+                break;
         }
-        break;
-     }
-     strcat(bdp, t);
- }
+    }
     return 0;
 }
 
 // -------------Position & Style Helpers----------------------------------------------------------
 
-void set_absolute_position(int prn, int x_dots, int y_dots) {
-    uint8_t cmd_x[4] = { ESC, '$', x_dots & 0xFF, (x_dots >> 8) & 0xFF };
-    uint8_t cmd_y[4] = { ESC, 'Y', y_dots & 0xFF, (y_dots >> 8) & 0xFF };
-    write_all(prn, cmd_x, sizeof(cmd_x));
-    write_all(prn, cmd_y, sizeof(cmd_y));
+void set_absolute_position(struct render_context *ctx, int x_dots, int y_dots) {
+    uint8_t cmd[8] = { ESC, '$', x_dots & 0xFF, (x_dots >> 8) & 0xFF,
+                       ESC, 'Y', y_dots & 0xFF, (y_dots >> 8) & 0xFF };
+    prn_position(ctx, cmd, sizeof(cmd));
 }
-void set_printer_rotation(int fd, int angle) {
+void set_printer_rotation(struct render_context *ctx, int angle) {
     uint8_t cmd[] = { ESC, 'V', (uint8_t)angle };
-    write_all(fd, cmd, sizeof(cmd));
+    prn_write(ctx, cmd, sizeof(cmd));
 }
 
-void select_font(int fd, int font) {
-    uint8_t cmd[] = { ESC, 'M', (uint8_t)font };
-    write_all(fd, cmd, sizeof(cmd));
+void select_font(struct render_context *ctx, int font) {
+    prn_set(ctx, ESC, 'M', (uint8_t)font);
 }
 
-void set_text_size(int fd, float h, float w) {
+void set_text_size(struct render_context *ctx, float h, float w) {
     int dh = (int)(h * DOTS_PER_MM + 0.5f);
     int dw = (int)(w * DOTS_PER_MM + 0.5f);
-    uint8_t cmd[] = { GS, '!', ((dh/8)<<4)|(dw/8) };
-    write_all(fd, cmd, sizeof(cmd));
+    prn_set(ctx, GS, '!', ((dh/8)<<4)|(dw/8));
 }
 
 int compute_text_width(const char *text, int font, float xmul) {
@@ -1246,172 +2649,182 @@ void parse_mode(const char *mode, int *bold, int *underline, int *invert) {
 }
 
 
-// ─── send_text() ──────────────────────────────────────────────────
-void send_text(int prn,
-               float x, float y,
-               int font,
-               float xmul, float ymul,
-               const char *text,
-               int data_len,
-               int offset,
-               char justify,
-               int lines,
-               float line_spacing_mm,
-               int angle,
-               const char *mode)
+// Where a ~T / ~V goes: the printer's cell size, line spacing, rotation
+// and the justified start, in dots. False if the offset skips it all.
+struct text_layout {
+    const char *text;           // from the offset on
+    int  xmag, ymag, lines, angle;
+    uint8_t esc_m, esc_t;
+    int  char_w, char_h, spacing;
+    int  xpos, ypos;
+};
+
+static bool text_layout(const struct render_context *ctx, struct text_layout *tl,
+                        float x, float y, int font, float xmul, float ymul,
+                        const char *text, int data_len, int offset, char justify,
+                        int lines, float line_spacing_mm, int angle)
 {
-    if (!text || lines < 1) return;
-
-    int xmag = fmaxf(1, fminf(6, roundf(xmul)));
-    int ymag = fmaxf(1, fminf(6, roundf(ymul)));
+    tl->xmag = fmaxf(1, fminf(6, roundf(xmul)));
+    tl->ymag = fmaxf(1, fminf(6, roundf(ymul)));
 
     int base_w = (font == 1 ? 12 : 9);
     int base_h = (font == 1 ? 24 : 17);
-    uint8_t esc_m = (font == 1 ? 0 : 1);
+    tl->esc_m = (font == 1 ? 0 : 1);
 
     int full = strlen(text);
-    if (offset >= full) return;
-    const char *ptext = text + offset;
+    if (offset >= full) return false;
+    tl->text = text + offset;
     int len = full - offset;
     if (data_len > 0 && len > data_len) len = data_len;
 
-    int char_width = base_w * xmag;
-    int char_height = base_h * ymag;
+    tl->char_w = base_w * tl->xmag;
+    tl->char_h = base_h * tl->ymag;
 
-    int text_width_dots = char_width * len;
-    int box_width_dots  = (data_len > 0 ? char_width * data_len : text_width_dots);
-    int spacing = (int)(line_spacing_mm * DOTS_PER_MM + 0.5f);
-    if (spacing < char_height) spacing = char_height;
+    int text_width_dots = tl->char_w * len;
+    int box_width_dots  = (data_len > 0 ? tl->char_w * data_len : text_width_dots);
+    tl->spacing = (int)(line_spacing_mm * DOTS_PER_MM + 0.5f);
+    if (tl->spacing < tl->char_h) tl->spacing = tl->char_h;
 
-    int xpos = (int)((x + lbl_x_offset) * DOTS_PER_MM + 0.5f);
-    int ypos = (int)((y + lbl_y_offset) * DOTS_PER_MM + 0.5f);
+    tl->xpos = (int)((x + ctx->x_off) * DOTS_PER_MM + 0.5f);
+    tl->ypos = (int)((y + ctx->y_off) * DOTS_PER_MM + 0.5f);
 
     // Justification
     if (justify == 'C') {
-        xpos += (box_width_dots - text_width_dots) / 2;
+        tl->xpos += (box_width_dots - text_width_dots) / 2;
     } else if (justify == 'R') {
-        xpos += (box_width_dots - text_width_dots);
+        tl->xpos += (box_width_dots - text_width_dots);
     }
 
     // Rotation code
-    uint8_t esc_t = 0;
-    if (angle == 90) esc_t = 1;
-    else if (angle == 180) esc_t = 2;
-    else if (angle == 270) esc_t = 3;
+    tl->esc_t = 0;
+    if (angle == 90) tl->esc_t = 1;
+    else if (angle == 180) tl->esc_t = 2;
+    else if (angle == 270) tl->esc_t = 3;
+    tl->angle = angle;
+    tl->lines = lines;
+    return true;
+}
+
+// ESC W window for line i (this_len characters); the text starts at the
+// window's ESC T origin
+static void text_line_window(const struct text_layout *tl, int i, int this_len,
+                             int *wx, int *wy, int *ww, int *wh)
+{
+    int y_i = tl->ypos + i * tl->spacing;
+
+    // Measure line dimensions based on magnification
+    int dx = tl->char_w * this_len;
+    int dy = tl->char_h;
+
+    // Add a safe margin to prevent clipping (especially for descenders)
+    int margin_x = 2 * tl->xmag;  // Add left/right padding
+    int margin_y = 2 * tl->ymag;  // Add top/bottom padding
+
+    dx += margin_x;
+    dy += margin_y;
+
+    int x0 = tl->xpos;
+    int y0 = y_i;
+    int win_dx, win_dy;
+
+    if (tl->angle == 90) {
+        y0 = y0 - (dx - 1);
+        win_dx = tl->spacing * tl->lines + margin_y;
+        win_dy = dx;
+    } else if (tl->angle == 180) {
+        x0 = x0 - (dx - 1);
+        y0 = y0 - (dy - 1);
+        win_dx = dx;
+        win_dy = tl->spacing * tl->lines + margin_y;
+    } else if (tl->angle == 270) {
+        x0 = x0 - (tl->spacing * tl->lines - 1);
+        win_dx = tl->spacing * tl->lines + margin_y;
+        win_dy = dx;
+    } else {
+        win_dx = dx;
+        win_dy = tl->spacing * tl->lines + margin_y;
+    }
+    *wx = x0;
+    *wy = y0;
+    *ww = win_dx;
+    *wh = win_dy;
+}
+
+// ─── send_text() ──────────────────────────────────────────────────
+void send_text(struct render_context *ctx,
+               float x, float y,
+               int font,
+               float xmul, float ymul,
+               const char *text,
+               int data_len,
+               int offset,
+               char justify,
+               int lines,
+               float line_spacing_mm,
+               int angle,
+               const char *mode)
+{
+    struct text_layout tl;
+    if (!text || lines < 1 ||
+        !text_layout(ctx, &tl, x, y, font, xmul, ymul, text, data_len, offset,
+                     justify, lines, line_spacing_mm, angle))
+        return;
 
     // Set orientation
-    write_all(prn, (uint8_t[]){ ESC, 'T', esc_t }, 3);
-    write_all(prn, (uint8_t[]){ ESC, 'M', esc_m }, 3);
-    write_all(prn, (uint8_t[]){ GS, '!', ((xmag - 1) << 4) | (ymag - 1) }, 3);
-    write_all(prn, (uint8_t[]){ ESC, '3', (uint8_t)spacing }, 3);
+    prn_set(ctx, ESC, 'T', tl.esc_t);
+    prn_set(ctx, ESC, 'M', tl.esc_m);
+    prn_set(ctx, GS, '!', ((tl.xmag - 1) << 4) | (tl.ymag - 1));
+    prn_set(ctx, ESC, '3', (uint8_t)tl.spacing);
 
     // Modes
-    if (strchr(mode, 'E')) write_all(prn, (uint8_t[]){ ESC, 'E', 1 }, 3);
-    if (strchr(mode, 'U')) write_all(prn, (uint8_t[]){ ESC, '-', 1 }, 3);
-    if (strchr(mode, 'I')) write_all(prn, (uint8_t[]){ GS, 'B', 1 }, 3);
+    if (strchr(mode, 'E')) prn_set(ctx, ESC, 'E', 1);
+    if (strchr(mode, 'U')) prn_set(ctx, ESC, '-', 1);
+    if (strchr(mode, 'I')) prn_set(ctx, GS, 'B', 1);
 
-    const char *line = ptext;
+    const char *line = tl.text;
     for (int i = 0; i < lines && line; i++) {
         const char *e = strchr(line, '\n');
         int this_len = e ? (int)(e - line) : strlen(line);
-        int y_i = ypos + i * spacing;
-
-        // Measure line dimensions based on magnification
-        int dx = char_width * this_len;
-        int dy = char_height;
-
-        // Add a safe margin to prevent clipping (especially for descenders)
-        int margin_x = 2 * xmag;  // Add left/right padding
-        int margin_y = 2 * ymag;  // Add top/bottom padding
-
-        dx += margin_x;
-        dy += margin_y;
-
-        int x0 = xpos;
-        int y0 = y_i;
-        int win_dx, win_dy;
-
-        if (angle == 90) {
-            y0 = y0 - (dx - 1);
-            win_dx = spacing * lines + margin_y;
-            win_dy = dx;
-        } else if (angle == 180) {
-            x0 = x0 - (dx - 1);
-            y0 = y0 - (dy - 1);
-            win_dx = dx;
-            win_dy = spacing * lines + margin_y;
-        } else if (angle == 270) {
-            x0 = x0 - (spacing * lines - 1);
-            win_dx = spacing * lines + margin_y;
-            win_dy = dx;
-        } else {
-            win_dx = dx;
-            win_dy = spacing * lines + margin_y;
-        }
 
-        // Set ESC W window with full coverage
-        write_all(prn, (uint8_t[]){
-            ESC, 'W',
-            lo(x0), hi(x0),
-            lo(y0), hi(y0),
-            lo(win_dx), hi(win_dx),
-            lo(win_dy), hi(win_dy)
-        }, 10);
+        // Set ESC W window with full coverage (the text starts at its origin)
+        int x0, y0, win_dx, win_dy;
+        text_line_window(&tl, i, this_len, &x0, &y0, &win_dx, &win_dy);
+        prn_window(ctx, x0, y0, win_dx, win_dy, true);
 
         // Print the text
-        write_all(prn, (const uint8_t *)line, this_len);
+        prn_write(ctx, (const uint8_t *)line, this_len);
         line = e ? e + 1 : NULL;
     }
 
 
     // Reset
-    write_all(prn, (uint8_t[]){ LF }, 1);
-    write_all(prn, (uint8_t[]){ ESC, 'E', 0 }, 3);
-    write_all(prn, (uint8_t[]){ ESC, '-', 0 }, 3);
-    write_all(prn, (uint8_t[]){ GS, 'B', 0 }, 3);
-    write_all(prn, (uint8_t[]){ GS, '!', 0 }, 3);
-    write_all(prn, (uint8_t[]){ ESC, '3', 32 }, 3);
+    prn_write(ctx, (uint8_t[]){ LF }, 1);
+    prn_set(ctx, ESC, 'E', 0);
+    prn_set(ctx, ESC, '-', 0);
+    prn_set(ctx, GS, 'B', 0);
+    prn_set(ctx, GS, '!', 0);
+    prn_set(ctx, ESC, '3', 32);
 }
 
 
 // ─── send_barcode() ──────────────────────────────────────────────────
 
 
-void send_barcode(int prn,
-                  float x, float y,
-                  float module_width_mm,
-                  float bar_height_mm,
-                  const char *data,
-                  const char *orig_type,
-                  char hri_pos,
-                  const char *barcode_name, int angle, char justify,
-                  const char *fld1, const char *cond1, const char *shift1,
-                  const char *fld2, const char *cond2, const char *shift2)
-{
-    // 1) Clear any text mode
-    uint8_t clear_mode[] = {
-        ESC, 'M', 0,
-        GS, '!', 0,
-        ESC, 'E', 0,
-        ESC, 'a', 0,
-        ESC, '3', 24
-    };
-    write_all(prn, clear_mode, sizeof(clear_mode));
+// Where send_barcode puts a symbol: the ESC $ / GS $ position of its
+// baseline in the ESC T direction of the angle, module width and bar
+// height, in dots
+struct bc_place {
+    int xpos, ypos, module_w, bar_h;
+    uint8_t esc_t;
+};
 
-    // 2) Set full window (ESC W) — REQUIRED to avoid clipping
-    write_all(prn, (uint8_t[]){
-        ESC, 'W',
-        0x00, 0x00,                      // X start = 0
-        0x00, 0x00,                      // Y start = 0
-        lo((int)(lbl_width_mm * DOTS_PER_MM)),   // Width
-        hi((int)(lbl_width_mm * DOTS_PER_MM)),
-        lo((int)(lbl_height_mm * DOTS_PER_MM)),  // Height
-        hi((int)(lbl_height_mm * DOTS_PER_MM))
-    }, 10);
-
-    int xpos = (int)((x + lbl_x_offset) * DOTS_PER_MM + 0.5f);
+static void barcode_place(const struct render_context *ctx, struct bc_place *bp,
+                          float x, float y, float module_width_mm, float bar_height_mm,
+                          const char *data, int angle, char justify)
+{
+    int xpos = (int)((x + ctx->x_off) * DOTS_PER_MM + 0.5f);
     int barcode_h_dots = (int)(bar_height_mm * DOTS_PER_MM + 0.5f);
-    int ypos = (int)((y + lbl_y_offset) * DOTS_PER_MM + 0.5f + barcode_h_dots);
+    int ypos = (int)((y + ctx->y_off) * DOTS_PER_MM + 0.5f + barcode_h_dots);
 
     int data_len = strlen(data);
     int module_width_dots = (int)(module_width_mm * DOTS_PER_MM + 0.5f);
@@ -1430,45 +2843,65 @@ void send_barcode(int prn,
         esc_t = 1;
         int temp = xpos;
         xpos = ypos;
-        ypos = (int)(lbl_height_mm * DOTS_PER_MM) - temp - barcode_width_dots;
+        ypos = (int)(ctx->lbl_h_mm * DOTS_PER_MM) - temp - barcode_width_dots;
     } else if (angle == 180) {
         esc_t = 2;
-        xpos = (int)(lbl_width_mm * DOTS_PER_MM) - xpos - barcode_width_dots;
-        ypos = (int)(lbl_height_mm * DOTS_PER_MM) - ypos - barcode_h_dots;
+        xpos = (int)(ctx->lbl_w_mm * DOTS_PER_MM) - xpos - barcode_width_dots;
+        ypos = (int)(ctx->lbl_h_mm * DOTS_PER_MM) - ypos - barcode_h_dots;
     } else if (angle == 270) {
         esc_t = 3;
         int temp = xpos;
-        xpos = (int)(lbl_width_mm * DOTS_PER_MM) - ypos - barcode_h_dots;
+        xpos = (int)(ctx->lbl_w_mm * DOTS_PER_MM) - ypos - barcode_h_dots;
         ypos = temp;
     }
 
+    *bp = (struct bc_place){ xpos, ypos, module_width_dots, barcode_h_dots, esc_t };
+}
+
+void send_barcode(struct render_context *ctx,
+                  float x, float y,
+                  float module_width_mm,
+                  float bar_height_mm,
+                  const char *data,
+                  const char *orig_type,
+                  char hri_pos, int angle, char justify)
+{
+    // 1) Clear any text mode
+    prn_set(ctx, ESC, 'M', 0);
+    prn_set(ctx, GS, '!', 0);
+    prn_set(ctx, ESC, 'E', 0);
+    prn_set(ctx, ESC, 'a', 0);
+    prn_set(ctx, ESC, '3', 24);
+
+    // 2) Set full window (ESC W) — REQUIRED to avoid clipping
+    prn_window(ctx, 0, 0,
+               (int)(ctx->lbl_w_mm * DOTS_PER_MM),
+               (int)(ctx->lbl_h_mm * DOTS_PER_MM), false);
+
+    struct bc_place bp;
+    barcode_place(ctx, &bp, x, y, module_width_mm, bar_height_mm, data, angle, justify);
+    int xpos = bp.xpos, ypos = bp.ypos;
+
     // Set printer rotation
-    uint8_t escT_cmd[3] = { ESC, 'T', esc_t };
-    write_all(prn, escT_cmd, sizeof(escT_cmd));
+    prn_set(ctx, ESC, 'T', bp.esc_t);
 
     // Position
     uint8_t pos_cmd[8] = {
         ESC, '$', lo(xpos), hi(xpos),
         GS,  '$', lo(ypos), hi(ypos)
     };
-    write_all(prn, pos_cmd, sizeof(pos_cmd));
+    prn_position(ctx, pos_cmd, sizeof(pos_cmd));
 
     // Barcode width and height
-    uint8_t wcmd[3] = { GS, 'w', (uint8_t)module_width_dots };
-    uint8_t hcmd[3] = { GS, 'h', (uint8_t)barcode_h_dots };
-    write_all(prn, wcmd, sizeof(wcmd));
-    write_all(prn, hcmd, sizeof(hcmd));
+    prn_set(ctx, GS, 'w', (uint8_t)bp.module_w);
+    prn_set(ctx, GS, 'h', (uint8_t)bp.bar_h);
 
     // HRI font & position
-    uint8_t hri_font_cmd[3] = { GS, 'f', 1 };
-    uint8_t hri_pos_cmd[3] = {
-        GS, 'H',
-        (hri_pos == 'B' ? 2 :
-         hri_pos == 'A' ? 1 :
-         hri_pos == '2' ? 3 : 0)
-    };
-    write_all(prn, hri_font_cmd, sizeof(hri_font_cmd));
-    write_all(prn, hri_pos_cmd, sizeof(hri_pos_cmd));
+    prn_set(ctx, GS, 'f', 1);
+    prn_set(ctx, GS, 'H',
+            hri_pos == 'B' ? 2 :
+            hri_pos == 'A' ? 1 :
+            hri_pos == '2' ? 3 : 0);
 
     // === Decide barcode type ===
     size_t L = strlen(data);
@@ -1483,10 +2916,10 @@ void send_barcode(int prn,
     if (all_digits && L == 12) {
         // EAN-13
         uint8_t hdr[] = { GS, 'k', 2 };
-        write_all(prn, hdr, sizeof(hdr));
-        write_all(prn, (const uint8_t*)data, 12);
+        prn_write(ctx, hdr, sizeof(hdr));
+        prn_write(ctx, (const uint8_t*)data, 12);
         uint8_t term = 0x00;
-        write_all(prn, &term, 1);
+        prn_write(ctx, &term, 1);
     } else if (strcmp(orig_type, "QRCODE") == 0) {
         if (L == 0 || L > 120) return;
         uint8_t cmd1[] = { GS,'(','k',3,0,49,69,49 };
@@ -1494,10 +2927,10 @@ void send_barcode(int prn,
         uint16_t sl = L + 3;
         uint8_t pl = sl & 0xFF, ph = sl >> 8;
         uint8_t cmd3[] = { GS,'(','k',pl,ph,49,80,48 };
-        write_all(prn, cmd1, sizeof(cmd1));
-        write_all(prn, cmd2, sizeof(cmd2));
-        write_all(prn, cmd3, sizeof(cmd3));
-        write_all(prn, (const uint8_t*)data, L);
+        prn_write(ctx, cmd1, sizeof(cmd1));
+        prn_write(ctx, cmd2, sizeof(cmd2));
+        prn_write(ctx, cmd3, sizeof(cmd3));
+        prn_write(ctx, (const uint8_t*)data, L);
     } else {
         char data_buf[260];
         if (L + 1 > sizeof(data_buf)) return;
@@ -1527,17 +2960,14 @@ void send_barcode(int prn,
         char send_buf[264];
         int dlen = snprintf(send_buf, sizeof(send_buf), "{%c%s", subset, data_buf);
         uint8_t hdr[4] = { GS, 'k', 73, (uint8_t)dlen };
-        write_all(prn, hdr, 4);
-        write_all(prn, (const uint8_t*)send_buf, dlen);
+        prn_write(ctx, hdr, 4);
+        prn_write(ctx, (const uint8_t*)send_buf, dlen);
     }
 
     // Restore to safe mode after barcode
-    uint8_t reset[] = {
-        ESC, 'M', 0,
-        GS,  '!', 0,
-        ESC, 'E', 0
-    };
-    write_all(prn, reset, sizeof(reset));
+    prn_set(ctx, ESC, 'M', 0);
+    prn_set(ctx, GS, '!', 0);
+    prn_set(ctx, ESC, 'E', 0);
 }
 
 
@@ -1545,16 +2975,13 @@ void send_barcode(int prn,
 
 // ─── send_rectangel() ──────────────────────────────────────────────────
 
-void send_rectangle(int prn, float x_mm, float y_mm,
-                    float w_mm, float h_mm,
-                    float th_mm, int angle,
-                    char mode, char printstatus)
+// FS R corners (inclusive) and line width of a ~R, in dots
+static void rect_box(const struct render_context *ctx, float x_mm, float y_mm,
+                     float w_mm, float h_mm, float th_mm, int angle, int box[5])
 {
-    if (!CheckPrintStatus(printstatus)) return;
-
     // Adjust X/Y by label offsets
-    float x0_mm = x_mm + lbl_x_offset;
-    float y0_mm = y_mm + lbl_y_offset;
+    float x0_mm = x_mm + ctx->x_off;
+    float y0_mm = y_mm + ctx->y_off;
 
     // Rotate logic applied via coordinate adjustment (not ESC T)
     float xloc, yloc, dx, dy;
@@ -1587,21 +3014,33 @@ void send_rectangle(int prn, float x_mm, float y_mm,
     int x1 = (int)((xloc + dx) * DOTS_PER_MM + 0.5f) - 1;
     int y1 = (int)((yloc + dy) * DOTS_PER_MM + 0.5f) - 1;
     int lwidth = (int)(th_mm * DOTS_PER_MM + 0.5f);
+    box[0] = x0;
+    box[1] = y0;
+    box[2] = x1;
+    box[3] = y1;
+    box[4] = lwidth;
+}
+
+void send_rectangle(struct render_context *ctx, float x_mm, float y_mm,
+                    float w_mm, float h_mm,
+                    float th_mm, int angle,
+                    char mode, char printstatus)
+{
+    if (!CheckPrintStatus(ctx, printstatus)) return;
+
+    int box[5];
+    rect_box(ctx, x_mm, y_mm, w_mm, h_mm, th_mm, angle, box);
+    int x0 = box[0], y0 = box[1], x1 = box[2], y1 = box[3], lwidth = box[4];
     int invert = (mode == 'I') ? 1 : 0;
 
     // Set full window
-    uint16_t full_x = (uint16_t)(lbl_width_mm * DOTS_PER_MM + 0.5f);
-    uint16_t full_y = (uint16_t)(lbl_height_mm * DOTS_PER_MM + 0.5f);
-    uint8_t fullwin[10] = {
-        ESC, 'W', 0, 0, 0, 0,
-        lo(full_x), hi(full_x),
-        lo(full_y), hi(full_y)
-    };
-    write_all(prn, fullwin, sizeof(fullwin));
+    uint16_t full_x = (uint16_t)(ctx->lbl_w_mm * DOTS_PER_MM + 0.5f);
+    uint16_t full_y = (uint16_t)(ctx->lbl_h_mm * DOTS_PER_MM + 0.5f);
+    prn_window(ctx, 0, 0, full_x, full_y, false);
 
     // Angle always 0 (we handled rotation in coordinates)
-    write_all(prn, (uint8_t[]){ ESC, 'T', 0 }, 3);
-    write_all(prn, (uint8_t[]){ GS, 'B', (uint8_t)invert }, 3);
+    prn_set(ctx, ESC, 'T', 0);
+    prn_set(ctx, GS, 'B', (uint8_t)invert);
 
     // Draw rectangle
     uint8_t cmd[] = {
@@ -1612,12 +3051,12 @@ void send_rectangle(int prn, float x_mm, float y_mm,
         lo(y1), hi(y1),
         (uint8_t)lwidth
     };
-    write_all(prn, cmd, sizeof(cmd));
+    prn_write_fixed(ctx, cmd, sizeof(cmd));
 }
 
 //***********************************************************************************************
 
-bool send_read_response(int prn, const char *expected, int timeout_ms) {
+bool send_read_response(struct render_context *ctx, const char *expected, int timeout_ms) {
     char buf[256];
     int elapsed = 0;
 
@@ -1627,7 +3066,7 @@ bool send_read_response(int prn, const char *expected, int timeout_ms) {
 
     while (elapsed < timeout_ms) {
         // try a nonblocking read
-        int n = read(prn, buf, sizeof(buf)-1);
+        int n = read(ctx->fd, buf, sizeof(buf)-1);
         if (n > 0) {
             buf[n] = '\0';
             // strip trailing CR/LF
@@ -1645,21 +3084,107 @@ bool send_read_response(int prn, const char *expected, int timeout_ms) {
 }
 
 
-// *********************************************************************
-void send_bitmap_data(int prn,
-                      float x_mm, float y_mm,
-                      int angle,
-                      int xmag, int ymag,
-                      float width_mm, float height_mm,
-                      char type,
-                      const char *mode,
-                      FILE *image_fp)
+// ─── 1bpp bit-matrix transpose ───
+// ~d images at angle 0 are sent column-major: output row x holds source
+// column x, MSB = topmost pixel. Work is done in 8x8 blocks: 16 blocks
+// side by side in vector registers (NEON on the A55, SSE2 on x86-64,
+// both baseline for those ISAs), and one block at a time in a uint64
+// for the row tail and for builds without either.
+
+// Transpose one 8x8 block; row r is byte r counted from the MSB
+static inline uint64_t bits_transpose8(uint64_t x) {
+    uint64_t t;
+    t = (x ^ (x >> 7))  & 0x00AA00AA00AA00AAULL; x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL; x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL; x ^= t ^ (t << 28);
+    return x;
+}
+
+#if defined(__ARM_NEON)
+typedef uint8x16_t bv16;
+#define BV_LOAD(p)      vld1q_u8(p)
+#define BV_STORE(p, v)  vst1q_u8(p, v)
+// Swap the s-bit sub-blocks between rows a and b (m = a's kept bits)
+#define BV_SWAP(a, b, s, m) do {                                    \
+        bv16 _m = vdupq_n_u8(m);                                    \
+        bv16 _a = vbslq_u8(_m, a, vshrq_n_u8(b, s));                \
+        b = vbslq_u8(_m, vshlq_n_u8(a, s), b);                      \
+        a = _a;                                                     \
+    } while (0)
+#elif defined(__SSE2__)
+typedef __m128i bv16;
+#define BV_LOAD(p)      _mm_loadu_si128((const __m128i *)(p))
+#define BV_STORE(p, v)  _mm_storeu_si128((__m128i *)(p), v)
+// 16-bit shifts are fine: the bits they carry across bytes are masked off
+#define BV_SWAP(a, b, s, m) do {                                    \
+        __m128i _m = _mm_set1_epi8((char)(m));                      \
+        __m128i _a = _mm_or_si128(_mm_and_si128(_m, a),             \
+                        _mm_andnot_si128(_m, _mm_srli_epi16(b, s)));\
+        b = _mm_or_si128(_mm_and_si128(_m, _mm_slli_epi16(a, s)),   \
+                        _mm_andnot_si128(_m, b));                   \
+        a = _a;                                                     \
+    } while (0)
+#endif
+
+#ifdef BV_LOAD
+// Lane j of v[0..7] is one 8x8 block; transposed in place
+static inline void bv_transpose8(bv16 v[8]) {
+    BV_SWAP(v[0], v[1], 1, 0xAA); BV_SWAP(v[2], v[3], 1, 0xAA);
+    BV_SWAP(v[4], v[5], 1, 0xAA); BV_SWAP(v[6], v[7], 1, 0xAA);
+    BV_SWAP(v[0], v[2], 2, 0xCC); BV_SWAP(v[1], v[3], 2, 0xCC);
+    BV_SWAP(v[4], v[6], 2, 0xCC); BV_SWAP(v[5], v[7], 2, 0xCC);
+    BV_SWAP(v[0], v[4], 4, 0xF0); BV_SWAP(v[1], v[5], 4, 0xF0);
+    BV_SWAP(v[2], v[6], 4, 0xF0); BV_SWAP(v[3], v[7], 4, 0xF0);
+}
+#endif
+
+// src: h rows of src_bpr bytes, w pixels wide. dst: w rows of dst_bpr
+// bytes, (h+7)/8 of them used; every used byte is written.
+static void bitmap_transpose(const uint8_t *src, int src_bpr, int w, int h,
+                             uint8_t *dst, int dst_bpr)
 {
-    if (!image_fp) {
-        fprintf(stderr, "[ERROR] Image file pointer is NULL\n");
-        return;
+    for (int y0 = 0; y0 < h; y0 += 8) {
+        int rows = h - y0 < 8 ? h - y0 : 8;
+        const uint8_t *s = src + (size_t)y0 * src_bpr;
+        uint8_t *d = dst + y0 / 8;
+        int bx = 0;
+#ifdef BV_LOAD
+        if (rows == 8) {
+            for (; bx + 16 <= src_bpr; bx += 16) {
+                bv16 v[8];
+                uint8_t out[8][16];
+                for (int r = 0; r < 8; r++)
+                    v[r] = BV_LOAD(s + (size_t)r * src_bpr + bx);
+                bv_transpose8(v);
+                for (int c = 0; c < 8; c++)
+                    BV_STORE(out[c], v[c]);
+                for (int j = 0; j < 16; j++) {
+                    int x = (bx + j) * 8;
+                    for (int c = 0; c < 8 && x + c < w; c++)
+                        d[(size_t)(x + c) * dst_bpr] = out[c][j];
+                }
+            }
+        }
+#endif
+        for (; bx < src_bpr; bx++) {
+            uint64_t m = 0;
+            for (int r = 0; r < rows; r++)
+                m |= (uint64_t)s[(size_t)r * src_bpr + bx] << (56 - 8 * r);
+            m = bits_transpose8(m);
+            int x = bx * 8;
+            for (int c = 0; c < 8 && x + c < w; c++)
+                d[(size_t)(x + c) * dst_bpr] = (uint8_t)(m >> (56 - 8 * c));
+        }
     }
+}
 
+// Raster of a ~d image as GS v 0 takes it: the data padded to its size
+// and, at angle 0, turned column-major. NULL when the image has no black
+// pixel (nothing is printed) or memory ran out.
+static uint8_t *bitmap_raster(int angle, int xmag, int ymag, float width_mm, float height_mm,
+                              const uint8_t *data, size_t data_len,
+                              int *bpr, int *rows, int *w_dots)
+{
     int raw_w = (int)(width_mm * DOTS_PER_MM + 0.5f);
     int raw_h = (int)(height_mm * DOTS_PER_MM + 0.5f);
     int img_w = raw_w * xmag;
@@ -1667,21 +3192,14 @@ void send_bitmap_data(int prn,
     int bytes_per_row = (img_w + 7) / 8;
     int expected_bytes = bytes_per_row * img_h;
 
-    fprintf(stderr, "[DEBUG] Width mm: %.2f Height mm: %.2f => raw_w: %d raw_h: %d\n",
-            width_mm, height_mm, raw_w, raw_h);
-    fprintf(stderr, "[DEBUG] xmag: %d ymag: %d => img_w: %d img_h: %d\n",
-            xmag, ymag, img_w, img_h);
-    fprintf(stderr, "[DEBUG] Expected bytes: %d (bytes_per_row: %d)\n",
-            expected_bytes, bytes_per_row);
-
     uint8_t *img = calloc(1, expected_bytes);
     if (!img) {
         fprintf(stderr, "[ERROR] Memory allocation failed\n");
-        return;
+        return NULL;
     }
 
-    size_t read = fread(img, 1, expected_bytes, image_fp);
-    fprintf(stderr, "[DEBUG] Successfully read %zu bytes of image data\n", read);
+    size_t read = data_len < (size_t)expected_bytes ? data_len : (size_t)expected_bytes;
+    memcpy(img, data, read);
 
     // If image is empty, skip
     int has_black = 0;
@@ -1694,48 +3212,89 @@ void send_bitmap_data(int prn,
     if (!has_black) {
         fprintf(stderr, "[WARN] Image contains only white pixels, skipping\n");
         free(img);
-        return;
+        return NULL;
     }
 
     // Transpose for rotation = 0
     if (angle == 0) {
         int t_bytes_per_row = (img_h + 7) / 8;
         int t_expected_bytes = t_bytes_per_row * img_w;
-        uint8_t *transposed = calloc(1, t_expected_bytes);
+        uint8_t *transposed = malloc(t_expected_bytes);
         if (!transposed) {
             free(img);
-            return;
+            return NULL;
         }
 
-        for (int y = 0; y < img_h; ++y) {
-            for (int x = 0; x < img_w; ++x) {
-                int src_byte = y * bytes_per_row + (x / 8);
-                int src_bit = 7 - (x % 8);
-                int bit = (img[src_byte] >> src_bit) & 1;
-
-                int dst_byte = x * t_bytes_per_row + (y / 8);
-                int dst_bit = 7 - (y % 8);
-                if (bit) transposed[dst_byte] |= (1 << dst_bit);
-            }
-        }
+        bitmap_transpose(img, bytes_per_row, img_w, img_h, transposed, t_bytes_per_row);
 
         free(img);
         img = transposed;
         bytes_per_row = t_bytes_per_row;
-        expected_bytes = t_expected_bytes;
 
         int tmp = img_w;
         img_w = img_h;
         img_h = tmp;
     }
 
-    uint8_t esc_t = 0;
-    if (angle == 90) esc_t = 1;
-    else if (angle == 180) esc_t = 2;
-    else if (angle == 270) esc_t = 3;
+    *bpr = bytes_per_row;
+    *rows = img_h;
+    *w_dots = img_w;
+    return img;
+}
 
-    int xpos = (int)((x_mm + lbl_x_offset) * DOTS_PER_MM + 0.5f);
-    int ypos = (int)((y_mm + lbl_y_offset) * DOTS_PER_MM + 0.5f);
+// Upload a raster into download graphics memory, evicting the least
+// recently used images this job does not need; false if it cannot fit.
+// Sent in standard mode, before the label enters page mode.
+static bool prn_image_upload(struct render_context *ctx, uint64_t key,
+                             const uint8_t *raster, int bpr, int rows) {
+    struct prn_images *im = ctx->imgs;
+    size_t size = (size_t)bpr * rows;
+    if (size > im->budget || bpr * 8 > 8192 || rows > 2304) return false;
+
+    int i;
+    for (;;) {
+        int lru = -1;
+        for (i = 0; i < PRN_IMAGE_SLOTS && im->slot[i].key; i++)
+            ;
+        if (i < PRN_IMAGE_SLOTS && im->bytes + size <= im->budget) break;
+        for (int j = 0; j < PRN_IMAGE_SLOTS; j++)
+            if (im->slot[j].key && im->slot[j].used != im->job &&
+                (lru < 0 || im->slot[j].used < im->slot[lru].used))
+                lru = j;
+        if (lru < 0) return false;      // all of it is on this label
+        prn_write_fixed(ctx, (uint8_t[]){ GS, '(', 'L', 4, 0, 48, 82, 'E', '0' + lru }, 9);
+        im->bytes -= im->slot[lru].bytes;
+        memset(&im->slot[lru], 0, sizeof(im->slot[lru]));
+        im->epoch++;
+    }
+
+    size_t plen = 11 + size;            // m fn a kc1 kc2 b xL xH yL yH c, data
+    int w = bpr * 8;
+    if (plen <= 0xFFFF)
+        prn_write_fixed(ctx, (uint8_t[]){ GS, '(', 'L', lo(plen), hi(plen) }, 5);
+    else
+        prn_write_fixed(ctx, (uint8_t[]){ GS, '8', 'L', plen & 0xFF, (plen >> 8) & 0xFF,
+                                          (plen >> 16) & 0xFF, (plen >> 24) & 0xFF }, 7);
+    prn_write_fixed(ctx, (uint8_t[]){ 48, 83, 48, 'E', '0' + i, 1,
+                                      lo(w), hi(w), lo(rows), hi(rows), 49 }, 11);
+    prn_write_fixed(ctx, raster, size);
+
+    im->slot[i] = (struct prn_image){ .key = key, .bytes = size, .used = im->job };
+    im->bytes += size;
+    im->epoch++;
+    atomic_fetch_add(&prn_img_uploads, 1);
+    atomic_fetch_add(&prn_img_upload_bytes, size);
+    return true;
+}
+
+// ESC W window of a ~d image (img_w x img_h as GS v 0 sends it), kept
+// on the label
+static void bitmap_window(const struct render_context *ctx, float x_mm, float y_mm,
+                          int angle, int img_w, int img_h,
+                          int *wx, int *wy, int *ww, int *wh)
+{
+    int xpos = (int)((x_mm + ctx->x_off) * DOTS_PER_MM + 0.5f);
+    int ypos = (int)((y_mm + ctx->y_off) * DOTS_PER_MM + 0.5f);
     int x0 = xpos, y0 = ypos;
     int win_w = img_w, win_h = img_h;
 
@@ -1753,8 +3312,8 @@ void send_bitmap_data(int prn,
     }
 
     // Validate window
-    int max_x = (int)(lbl_width_mm * DOTS_PER_MM);
-    int max_y = (int)(lbl_height_mm * DOTS_PER_MM);
+    int max_x = (int)(ctx->lbl_w_mm * DOTS_PER_MM);
+    int max_y = (int)(ctx->lbl_h_mm * DOTS_PER_MM);
     if (x0 < 0 || y0 < 0 || x0 + win_w > max_x || y0 + win_h > max_y) {
         fprintf(stderr, "[WARN] Image outside label area, adjusting\n");
         if (x0 < 0) x0 = 0;
@@ -1763,11 +3322,56 @@ void send_bitmap_data(int prn,
         if (y0 + win_h > max_y) win_h = max_y - y0;
     }
 
-    fprintf(stderr, "[DEBUG] Final print position: x=%d y=%d angle=%d win_w=%d win_h=%d\n",
-            x0, y0, angle, win_w, win_h);
+    *wx = x0;
+    *wy = y0;
+    *ww = win_w;
+    *wh = win_h;
+}
 
-    write_all(prn, (uint8_t[]){ ESC, 'W', lo(x0), hi(x0), lo(y0), hi(y0), lo(win_w), hi(win_w), lo(win_h), hi(win_h) }, 10);
-    write_all(prn, (uint8_t[]){ ESC, 'T', esc_t }, 3);
+// *********************************************************************
+void send_bitmap_data(struct render_context *ctx,
+                      float x_mm, float y_mm,
+                      int angle,
+                      int xmag, int ymag,
+                      float width_mm, float height_mm,
+                      const char *mode,
+                      const uint8_t *data, size_t data_len,
+                      uint64_t key)
+{
+    if (!data) {
+        fprintf(stderr, "[ERROR] Image data is NULL\n");
+        return;
+    }
+
+    // Resident in the printer: only the geometry is needed
+    int ki = ctx->imgs && key && xmag == 1 && ymag == 1 ? prn_image_find(ctx->imgs, key) : -1;
+    uint8_t *img = NULL;
+    int bytes_per_row, img_w, img_h;
+    if (ki >= 0) {
+        img_w = (int)(width_mm * DOTS_PER_MM + 0.5f);
+        img_h = (int)(height_mm * DOTS_PER_MM + 0.5f);
+        if (angle == 0) {
+            int tmp = img_w;
+            img_w = img_h;
+            img_h = tmp;
+        }
+        bytes_per_row = (img_w + 7) / 8;
+    } else {
+        img = bitmap_raster(angle, xmag, ymag, width_mm, height_mm, data, data_len,
+                            &bytes_per_row, &img_h, &img_w);
+        if (!img) return;
+    }
+
+    uint8_t esc_t = 0;
+    if (angle == 90) esc_t = 1;
+    else if (angle == 180) esc_t = 2;
+    else if (angle == 270) esc_t = 3;
+
+    int x0, y0, win_w, win_h;
+    bitmap_window(ctx, x_mm, y_mm, angle, img_w, img_h, &x0, &y0, &win_w, &win_h);
+
+    prn_window(ctx, x0, y0, win_w, win_h, true);
+    prn_set(ctx, ESC, 'T', esc_t);
 
     uint8_t inv = 0, enh = 0, und = 0;
     if (mode) {
@@ -1775,22 +3379,26 @@ void send_bitmap_data(int prn,
         if (strchr(mode, 'E')) enh = 1;
         if (strchr(mode, 'U')) und = 1;
     }
-    write_all(prn, (uint8_t[]){ GS, 'B', inv }, 3);
-    write_all(prn, (uint8_t[]){ ESC, 'E', enh }, 3);
-    write_all(prn, (uint8_t[]){ ESC, '-', und }, 3);
+    prn_set(ctx, GS, 'B', inv);
+    prn_set(ctx, ESC, 'E', enh);
+    prn_set(ctx, ESC, '-', und);
 
-    write_all(prn, (uint8_t[]){ GS, '$', 0, 0 }, 4);
+    prn_write(ctx, (uint8_t[]){ GS, '$', 0, 0 }, 4);
 
-    uint8_t magnify = ((ymag - 1) << 4) | (xmag - 1);
-    write_all(prn, (uint8_t[]){ GS, 'v', '0', magnify, lo(bytes_per_row), hi(bytes_per_row), lo(img_h), hi(img_h) }, 8);
+    if (ki >= 0) {
+        prn_write(ctx, (uint8_t[]){ GS, '(', 'L', 6, 0, 48, 85, 'E', '0' + ki, 1, 1 }, 11);
+        atomic_fetch_add(&prn_img_refs, 1);
+    } else {
+        uint8_t magnify = ((ymag - 1) << 4) | (xmag - 1);
+        prn_write(ctx, (uint8_t[]){ GS, 'v', '0', magnify, lo(bytes_per_row), hi(bytes_per_row), lo(img_h), hi(img_h) }, 8);
 
-    write_all(prn, img, expected_bytes);
-    fsync(prn);
+        prn_write(ctx, img, (size_t)bytes_per_row * img_h);
+    }
 
-    write_all(prn, (uint8_t[]){ ESC, 'T', 0 }, 3);
-    write_all(prn, (uint8_t[]){ GS, 'B', 0 }, 3);
-    write_all(prn, (uint8_t[]){ ESC, 'E', 0 }, 3);
-    write_all(prn, (uint8_t[]){ ESC, '-', 0 }, 3);
+    prn_set(ctx, ESC, 'T', 0);
+    prn_set(ctx, GS, 'B', 0);
+    prn_set(ctx, ESC, 'E', 0);
+    prn_set(ctx, ESC, '-', 0);
 
     free(img);
 }
@@ -1799,54 +3407,94 @@ void send_bitmap_data(int prn,
 
 //--------------Decode backslash-escaped binary image string----------------------------------------
 
-void decode_escaped_binary(FILE *f, FILE *out, int expected_bytes) {
-    int ch, count = 0;
-    while ((ch = fgetc(f)) != EOF && count < expected_bytes) {
+// Hex digit value + 1, 0 for anything that is not a hex digit
+static const uint8_t hex_digit[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+    ['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+// Length of the run at p with no backslash, CR or LF (copied as-is)
+static size_t esc_plain_run(const char *p, const char *end) {
+    const char *q = p;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    for (; end - q >= 16; q += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)q);
+        uint8x16_t m = vorrq_u8(vceqq_u8(v, vdupq_n_u8('\\')),
+                       vorrq_u8(vceqq_u8(v, vdupq_n_u8('\r')), vceqq_u8(v, vdupq_n_u8('\n'))));
+        if (vmaxvq_u8(m)) break;
+    }
+#elif defined(__SSE2__)
+    for (; end - q >= 16; q += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)q);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+        int bits = _mm_movemask_epi8(m);
+        if (bits) return (size_t)(q - p) + __builtin_ctz(bits);
+    }
+#endif
+    while (q < end && *q != '\\' && *q != '\n' && *q != '\r') q++;
+    return q - p;
+}
+
+// Decodes from *src (advanced past what was consumed) into out, which
+// has room for expected_bytes; returns the number of bytes decoded.
+// A backslash and two hex digits make one byte (a bad digit ends the
+// number, as strtol did), CR/LF are skipped, the rest is copied as-is.
+int decode_escaped_binary(const char **src, const char *end, uint8_t *out, int expected_bytes) {
+    const char *p = *src;
+    int count = 0;
+    while (p < end) {
+        if (count >= expected_bytes) {
+            p++;                // the byte after a full image is consumed too
+            break;
+        }
+        char ch = *p;
         if (ch == '\\') {
-            int h1 = fgetc(f);
-            int h2 = fgetc(f);
-            if (h1 == EOF || h2 == EOF) break;
-            char hex[3] = { h1, h2, 0 };
-            uint8_t val = (uint8_t)strtol(hex, NULL, 16);
-            fputc(val, out);
-            count++;
-        } else if (ch != '\n' && ch != '\r') {
-            fputc((uint8_t)ch, out);
-            count++;
+            if (end - p < 3) { p = end; break; }
+            uint8_t hi = hex_digit[(unsigned char)p[1]], lo = hex_digit[(unsigned char)p[2]];
+            out[count++] = !hi ? 0 : !lo ? hi - 1 : (hi - 1) << 4 | (lo - 1);
+            p += 3;
+        } else if (ch == '\n' || ch == '\r') {
+            p++;
+        } else {
+            size_t n = esc_plain_run(p, end);
+            if (n > (size_t)(expected_bytes - count)) n = expected_bytes - count;
+            memcpy(out + count, p, n);
+            count += n;
+            p += n;
         }
     }
-    fprintf(stderr, "[DEBUG] Decoded %d bytes from escaped image data\n", count);
+    *src = p;
+    return count;
 }
 
 
 // -------------Send Circle --------------------------------------------------------------------------------------
 
-void send_circle(int prn, float x, float y, float radius, float thickness, char mode, char printstatus)
+void send_circle(struct render_context *ctx, float x, float y, float radius, float thickness, char mode, char printstatus)
 {
-    if (!CheckPrintStatus(printstatus)) return;
+    if (!CheckPrintStatus(ctx, printstatus)) return;
 
     // Convert mm to dots with offsets
-    int xloc = (int)((x + lbl_x_offset) * DOTS_PER_MM + 0.5f);
-    int yloc = (int)((y + lbl_y_offset) * DOTS_PER_MM + 0.5f);
+    int xloc = (int)((x + ctx->x_off) * DOTS_PER_MM + 0.5f);
+    int yloc = (int)((y + ctx->y_off) * DOTS_PER_MM + 0.5f);
     int radius_dots = (int)(radius * DOTS_PER_MM + 0.5f);
     int thick_dots = (int)(thickness * DOTS_PER_MM + 0.5f);
     int invert = (mode == 'I') ? 1 : 0;
 
     // Full window like rectangle
-    uint16_t full_x = (uint16_t)(lbl_width_mm * DOTS_PER_MM + 0.5f);
-    uint16_t full_y = (uint16_t)(lbl_height_mm * DOTS_PER_MM + 0.5f);
-    uint8_t fullwin[10] = {
-        ESC, 'W', 0, 0, 0, 0,
-        lo(full_x), hi(full_x),
-        lo(full_y), hi(full_y)
-    };
-    write_all(prn, fullwin, sizeof(fullwin));
+    uint16_t full_x = (uint16_t)(ctx->lbl_w_mm * DOTS_PER_MM + 0.5f);
+    uint16_t full_y = (uint16_t)(ctx->lbl_h_mm * DOTS_PER_MM + 0.5f);
+    prn_window(ctx, 0, 0, full_x, full_y, false);
 
     // Set rotation to 0
-    write_all(prn, (uint8_t[]){ ESC, 'T', 0 }, 3);
+    prn_set(ctx, ESC, 'T', 0);
 
     // Set invert mode
-    write_all(prn, (uint8_t[]){ GS, 'B', (uint8_t)invert }, 3);
+    prn_set(ctx, GS, 'B', (uint8_t)invert);
 
     // Now send the circle
     uint8_t cmd[12];
@@ -1857,42 +3505,301 @@ void send_circle(int prn, float x, float y, float radius, float thickness, char
     cmd[i++] = (uint8_t)radius_dots;
     cmd[i++] = (uint8_t)thick_dots;
 
-    write_all(prn, cmd, i);
+    prn_write_fixed(ctx, cmd, i);
 }
 
 
 
-uint8_t *job_buf = NULL;
-size_t job_len = 0, job_cap = 0;
+// ─── Software raster: drawing ─────────────────────────────────────
 
+// Size r to w x h dots and clear it; false if memory ran out
+static bool raster_size(struct raster *r, int w, int h) {
+    if (w < 1 || h < 1) {
+        r->w = r->h = r->bpr = 0;
+        return false;
+    }
+    int bpr = (w + 7) / 8;
+    size_t need = (size_t)bpr * h;
+    if (need > r->cap) {
+        uint8_t *nb = realloc(r->bits, need);
+        if (!nb) {
+            r->w = r->h = r->bpr = 0;
+            return false;
+        }
+        r->bits = nb;
+        r->cap = need;
+    }
+    r->w = w;
+    r->h = h;
+    r->bpr = bpr;
+    memset(r->bits, 0, need);
+    return true;
+}
+
+// Dots x0 .. x1-1 of row y, clipped
+static void raster_span(struct raster *r, int y, int x0, int x1, bool black) {
+    if (y < 0 || y >= r->h) return;
+    if (x0 < 0) x0 = 0;
+    if (x1 > r->w) x1 = r->w;
+    if (x0 >= x1) return;
+    uint8_t *row = r->bits + (size_t)y * r->bpr;
+    int b0 = x0 >> 3, b1 = (x1 - 1) >> 3;
+    uint8_t m0 = 0xFF >> (x0 & 7), m1 = (uint8_t)(0xFF << (7 - ((x1 - 1) & 7)));
+    if (b0 == b1) {
+        m0 &= m1;
+        row[b0] = black ? row[b0] | m0 : row[b0] & ~m0;
+        return;
+    }
+    row[b0] = black ? row[b0] | m0 : row[b0] & ~m0;
+    memset(row + b0 + 1, black ? 0xFF : 0, b1 - b0 - 1);
+    row[b1] = black ? row[b1] | m1 : row[b1] & ~m1;
+}
+
+static void raster_fill(struct raster *r, int x0, int y0, int x1, int y1, bool black) {
+    if (y0 < 0) y0 = 0;
+    if (y1 > r->h) y1 = r->h;
+    for (int y = y0; y < y1; y++)
+        raster_span(r, y, x0, x1, black);
+}
+
+// Draw sprite s as page mode prints in ESC T direction dir inside the
+// window (wx, wy, ww, wh): 0 starts top-left running right, 1 bottom-left
+// running up, 2 bottom-right running left, 3 top-right running down.
+// (ox, oy) places the sprite in those turned coordinates. White dots are
+// drawn only if opaque; everything is clipped to the window.
+static void raster_blit(struct raster *r, const struct raster *s,
+                        int wx, int wy, int ww, int wh, int dir, int ox, int oy, bool opaque) {
+    int cx0 = wx > 0 ? wx : 0, cy0 = wy > 0 ? wy : 0;
+    int cx1 = wx + ww < r->w ? wx + ww : r->w, cy1 = wy + wh < r->h ? wy + wh : r->h;
+    if (cx0 >= cx1 || cy0 >= cy1) return;
+    for (int v = 0; v < s->h; v++) {
+        const uint8_t *row = s->bits + (size_t)v * s->bpr;
+        for (int u = 0; u < s->w; u++) {
+            if (!opaque && !(u & 7) && !row[u >> 3]) {
+                u += 7;
+                continue;
+            }
+            bool black = row[u >> 3] & (0x80 >> (u & 7));
+            if (!black && !opaque) continue;
+            int X = ox + u, Y = oy + v, x, y;
+            switch (dir) {
+            case 1:  x = wx + Y;          y = wy + wh - 1 - X; break;
+            case 2:  x = wx + ww - 1 - X; y = wy + wh - 1 - Y; break;
+            case 3:  x = wx + ww - 1 - Y; y = wy + X;          break;
+            default: x = wx + X;          y = wy + Y;          break;
+            }
+            if (x < cx0 || x >= cx1 || y < cy0 || y >= cy1) continue;
+            uint8_t *p = &r->bits[(size_t)y * r->bpr + (x >> 3)];
+            uint8_t m = 0x80 >> (x & 7);
+            *p = black ? *p | m : *p & ~m;
+        }
+    }
+}
+
+// 5x7 glyphs for 0x20..0x7E, one byte per column, bit 0 = top row
+static const uint8_t font5x7[95][5] = {
+    {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00},
+    {0x14,0x7F,0x14,0x7F,0x14}, {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62},
+    {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00}, {0x00,0x1C,0x22,0x41,0x00},
+    {0x00,0x41,0x22,0x1C,0x00}, {0x14,0x08,0x3E,0x08,0x14}, {0x08,0x08,0x3E,0x08,0x08},
+    {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x60,0x60,0x00,0x00},
+    {0x20,0x10,0x08,0x04,0x02}, {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00},
+    {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31}, {0x18,0x14,0x12,0x7F,0x10},
+    {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03},
+    {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, {0x00,0x36,0x36,0x00,0x00},
+    {0x00,0x56,0x36,0x00,0x00}, {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14},
+    {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06}, {0x32,0x49,0x79,0x41,0x3E},
+    {0x7E,0x11,0x11,0x11,0x7E}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22},
+    {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x09,0x01},
+    {0x3E,0x41,0x49,0x49,0x7A}, {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00},
+    {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41}, {0x7F,0x40,0x40,0x40,0x40},
+    {0x7F,0x02,0x0C,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E},
+    {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46},
+    {0x46,0x49,0x49,0x49,0x31}, {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F},
+    {0x1F,0x20,0x40,0x20,0x1F}, {0x3F,0x40,0x38,0x40,0x3F}, {0x63,0x14,0x08,0x14,0x63},
+    {0x07,0x08,0x70,0x08,0x07}, {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7F,0x41,0x41,0x00},
+    {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7F,0x00}, {0x04,0x02,0x01,0x02,0x04},
+    {0x40,0x40,0x40,0x40,0x40}, {0x00,0x01,0x02,0x04,0x00}, {0x20,0x54,0x54,0x54,0x78},
+    {0x7F,0x48,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x20}, {0x38,0x44,0x44,0x48,0x7F},
+    {0x38,0x54,0x54,0x54,0x18}, {0x08,0x7E,0x09,0x01,0x02}, {0x0C,0x52,0x52,0x52,0x3E},
+    {0x7F,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7D,0x40,0x00}, {0x20,0x40,0x44,0x3D,0x00},
+    {0x7F,0x10,0x28,0x44,0x00}, {0x00,0x41,0x7F,0x40,0x00}, {0x7C,0x04,0x18,0x04,0x78},
+    {0x7C,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38}, {0x7C,0x14,0x14,0x14,0x08},
+    {0x08,0x14,0x14,0x18,0x7C}, {0x7C,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x20},
+    {0x04,0x3F,0x44,0x40,0x20}, {0x3C,0x40,0x40,0x20,0x7C}, {0x1C,0x20,0x40,0x20,0x1C},
+    {0x3C,0x40,0x30,0x40,0x3C}, {0x44,0x28,0x10,0x28,0x44}, {0x0C,0x50,0x50,0x50,0x3C},
+    {0x44,0x64,0x54,0x4C,0x44}, {0x00,0x08,0x36,0x41,0x00}, {0x00,0x00,0x7F,0x00,0x00},
+    {0x00,0x41,0x36,0x08,0x00}, {0x08,0x04,0x08,0x10,0x08},
+};
+
+// One line of text in the printer's character cells (Font A 12x24 with
+// the glyphs at 2x3, Font B 9x17 at 1x2), GS ! magnification on top.
+// Bold widens each stroke by a dot; inverted cells are black with white
+// glyphs. Characters outside ASCII print as '?'.
+static void raster_glyphs(struct raster *s, int x, int y, const char *str, int n,
+                          uint8_t esc_m, int xmag, int ymag, bool bold, bool ul, bool inv) {
+    int base_w = esc_m ? 9 : 12, base_h = esc_m ? 17 : 24;
+    int gx = esc_m ? 1 : 2, gy = esc_m ? 2 : 3;
+    int left = (base_w - 5 * gx) / 2, top = 1;
+    for (int i = 0; i < n; i++) {
+        int cx = x + i * base_w * xmag;
+        if (inv) raster_fill(s, cx, y, cx + base_w * xmag, y + base_h * ymag, true);
+        unsigned char c = str[i];
+        const uint8_t *g = font5x7[(c >= 0x20 && c < 0x7F ? c : '?') - 0x20];
+        for (int col = 0; col < 5; col++)
+            for (int row = 0; row < 7; row++) {
+                if (!(g[col] >> row & 1)) continue;
+                int px = cx + (left + col * gx) * xmag, py = y + (top + row * gy) * ymag;
+                raster_fill(s, px, py, px + (gx + bold) * xmag, py + gy * ymag, !inv);
+            }
+        if (ul) raster_fill(s, cx, y + (base_h - 1) * ymag, cx + base_w * xmag, y + base_h * ymag, !inv);
+    }
+}
+
+// Code 128 symbols 0..105 and stop, as bar/space widths starting with a bar
+static const char code128_pat[107][8] = {
+    "212222", "222122", "222221", "121223", "121322", "131222", "122213", "122312",
+    "132212", "221213", "221312", "231212", "112232", "122132", "122231", "113222",
+    "123122", "123221", "223211", "221132", "221231", "213212", "223112", "312131",
+    "311222", "321122", "321221", "312212", "322112", "322211", "212123", "212321",
+    "232121", "111323", "131123", "131321", "112313", "132113", "132311", "211313",
+    "231113", "231311", "112133", "112331", "132131", "113123", "113321", "133121",
+    "313121", "211331", "231131", "213113", "213311", "213131", "311123", "311321",
+    "331121", "312113", "312311", "332111", "314111", "221411", "431111", "111224",
+    "111422", "121124", "121421", "141122", "141221", "112214", "112412", "122114",
+    "122411", "142112", "142211", "241211", "221114", "413111", "241112", "134111",
+    "111242", "121142", "121241", "114212", "124112", "124211", "411212", "421112",
+    "421211", "212141", "214121", "412121", "111143", "111341", "131141", "114113",
+    "114311", "411113", "411311", "113141", "114131", "311141", "411131", "211412",
+    "211214", "211232", "2331112",
+};
+
+// EAN-13 L-code per digit (7 modules, MSB first); R is its complement and
+// G the R code reversed. Bits 5..0 of the parity mask pick G for the
+// left-hand digits 1..6.
+static const uint8_t ean_l[10] = { 0x0D, 0x19, 0x13, 0x3D, 0x23, 0x31, 0x2F, 0x3B, 0x37, 0x0B };
+static const uint8_t ean_parity[10] = { 0x00, 0x0B, 0x0D, 0x0E, 0x13, 0x19, 0x1C, 0x15, 0x16, 0x1A };
+
+static int bars_put(uint8_t *mod, int n, unsigned bits, int width) {
+    for (int i = width - 1; i >= 0; i--) mod[n++] = bits >> i & 1;
+    return n;
+}
+
+// Modules (1 = bar) of the symbol send_barcode would print for data:
+// EAN-13 for 12 digits, otherwise Code 128 in the subset it picks. The
+// HRI text goes to hri. Returns the module count, 0 if not encodable.
+static int barcode_modules(const char *data, uint8_t *mod, int cap, char *hri, size_t hcap) {
+    size_t L = strlen(data);
+    bool all_digits = true;
+    for (size_t i = 0; i < L; i++)
+        if (!isdigit((unsigned char)data[i])) all_digits = false;
+
+    if (all_digits && L == 12) {
+        if (cap < 95 || hcap < 14) return 0;
+        int sum = 0;
+        for (int i = 0; i < 12; i++) sum += (data[i] - '0') * (i & 1 ? 3 : 1);
+        snprintf(hri, hcap, "%s%d", data, (10 - sum % 10) % 10);
+        int n = bars_put(mod, 0, 0x5, 3);
+        uint8_t par = ean_parity[hri[0] - '0'];
+        for (int i = 1; i <= 6; i++) {
+            uint8_t l = ean_l[hri[i] - '0'], g = 0;
+            for (int b = 0; b < 7; b++) g |= ((~l >> b) & 1) << (6 - b);
+            n = bars_put(mod, n, par >> (6 - i) & 1 ? g : l, 7);
+        }
+        n = bars_put(mod, n, 0x0A, 5);
+        for (int i = 7; i <= 12; i++) n = bars_put(mod, n, ~ean_l[hri[i] - '0'] & 0x7F, 7);
+        return bars_put(mod, n, 0x5, 3);
+    }
+
+    char buf[260];
+    if (L == 0 || L + 2 > sizeof(buf) || L + 2 > hcap) return 0;
+    if (all_digits && L % 2) buf[0] = '0';
+    memcpy(buf + (all_digits && L % 2), data, L + 1);
+    L = strlen(buf);
+    char subset = 'C';
+    if (!all_digits) {
+        subset = 'A';
+        for (size_t i = 0; i < L; i++)
+            if (islower((unsigned char)buf[i]) || ispunct((unsigned char)buf[i])) subset = 'B';
+    }
+    snprintf(hri, hcap, "%s", buf);
 
-void ensure_capacity(size_t more) {
-    if (job_len + more > job_cap) {
-        size_t newcap = job_cap ? job_cap * 2 : INITIAL_CAP;
-        while (newcap < job_len + more) newcap *= 2;
-        job_buf = realloc(job_buf, newcap);
-        job_cap = newcap;
+    int vals[262], nv = 0;
+    vals[nv++] = 103 + (subset - 'A');
+    for (size_t i = 0; i < L; i++) {
+        unsigned char c = buf[i];
+        if (subset == 'C') {
+            vals[nv++] = (c - '0') * 10 + (buf[i + 1] - '0');
+            i++;
+        } else if (c >= 0x80 || (subset == 'A' && c >= 0x60) || (subset == 'B' && c < 0x20)) {
+            return 0;
+        } else {
+            vals[nv++] = c >= 0x20 ? c - 0x20 : c + 0x40;
+        }
     }
+    int check = vals[0];
+    for (int i = 1; i < nv; i++) check += vals[i] * i;
+    vals[nv++] = check % 103;
+    vals[nv++] = 106;
+
+    int n = 0;
+    for (int i = 0; i < nv; i++) {
+        const char *w = code128_pat[vals[i]];
+        for (int k = 0; w[k]; k++)
+            for (int j = 0; j < w[k] - '0'; j++) {
+                if (n == cap) return 0;
+                mod[n++] = !(k & 1);
+            }
+    }
+    return n;
 }
 
-void buffer_data(const void *data, size_t len) {
-    ensure_capacity(len);
-    memcpy(job_buf + job_len, data, len);
-    job_len += len;
+#define RASTER_GAP_ROWS 2       // blank rows a band may span rather than split
+
+// Send the framebuffer as GS v 0 bands, each in its own ESC W window
+// cropped to the bytes that have ink, and clear it for the next ~P
+static void raster_emit(struct render_context *ctx) {
+    struct raster *r = ctx->fb;
+    for (int y = 0; y < r->h; ) {
+        int y0 = -1, last = y, bx0 = r->bpr, bx1 = 0;
+        for (; y < r->h && (y0 < 0 || (y - last <= RASTER_GAP_ROWS && y - y0 < 2048)); y++) {
+            const uint8_t *row = r->bits + (size_t)y * r->bpr;
+            int a = 0, b = r->bpr;
+            while (a < b && !row[a]) a++;
+            if (a == b) continue;
+            while (!row[b - 1]) b--;
+            if (y0 < 0) y0 = y;
+            last = y;
+            if (a < bx0) bx0 = a;
+            if (b > bx1) bx1 = b;
+        }
+        if (y0 < 0) break;
+        y = last + 1;
+        int rows = last - y0 + 1, bw = bx1 - bx0;
+        prn_window(ctx, bx0 * 8, y0, bw * 8, rows, true);
+        prn_set(ctx, ESC, 'T', 0);
+        prn_write(ctx, (uint8_t[]){ GS, '$', 0, 0 }, 4);
+        prn_write(ctx, (uint8_t[]){ GS, 'v', '0', 0, lo(bw), hi(bw), lo(rows), hi(rows) }, 8);
+        for (int i = 0; i < rows; i++)
+            prn_write(ctx, r->bits + (size_t)(y0 + i) * r->bpr + bx0, bw);
+        atomic_fetch_add(&raster_bytes, (unsigned long)rows * bw);
+    }
+    memset(r->bits, 0, (size_t)r->bpr * r->h);
 }
 
+
 // --------- int main ----------------------------------------------------------------------
 
 int main(int argc, char **argv) {
     if (argc == 3) {
         // CLI mode
-        return convert_label(argv[1], argv[2]);
+        return convert_label(argv[1], argv[2], 0, &printer_ports[0]);
     }
     else if (argc == 1) {
 	// 1. Open & configure the scale serial port (OPTIONAL)
-	weight_fd = open("/dev/ttyUSB1", O_RDWR | O_NOCTTY | O_SYNC);
+	weight_fd = open(SCALE_PORT, O_RDWR | O_NOCTTY | O_SYNC);
 	if (weight_fd < 0) {
-	    perror("Warning: scale not connected (/dev/ttyUSB1)");
+	    perror("Warning: scale not connected (" SCALE_PORT ")");
 	    weight_fd = -1;  // mark as unavailable
 	} else {
 	    struct termios tty;
@@ -1918,40 +3825,24 @@ int main(int argc, char **argv) {
 	    }
 	}
        // 2. Start TCP server on port 8888
+        signal(SIGPIPE, SIG_IGN);   // a client vanishing mid-reply must not kill us
         int server_fd = setup_server_socket(PORT);
-        printf("Listening on port %d...\n", PORT);
-
-        // 3. Accept loop—always listening, never closing the port
-        while (1) {
-            struct sockaddr_in client_addr;
-            socklen_t addrlen = sizeof(client_addr);
-            int *pclient = malloc(sizeof(int));
-            if (!pclient) {
-                perror("malloc");
-                // Sleep a bit to avoid busy looping if malloc keeps failing
-                sleep(1);
-                continue;
-            }
-
-            *pclient = accept(server_fd,
-                              (struct sockaddr *)&client_addr,
-                              &addrlen);
-            if (*pclient < 0) {
-                perror("accept");
-                free(pclient);
-                continue;
-            }
-
-            // Launch a detached thread to handle this client
-            pthread_t tid;
-            if (pthread_create(&tid, NULL, client_thread, pclient) != 0) {
-                perror("pthread_create");
-                close(*pclient);
-                free(pclient);
-                continue;
-            }
-            pthread_detach(tid);
-        }
+        pool_start(WORKER_THREADS);
+        scale_sampler_start();
+        if (lft_db_open() < 0)
+            fprintf(stderr, "Warning: LFT database not ready, will retry per job\n");
+        long plus = plu_load_db();
+        if (plus >= 0)
+            printf("Product master: %ld PLU(s)\n", plus);
+        for (int i = 0; i < NUM_PRINTER_PORTS; i++)
+            if (printer_open(&printer_ports[i]) < 0)
+                fprintf(stderr, "Warning: printer %s not ready, will retry per job\n",
+                        printer_ports[i].path);
+        printf("Listening on port %d (up to %d clients, %d workers)...\n",
+               PORT, MAX_CLIENTS, WORKER_THREADS);
+
+        // 3. Event loop—always listening, never closing the port
+        run_event_loop(server_fd);
 
         // unreachable
     }
@@ -1966,450 +3857,1609 @@ int main(int argc, char **argv) {
 
 //-------- convert label ----------------------------------------------------------------------------------
 
-int convert_label(const char *config_path, const char *lft_path) {
-    // 1) load JSON into the global json_root
-    load_json_data(config_path);
-    if (json_root == NULL) {
-        fprintf(stderr, "Error: failed to parse JSON in %s\n", config_path);
-        return 1;
+// ─── Printer session ──────────────────────────────────────────────
+// The port is opened and configured once and reused by every job on its
+// lane. A write error or a vanished device node closes it; the next job
+// reopens it and starts with ESC @ because the printer state is unknown.
+
+static void printer_close(struct printer_port *pp) {
+    if (pp->fd >= 0) close(pp->fd);
+    pp->fd = -1;
+    pp->state_known = false;
+}
+
+// Cheap unplug check: the node must still exist and be the same device
+static bool printer_alive(struct printer_port *pp) {
+    struct stat st;
+    return stat(pp->path, &st) == 0 && st.st_rdev == pp->rdev;
+}
+
+int printer_open(struct printer_port *pp) {
+    if (pp->fd >= 0) {
+        if (printer_alive(pp)) return pp->fd;
+        fprintf(stderr, "Printer %s went away, reconnecting\n", pp->path);
+        printer_close(pp);
     }
 
-    // --- 1.a) Extract actual_unit_price and unit_price from JSON ---
-    {
-        struct json_object *d = NULL, *val = NULL;
+    int fd = open(pp->path, O_RDWR | O_NOCTTY | O_SYNC);
+    if (fd < 0) {
+        perror("opening serial port");
+        return -1;
+    }
 
-        if (json_object_object_get_ex(json_root, "data", &d)) {
-            if (json_object_object_get_ex(d, "actual_unit_price", &val)) {
-                actual_unit_price = atof(json_object_get_string(val));
-            }
-            if (json_object_object_get_ex(d, "spl_up", &val)) {
-                unit_price = atof(json_object_get_string(val));
-            }
+    struct termios tty;
+    struct stat st;
+    if (tcgetattr(fd, &tty) != 0 || fstat(fd, &st) != 0) {
+        perror("tcgetattr");
+        close(fd);
+        return -1;
+    }
+    cfsetospeed(&tty, B115200);
+    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;
+    tty.c_cflag &= ~PARENB;
+    tty.c_cflag &= ~CSTOPB;
+    tty.c_cflag &= ~CRTSCTS;
+    tty.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tty);
+
+    pp->fd = fd;
+    pp->rdev = st.st_rdev;
+    pp->state_known = false;
+    const char *env = getenv("ESSAE_PRN_IMAGE_KB");
+    pp->images.budget = env ? (size_t)atoi(env) * 1024 : 0;
+    env = getenv("ESSAE_PRN_MACRO_BYTES");
+    pp->macro.cap = env ? (size_t)atoi(env) : 0;
+    pp->macro.len = 0;          // may be a different or power-cycled printer
+    pp->raster_slots = getenv("ESSAE_RASTER_SLOTS");
+    pp->opens++;
+    if (pp->opens > 1)
+        printf("Printer %s reconnected\n", pp->path);
+    return fd;
+}
+
+// ─── Compiled LFT programs ────────────────────────────────────────
+// Each slot's LFT is parsed once into an array of element records:
+// numbers converted, ~T text unescaped, bitmap data decoded. Prints run
+// the records; only what depends on the product (~V values, ~B data,
+// print status) is resolved per job. A program is reused while the
+// slot's content in lft_files is byte-for-byte the same.
+//
+// Runs of static elements (~T, ~R, ~C, ~d, ~A, ~s, ~I) form segments
+// whose ESC/POS bytes are kept after the first render. A render is
+// reused when the printer-state tracker, label size and (for segments
+// with uom-dependent print status) item type match; only ~V and ~B
+// are rendered on every print.
+
+#define LFT_SEG_RENDERS 8       // cached renders per segment
+
+enum lft_op {
+    OP_SIZE, OP_SPACING, OP_CLEAR, OP_TEXT, OP_VAR, OP_BARCODE, OP_RECT,
+    OP_CIRCLE, OP_RAW, OP_BITMAP, OP_DELAY, OP_INTENSITY, OP_READ, OP_PRINT
+};
+
+struct lft_text {               // ~T and ~V
+    float x, y, xm, ym, spacing;
+    int   angle, font, len, offset, lines;
+    char  justify, mode[4];
+    char  id[32];               // ~V data id
+    unsigned short data_id;     // ~V registry data ID, 0 = look id up in the record
+    char *text;                 // ~T text / ~V fallback, escapes decoded
+};
+
+struct lft_elem {
+    enum lft_op op;
+    char status;                // CheckPrintStatus() code, checked per job
+    union {
+        struct { float w_mm, h_mm; uint16_t w, h; } size;           // ~S (dots)
+        uint8_t spacing;                                            // ~s (dots)
+        struct { int x, y, dx, dy; } clear;                         // ~A (dots)
+        struct lft_text text;                                       // ~T / ~V
+        struct { float x, y, mw, bh; int angle, font, len, offset;
+                 char justify, hri, mode; } barcode;                // ~B
+        struct { float x, y, angle, dx, dy, th; char mode; } rect;  // ~R
+        struct { float x, y, r, t; char mode; } circle;             // ~C
+        struct { uint8_t bytes[64]; int n; } raw;                   // ~c
+        struct { float x, y, w, h; int angle, xmag, ymag; char mode[4];
+                 const uint8_t *data; size_t len;
+                 uint64_t key;          // hash of data and geometry
+                 bool owned; } bitmap;                              // ~d (raw data points into src)
+        int delay_ms;                                               // ~Y (clamped)
+        uint8_t level;                                              // ~I (clamped)
+        struct { char mode; char expected[128]; int timeout_ms; } read;  // ~e
+        struct { int copies; char dir; } print;                     // ~P
+    } u;
+};
+
+struct lft_render {             // one cached render of a segment
+    int    variant;             // uom_type / price match, when the segment cares
+    float  lbl_w, lbl_h;
+    struct prn_tracker in, out; // tracker state before and after
+    const struct prn_images *imgs;  // resident images it may print by key
+    unsigned img_epoch;
+    uint64_t hash;              // FNV-1a of bytes, to recognise the printer's macro
+    long   suppressed;          // tracker's suppressed count delta
+    uint8_t *bytes;
+    size_t len;
+    struct lft_render *next;
+};
+
+struct lft_segment {
+    int    first, count;        // element range
+    bool   by_uom;              // holds elements with print status 2..5
+    bool   has_bitmap;          // holds ~d: renders depend on resident images
+    int    nrenders;
+    struct lft_render *renders;
+};
+
+struct raster_frame {           // static layer of a rastered program
+    int    variant;             // as lft_render
+    float  lbl_w, lbl_h;
+    struct raster_frame *next;
+    uint8_t bits[];             // the framebuffer's rows
+};
+
+struct lft_program {
+    int    slot;
+    void  *src;                 // LFT bytes the program was built from
+    int    src_len;
+    struct lft_elem *elems;
+    int    count, cap;
+    struct lft_segment *segs;
+    int    nsegs;
+    bool   frame_ok;            // static layer can be drawn ahead of ~V / ~B
+    bool   frame_by_uom;        // ... and holds elements with print status 2..5
+    struct raster_frame *frames;
+    int    nframes;
+    sqlite3_int64 version;      // data_version the source was last checked at
+    int    refs;                // cache + running jobs
+    struct lft_program *next;
+};
+
+static pthread_mutex_t lft_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lft_program *lft_cache;
+static unsigned long lft_cache_hits, lft_cache_compiles, lft_blob_reads;
+static unsigned long lft_seg_hits, lft_seg_renders;
+
+int lft_cache_stats(char *out, size_t cap) {
+    pthread_mutex_lock(&lft_cache_lock);
+    int n = snprintf(out, cap, " lft_hits=%lu lft_reads=%lu lft_compiles=%lu seg_hits=%lu seg_renders=%lu",
+                     lft_cache_hits, lft_blob_reads, lft_cache_compiles, lft_seg_hits, lft_seg_renders);
+    pthread_mutex_unlock(&lft_cache_lock);
+    return n;
+}
+
+static void lft_program_free(struct lft_program *prog) {
+    for (int i = 0; i < prog->count; i++) {
+        struct lft_elem *e = &prog->elems[i];
+        if (e->op == OP_TEXT || e->op == OP_VAR) free(e->u.text.text);
+        if (e->op == OP_BITMAP && e->u.bitmap.owned) free((void *)e->u.bitmap.data);
+    }
+    for (int i = 0; i < prog->nsegs; i++) {
+        struct lft_render *r = prog->segs[i].renders;
+        while (r) {
+            struct lft_render *next = r->next;
+            free(r->bytes);
+            free(r);
+            r = next;
         }
     }
+    while (prog->frames) {
+        struct raster_frame *next = prog->frames->next;
+        free(prog->frames);
+        prog->frames = next;
+    }
+    free(prog->segs);
+    free(prog->elems);
+    free(prog->src);
+    free(prog);
+}
+
+static struct lft_elem *lft_add(struct lft_program *prog, enum lft_op op, char status) {
+    if (prog->count == prog->cap) {
+        int ncap = prog->cap ? prog->cap * 2 : 32;
+        struct lft_elem *ne = realloc(prog->elems, ncap * sizeof(*ne));
+        if (!ne) return NULL;
+        prog->elems = ne;
+        prog->cap = ncap;
+    }
+    struct lft_elem *e = &prog->elems[prog->count++];
+    memset(e, 0, sizeof(*e));
+    e->op = op;
+    e->status = status;
+    return e;
+}
 
+// Elements whose output never depends on the job's data
+static bool lft_op_static(enum lft_op op) {
+    return op == OP_TEXT || op == OP_RECT || op == OP_CIRCLE || op == OP_BITMAP ||
+           op == OP_CLEAR || op == OP_SPACING || op == OP_INTENSITY;
+}
 
-    // ─── Count how many barcodes we have ──────────────────────────
-    {
-        json_object *barcodes_arr = NULL;
-        if (json_object_object_get_ex(
-                json_root,        // <-- use json_root, not job_obj
-                "barcodes",
-                &barcodes_arr
-            )
-            && json_object_is_type(barcodes_arr, json_type_array))
-        {
-            num_json_barcodes = json_object_array_length(barcodes_arr);
+// FNV-1a over a ~d element's data and everything that shapes its raster
+static uint64_t lft_image_key(const struct lft_elem *e) {
+    int geo[5] = { e->u.bitmap.angle == 0, e->u.bitmap.xmag, e->u.bitmap.ymag,
+                   (int)(e->u.bitmap.w * DOTS_PER_MM + 0.5f),
+                   (int)(e->u.bitmap.h * DOTS_PER_MM + 0.5f) };
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < sizeof(geo); i++)
+        h = (h ^ ((const uint8_t *)geo)[i]) * 0x100000001b3ULL;
+    for (size_t i = 0; i < e->u.bitmap.len; i++)
+        h = (h ^ e->u.bitmap.data[i]) * 0x100000001b3ULL;
+    return h ? h : 1;
+}
+
+// Split the program into runs of static elements
+static bool lft_segment(struct lft_program *prog) {
+    for (int i = 0; i < prog->count; ) {
+        if (!lft_op_static(prog->elems[i].op)) { i++; continue; }
+        struct lft_segment *ns = realloc(prog->segs, (prog->nsegs + 1) * sizeof(*ns));
+        if (!ns) return false;
+        prog->segs = ns;
+        struct lft_segment *sg = &prog->segs[prog->nsegs++];
+        memset(sg, 0, sizeof(*sg));
+        sg->first = i;
+        for (; i < prog->count && lft_op_static(prog->elems[i].op); i++) {
+            if (prog->elems[i].status >= '2' && prog->elems[i].status <= '5')
+                sg->by_uom = true;
+            if (prog->elems[i].op == OP_BITMAP)
+                sg->has_bitmap = true;
+            sg->count++;
+        }
+    }
+    return true;
+}
+
+// Whether drawing the static elements first and then ~V / ~B gives the
+// same raster as drawing in order: one ~S before anything is drawn, one
+// ~P after it all, and nothing that overwrites (~A, mode I) once a
+// ~V / ~B has been drawn, nor anything at all after an inverted ~V
+static bool lft_frame_ok(struct lft_program *prog) {
+    int sizes = 0, prints = 0;
+    bool seen_var = false, seen_inv = false;
+    for (int i = 0; i < prog->count; i++) {
+        const struct lft_elem *e = &prog->elems[i];
+        switch (e->op) {
+        case OP_SIZE:  sizes++; continue;
+        case OP_PRINT: prints++; continue;
+        case OP_VAR:
+        case OP_BARCODE:
+            if (!sizes || prints) return false;
+            seen_var = true;
+            if (e->op == OP_VAR && strchr(e->u.text.mode, 'I')) seen_inv = true;
+            continue;
+        case OP_TEXT: case OP_RECT: case OP_CIRCLE: case OP_BITMAP: case OP_CLEAR: {
+            if (!sizes || prints || seen_inv) return false;
+            bool over = e->op == OP_CLEAR ||
+                        (e->op == OP_TEXT && strchr(e->u.text.mode, 'I')) ||
+                        (e->op == OP_RECT && e->u.rect.mode == 'I') ||
+                        (e->op == OP_CIRCLE && e->u.circle.mode == 'I');
+            if (over && seen_var) return false;
+            if (e->status >= '2' && e->status <= '5') prog->frame_by_uom = true;
+            continue;
+        }
+        default:
+            continue;
+        }
+    }
+    return sizes == 1 && prints == 1;
+}
+
+// \n, \, and \\ escapes used by ~T / ~V text
+static void lft_unescape(const char *s, char *d) {
+    while (*s) {
+        if (s[0] == '\\') {
+            if (s[1] == 'n') { *d++ = '\n'; s += 2; }
+            else if (s[1] == ',') { *d++ = ','; s += 2; }
+            else if (s[1] == '\\') { *d++ = '\\'; s += 2; }
+            else { *d++ = *s++; }
         } else {
-            num_json_barcodes = 0;
+            *d++ = *s++;
         }
     }
-    // ───────────────────────────────────────────────────────────────
+    *d = '\0';
+}
 
-// ================================================================
-// Only override JSON weight_or_quantity if item is a WEIGHING item
-// ================================================================
-if (uom_type == WEIGH) {
-    char rawbuf[64] = {0};
-    double kg = 0.0;
-
-    // Send RD_WEIGHT (0x05) to the scale
-    unsigned char rd_cmd = 0x05;
-    if (write(weight_fd, &rd_cmd, 1) < 0) {
-        perror("Error writing RD_WEIGHT to scale port");
+// fgets() over the blob: the next line (at most max-1 bytes of it)
+static bool lft_getline(const char **src, const char *end, char *line, size_t max) {
+    if (*src >= end) return false;
+    size_t n = end - *src;
+    if (n > max - 1) n = max - 1;
+    const char *nl = memchr(*src, '\n', n);
+    if (nl) n = nl - *src + 1;
+    memcpy(line, *src, n);
+    line[n] = '\0';
+    *src += n;
+    return true;
+}
+
+// Parse LFT bytes into a program that keeps its own copy of them; NULL
+// on allocation failure. Lines are read straight from that copy, and
+// raw ~d image data is used in place.
+static struct lft_program *lft_compile(const void *src, int src_len) {
+    struct lft_program *prog = calloc(1, sizeof(*prog));
+    if (!prog) return NULL;
+    prog->src = malloc(src_len ? src_len : 1);
+    if (!prog->src) goto oom;
+    memcpy(prog->src, src, src_len);
+    prog->src_len = src_len;
+
+    const char *p = prog->src, *end = p + src_len;
+    char line[512];
+    while (lft_getline(&p, end, line, sizeof(line))) {
+        if (line[0]=='#' || line[0]=='@' || line[0]=='\n')
+            continue;
+
+        struct lft_elem *e = NULL;
+
+        // -------- ~S: define label size & page window in mm --------
+        if (strncmp(line,"~S",2)==0) {
+            float w,h,g; int no;
+            if (sscanf(line+3,"%f,%f,%f,%d",&w,&h,&g,&no)>=2) {
+                if (!(e = lft_add(prog, OP_SIZE, '1'))) goto oom;
+                e->u.size.w_mm = w;
+                e->u.size.h_mm = h;
+                e->u.size.w = (uint16_t)(w*DOTS_PER_MM + 0.5f);
+                e->u.size.h = (uint16_t)(h*DOTS_PER_MM + 0.5f);
+            }
+        }
+        // ------- ~s: line spacing (mm) -------
+        else if (strncmp(line, "~s", 2) == 0) {
+            float sp_mm;
+            if (sscanf(line + 3, "%f", &sp_mm) == 1) {
+                if (!(e = lft_add(prog, OP_SPACING, '1'))) goto oom;
+                e->u.spacing = (uint8_t)(int)(sp_mm * DOTS_PER_MM + 0.5f);
+            }
+        }
+        // ------ ~A: clear area ------
+        else if (strncmp(line, "~A", 2) == 0) {
+            float x,y,dx,dy; char mode;
+            if (sscanf(line+3, "%f,%f,%f,%f,%c", &x,&y,&dx,&dy,&mode) >= 5) {
+                if (!(e = lft_add(prog, OP_CLEAR, '1'))) goto oom;
+                e->u.clear.x  = (int)(x * DOTS_PER_MM + 0.5f);
+                e->u.clear.y  = (int)(y * DOTS_PER_MM + 0.5f);
+                e->u.clear.dx = (int)(dx * DOTS_PER_MM + 0.5f);
+                e->u.clear.dy = (int)(dy * DOTS_PER_MM + 0.5f);
+            }
+        }
+        // ------- ~T Fixed Text -------
+        else if (strncmp(line, "~T", 2) == 0) {
+            char prnstatus = '1';
+            char decoded[512];
+            char *p = line + 3;
+
+            // Trim trailing whitespace/newlines
+            for (int i = strlen(p) - 1; i >= 0 && isspace((unsigned char)p[i]); --i)
+                p[i] = '\0';
+
+            // Extract print status (last char)
+            char *c = strrchr(p, ',');
+            if (c && strlen(c + 1) == 1 && isdigit((unsigned char)*(c + 1))) {
+                prnstatus = *(c + 1);
+                *c = '\0';
+            }
+
+            // Split on commas, keeping escaped ones inside the text field
+            char *fields[13];
+            int field_count = 0;
+            for (char *token = p; token && field_count < 13; ) {
+                char *comma = token;
+                while (*comma) {
+                    if (*comma == '\\' && comma[1] == ',') {
+                        comma += 2; // skip escaped comma
+                        continue;
+                    }
+                    if (*comma == ',') break;
+                    comma++;
+                }
+                if (*comma == ',') {
+                    *comma = '\0';
+                    fields[field_count++] = token;
+                    token = comma + 1;
+                } else {
+                    fields[field_count++] = token;
+                    break;
+                }
+            }
+            if (field_count < 13) continue;
+
+            lft_unescape(fields[6], decoded);
+
+            if (!(e = lft_add(prog, OP_TEXT, prnstatus))) goto oom;
+            struct lft_text *t = &e->u.text;
+            t->x = atof(fields[0]);
+            t->y = atof(fields[1]);
+            t->angle = atoi(fields[2]);
+            t->font = atoi(fields[3]);
+            t->xm = atof(fields[4]);
+            t->ym = atof(fields[5]);
+            t->len = atoi(fields[7]);
+            t->offset = atoi(fields[8]);
+            t->justify = fields[9][0];
+            t->lines = atoi(fields[10]);
+            t->spacing = atof(fields[11]);
+            strncpy(t->mode, fields[12], 3); t->mode[3] = '\0';
+            if (!(t->text = strdup(decoded))) goto oom;
+        }
+        // ----------- ~V Variable Text -----------
+        else if (strncmp(line, "~V", 2) == 0) {
+            char prnstatus = '1';
+            char raw[512] = "", decoded[512] = "";
+            char *p = line + 3;
+
+            // Strip print status (last char if digit)
+            char *last_comma = strrchr(p, ',');
+            if (last_comma && strlen(last_comma + 1) == 1 && isdigit((unsigned char)*(last_comma + 1))) {
+                prnstatus = *(last_comma + 1);
+                *last_comma = '\0';
+            }
+
+            char *fields[14];
+            int i = 0;
+            char *token = strtok(p, ",");
+            while (token && i < 14) {
+                fields[i++] = token;
+                token = strtok(NULL, ",");
+            }
+            if (i < 13) continue;
+
+            if (!(e = lft_add(prog, OP_VAR, prnstatus))) goto oom;
+            struct lft_text *t = &e->u.text;
+            t->x = atof(fields[0]);
+            t->y = atof(fields[1]);
+            t->angle = atoi(fields[2]);
+            t->font = atoi(fields[3]);
+            t->xm = atof(fields[4]);
+            t->ym = atof(fields[5]);
+            strncpy(t->id, fields[6], sizeof(t->id)-1);
+            if (isdigit((unsigned char)t->id[0]) && atoi(t->id) < FLD_COUNT)
+                t->data_id = atoi(t->id);
+            strncpy(raw, fields[7], sizeof(raw)-1);
+            t->len = atoi(fields[8]);
+            t->offset = atoi(fields[9]);
+            t->justify = fields[10][0];
+            t->lines = atoi(fields[11]);
+            t->spacing = atof(fields[12]);
+            // fields[13] is absent when the line has only 13 fields
+            if (i > 13) { strncpy(t->mode, fields[13], 3); t->mode[3] = '\0'; }
+
+            lft_unescape(raw, decoded);
+            if (!(t->text = strdup(decoded))) goto oom;
+        }
+        // ------ Barcode ~B (data comes from JSON per job) ------
+        else if (strncmp(line, "~B", 2) == 0) {
+            float x, y, module_width_mm, bar_height_mm;
+            int angle, font, offset, data_length;
+            char justify = 'N', hri = 'N', mode = 'W';
+
+            // Parse full barcode line — we ignore .LFT barcode data + type
+            if (sscanf(line + 3,
+                "%f,%f,%d,%d,%f,%f,%*[^,],%d,%d,%c,%*[^,],%c,%c,%*[^,\r\n]",
+                &x, &y,
+                &angle, &font,
+                &module_width_mm, &bar_height_mm,
+                &data_length, &offset,
+                &justify, &hri, &mode
+            ) != 11) {
+                fprintf(stderr, "Invalid ~B line format: %s\n", line);
+                continue;
+            }
+            if (!(e = lft_add(prog, OP_BARCODE, '1'))) goto oom;
+            e->u.barcode.x = x;
+            e->u.barcode.y = y;
+            e->u.barcode.mw = module_width_mm;
+            e->u.barcode.bh = bar_height_mm;
+            e->u.barcode.angle = angle;
+            e->u.barcode.font = font;
+            e->u.barcode.len = data_length;
+            e->u.barcode.offset = offset;
+            e->u.barcode.justify = justify;
+            e->u.barcode.hri = hri;
+            e->u.barcode.mode = mode;
+        }
+        // ------ ~R Rectangle ------
+        else if (strncmp(line, "~R", 2) == 0) {
+            float x = 0, y = 0, angle = 0, dx = 0, dy = 0, th = 0;
+            char mode = 'W', status = '1';  // Default printstatus = '1'
+            int count = sscanf(line + 3, "%f,%f,%f,%f,%f,%f,%c,%c",
+                               &x, &y, &angle, &dx, &dy, &th, &mode, &status);
+            if (count >= 7) {
+                if (!(e = lft_add(prog, OP_RECT, status))) goto oom;
+                e->u.rect.x = x;   e->u.rect.y = y;   e->u.rect.angle = angle;
+                e->u.rect.dx = dx; e->u.rect.dy = dy; e->u.rect.th = th;
+                e->u.rect.mode = mode;
+            }
+        }
+        // ------ ~C Circle ------
+        else if (strncmp(line, "~C", 2) == 0) {
+            float x, y, r, t;
+            char mode = 'W', printstatus = '1';
+            int num = sscanf(line + 3, "%f,%f,%f,%f,%c,%c", &x, &y, &r, &t, &mode, &printstatus);
+            if (num >= 5) {
+                if (!(e = lft_add(prog, OP_CIRCLE, printstatus))) goto oom;
+                e->u.circle.x = x; e->u.circle.y = y;
+                e->u.circle.r = r; e->u.circle.t = t;
+                e->u.circle.mode = mode;
+            }
+        }
+        // ------ ~c Escape Codes (comma-separated integers) ------
+        else if (strncmp(line, "~c", 2) == 0) {
+            uint8_t esc_bytes[64];
+            int value, n = 0;
+            const char *p = line + 3;
+            while (*p && n < 64) {
+                if (sscanf(p, "%d", &value) == 1) {
+                    esc_bytes[n++] = (uint8_t)value;
+                }
+                // Skip to next comma
+                while (*p && *p != ',') p++;
+                if (*p == ',') p++;
+            }
+            if (n > 0) {
+                if (!(e = lft_add(prog, OP_RAW, '1'))) goto oom;
+                memcpy(e->u.raw.bytes, esc_bytes, n);
+                e->u.raw.n = n;
+            }
+        }
+        // ------ ~d Bitmap Data (image bytes follow the line) ------
+        else if (strncmp(line, "~d", 2) == 0) {
+            char prnstatus = '1';
+            char *fields[11];
+            int i = 0;
+            char *token = strtok(line + 3, ",");
+            while (token && i < 11) {
+                fields[i++] = token;
+                token = strtok(NULL, ",");
+            }
+            if (i < 9) continue;
+            if (i > 9 && isdigit(fields[9][0])) prnstatus = fields[9][0];
+
+            if (!(e = lft_add(prog, OP_BITMAP, prnstatus))) goto oom;
+            e->u.bitmap.x = atof(fields[0]);
+            e->u.bitmap.y = atof(fields[1]);
+            e->u.bitmap.angle = atoi(fields[2]);
+            e->u.bitmap.xmag = atoi(fields[3]);
+            e->u.bitmap.ymag = atoi(fields[4]);
+            e->u.bitmap.w = atof(fields[5]);
+            e->u.bitmap.h = atof(fields[6]);
+            strncpy(e->u.bitmap.mode, fields[8], 3);
+            e->u.bitmap.mode[3] = '\0';
+
+            int img_w = (int)(e->u.bitmap.w * DOTS_PER_MM + 0.5f) * e->u.bitmap.xmag;
+            int img_h = (int)(e->u.bitmap.h * DOTS_PER_MM + 0.5f) * e->u.bitmap.ymag;
+            int total_bytes = ((img_w + 7) / 8) * img_h;
+            if (total_bytes < 0) total_bytes = 0;
+
+            // Backslash-hex escaped data, or raw bytes used where they are
+            if (p < end && *p == '\\') {
+                uint8_t *buf = malloc(total_bytes ? total_bytes : 1);
+                if (!buf) goto oom;
+                e->u.bitmap.len = decode_escaped_binary(&p, end, buf, total_bytes);
+                e->u.bitmap.data = buf;
+                e->u.bitmap.owned = true;
+            } else {
+                size_t n = end - p;
+                e->u.bitmap.data = (const uint8_t *)p;
+                e->u.bitmap.len = n < (size_t)total_bytes ? n : (size_t)total_bytes;
+                p += e->u.bitmap.len;
+            }
+            e->u.bitmap.key = lft_image_key(e);
+        }
+        // ------ ~Y Delay (5–5000 ms) ------
+        else if (strncmp(line, "~Y", 2) == 0) {
+            int delay_ms;
+            if (sscanf(line + 3, "%d", &delay_ms) == 1) {
+                if (delay_ms < 5) delay_ms = 5;
+                else if (delay_ms > 5000) delay_ms = 5000;
+                if (!(e = lft_add(prog, OP_DELAY, '1'))) goto oom;
+                e->u.delay_ms = delay_ms;
+            }
+        }
+        // ------ ~I Intensity ------
+        else if (strncmp(line, "~I", 2) == 0) {
+            int level;
+            if (sscanf(line + 3, "%d", &level) == 1) {
+                // clamp to 60–140%
+                if (level < 60) level = 60;
+                if (level > 140) level = 140;
+                if (!(e = lft_add(prog, OP_INTENSITY, '1'))) goto oom;
+                e->u.level = (uint8_t)level;
+            }
+        }
+        // ------ ~e Read Response ------
+        else if (strncmp(line, "~e", 2) == 0) {
+            char mode = '\0';
+            char expected[128] = {0};
+            int timeout_ms = 0;
+            // single-char mode, up to 127-byte expected string, integer timeout
+            if (sscanf(line + 3, " %c , %127[^,] , %d",
+                       &mode, expected, &timeout_ms) >= 3) {
+                if (!(e = lft_add(prog, OP_READ, '1'))) goto oom;
+                e->u.read.mode = mode;
+                memcpy(e->u.read.expected, expected, sizeof(expected));
+                e->u.read.timeout_ms = timeout_ms;
+            }
+        }
+        // ------- ~P: print & exit page mode -------
+        else if (strncmp(line,"~P",2)==0) {
+            int copies; char dir = 'N';
+            if (sscanf(line+3,"%d,%c",&copies,&dir)!=2) copies=1;
+            if (!(e = lft_add(prog, OP_PRINT, '1'))) goto oom;
+            e->u.print.copies = copies;
+            e->u.print.dir = dir;
+        }
+    }
+    if (lft_segment(prog)) {
+        prog->frame_ok = lft_frame_ok(prog);
+        return prog;
+    }
+
+oom:
+    fprintf(stderr, "Error: out of memory compiling LFT\n");
+    lft_program_free(prog);
+    return NULL;
+}
+
+// Cached program for a slot if it was checked at this data_version
+static struct lft_program *lft_program_current(int slot, sqlite3_int64 version) {
+    struct lft_program *prog;
+    pthread_mutex_lock(&lft_cache_lock);
+    for (prog = lft_cache; prog; prog = prog->next) {
+        if (prog->slot == slot) break;
+    }
+    if (prog && prog->version == version) {
+        prog->refs++;
+        lft_cache_hits++;
     } else {
-        usleep(200000);  // wait for scale response
+        prog = NULL;
+    }
+    pthread_mutex_unlock(&lft_cache_lock);
+    return prog;
+}
 
-        int n = read(weight_fd, rawbuf, sizeof(rawbuf) - 1);
-        if (n > 0) {
-            rawbuf[n] = '\0';
-            kg = atof(rawbuf);
+// Program for a slot's current LFT bytes, compiling on first use or after
+// the row changed. The caller owns one reference (lft_program_put).
+static struct lft_program *lft_program_get(int slot, const void *src, int src_len,
+                                           sqlite3_int64 version) {
+    pthread_mutex_lock(&lft_cache_lock);
+    lft_blob_reads++;
+
+    struct lft_program **pp = &lft_cache;
+    for (; *pp; pp = &(*pp)->next) {
+        if ((*pp)->slot != slot) continue;
+        struct lft_program *prog = *pp;
+        if (prog->src_len == src_len && memcmp(prog->src, src, src_len) == 0) {
+            prog->version = version;
+            prog->refs++;
+            lft_cache_hits++;
+            pthread_mutex_unlock(&lft_cache_lock);
+            return prog;
+        }
+        // Row was edited: drop the stale program (freed once no job uses it)
+        *pp = prog->next;
+        if (--prog->refs == 0) lft_program_free(prog);
+        break;
+    }
+
+    struct lft_program *prog = lft_compile(src, src_len);
+    if (prog) {
+        prog->slot = slot;
+        prog->version = version;
+        prog->refs = 2;         // the cache and the caller
+        prog->next = lft_cache;
+        lft_cache = prog;
+        lft_cache_compiles++;
+    }
+    pthread_mutex_unlock(&lft_cache_lock);
+    return prog;
+}
+
+static void lft_program_put(struct lft_program *prog) {
+    pthread_mutex_lock(&lft_cache_lock);
+    if (--prog->refs == 0) lft_program_free(prog);
+    pthread_mutex_unlock(&lft_cache_lock);
+}
+
+// ─── LFT database ─────────────────────────────────────────────────
+// One connection for the server's lifetime with its statements prepared
+// once. PRAGMA data_version moves whenever another connection (the GUI)
+// commits; while it holds still the cached programs are current and a
+// print does not touch lft_files at all. Any SQLite error, or the file
+// being replaced under us, closes the connection and it is reopened.
+
+#define LFT_DB_MMAP_SIZE (64 << 20)
+
+static struct {
+    pthread_mutex_t lock;
+    sqlite3 *db;
+    sqlite3_stmt *sel;          // SELECT content ... WHERE slot = ?
+    sqlite3_stmt *ver;          // PRAGMA data_version
+    dev_t dev;                  // identity of the opened file
+    ino_t ino;
+    unsigned opens;             // data_version restarts with each connection
+} lft_db = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void lft_db_close(void) {
+    sqlite3_finalize(lft_db.sel);
+    sqlite3_finalize(lft_db.ver);
+    sqlite3_close(lft_db.db);
+    lft_db.sel = lft_db.ver = NULL;
+    lft_db.db = NULL;
+}
+
+// Open and prepare if not done yet; call with lft_db.lock held
+static bool lft_db_ready(void) {
+    struct stat st;
+    bool present = stat(LFT_DB_PATH, &st) == 0;
+    if (lft_db.db) {
+        if (present && st.st_dev == lft_db.dev && st.st_ino == lft_db.ino)
+            return true;
+        lft_db_close();         // deleted or swapped for another file
+    }
+    lft_db.dev = present ? st.st_dev : 0;
+    lft_db.ino = present ? st.st_ino : 0;
+
+    if (sqlite3_open_v2(LFT_DB_PATH, &lft_db.db,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Error: cannot open LFT database: %s\n", sqlite3_errmsg(lft_db.db));
+        lft_db_close();
+        return false;
+    }
+    lft_db.opens++;
+    // WAL lets the GUI commit while a print reads (the mode sticks to the
+    // file; on a read-only medium it just stays as it was). We never write.
+    sqlite3_exec(lft_db.db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+    sqlite3_exec(lft_db.db, "PRAGMA query_only=1", NULL, NULL, NULL);
+    char mmap_sql[48];
+    snprintf(mmap_sql, sizeof(mmap_sql), "PRAGMA mmap_size=%d", LFT_DB_MMAP_SIZE);
+    sqlite3_exec(lft_db.db, mmap_sql, NULL, NULL, NULL);
+    sqlite3_busy_timeout(lft_db.db, 1000);
+
+    if (sqlite3_prepare_v2(lft_db.db, "SELECT content FROM lft_files WHERE slot = ?",
+                           -1, &lft_db.sel, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(lft_db.db, "PRAGMA data_version", -1, &lft_db.ver, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Error: LFT database: %s\n", sqlite3_errmsg(lft_db.db));
+        lft_db_close();
+        return false;
+    }
+    return true;
+}
+
+int lft_db_open(void) {
+    pthread_mutex_lock(&lft_db.lock);
+    bool ok = lft_db_ready();
+    pthread_mutex_unlock(&lft_db.lock);
+    return ok ? 0 : -1;
+}
+
+// Compiled program for a slot (caller puts it); NULL after printing why
+static struct lft_program *lft_load(int slot) {
+    struct lft_program *prog = NULL;
+    sqlite3_int64 version = 0;
+    int rc = SQLITE_OK;
+
+    pthread_mutex_lock(&lft_db.lock);
+    if (!lft_db_ready()) {
+        pthread_mutex_unlock(&lft_db.lock);
+        return NULL;
+    }
+
+    rc = sqlite3_step(lft_db.ver);
+    if (rc == SQLITE_ROW)
+        version = ((sqlite3_int64)lft_db.opens << 40) | sqlite3_column_int64(lft_db.ver, 0);
+    sqlite3_reset(lft_db.ver);
+
+    if (rc == SQLITE_ROW && !(prog = lft_program_current(slot, version))) {
+        sqlite3_bind_int(lft_db.sel, 1, slot);
+        rc = sqlite3_step(lft_db.sel);
+        if (rc == SQLITE_ROW) {
+            prog = lft_program_get(slot, sqlite3_column_blob(lft_db.sel, 0),
+                                   sqlite3_column_bytes(lft_db.sel, 0), version);
+            if (!prog) fprintf(stderr, "Error: cannot compile LFT for slot %d\n", slot);
+        } else if (rc == SQLITE_DONE) {
+            fprintf(stderr, "Error: no LFT file found for slot %d\n", slot);
+        }
+        sqlite3_reset(lft_db.sel);
+    }
+
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        fprintf(stderr, "Error: LFT database: %s\n", sqlite3_errmsg(lft_db.db));
+        lft_db_close();
+    }
+    pthread_mutex_unlock(&lft_db.lock);
+    return prog;
+}
+
+// Render one static element
+static void lft_render_static(struct render_context *ctx, const struct lft_elem *e) {
+    switch (e->op) {
+    case OP_SPACING:            // ESC 3 n
+        prn_set(ctx, ESC, '3', e->u.spacing);
+        break;
+
+    case OP_CLEAR: {            // ~A: window on the area, CAN, full-label window back
+        prn_window(ctx, e->u.clear.x, e->u.clear.y, e->u.clear.dx, e->u.clear.dy, false);
+        uint8_t can = 0x18;
+        prn_write_fixed(ctx, &can, 1);
+        uint16_t full_x = (uint16_t)(ctx->lbl_w_mm  * DOTS_PER_MM + 0.5f);
+        uint16_t full_y = (uint16_t)(ctx->lbl_h_mm * DOTS_PER_MM + 0.5f);
+        prn_window(ctx, 0, 0, full_x, full_y, false);
+        break;
+    }
+
+    case OP_TEXT: {
+        const struct lft_text *t = &e->u.text;
+        if (!CheckPrintStatus(ctx, e->status)) break;
+        send_text(ctx, t->x, t->y, t->font, t->xm, t->ym, t->text, t->len, t->offset,
+                  t->justify, t->lines, t->spacing, t->angle, t->mode);
+        break;
+    }
+
+    case OP_RECT:
+        send_rectangle(ctx, e->u.rect.x, e->u.rect.y, e->u.rect.dx, e->u.rect.dy,
+                       e->u.rect.th, (int)e->u.rect.angle, e->u.rect.mode, e->status);
+        break;
+
+    case OP_CIRCLE:
+        send_circle(ctx, e->u.circle.x, e->u.circle.y, e->u.circle.r, e->u.circle.t,
+                    e->u.circle.mode, e->status);
+        break;
+
+    case OP_BITMAP:
+        if (!CheckPrintStatus(ctx, e->status)) break;
+        send_bitmap_data(ctx, e->u.bitmap.x, e->u.bitmap.y, e->u.bitmap.angle,
+                         e->u.bitmap.xmag, e->u.bitmap.ymag,
+                         e->u.bitmap.w, e->u.bitmap.h, e->u.bitmap.mode,
+                         e->u.bitmap.data, e->u.bitmap.len, e->u.bitmap.key);
+        break;
+
+    case OP_INTENSITY: {        // DC2 '~' n
+        uint8_t cmd[3] = { 0x12, 0x7E, e->u.level };
+        prn_write_fixed(ctx, cmd, sizeof(cmd));
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+// Emit a static segment into the open job: replay a cached render made
+// from the same state, or render it and keep the bytes. With macro set,
+// the replay may be stored as (or run from) the printer's macro.
+static void lft_run_segment(struct render_context *ctx, struct lft_segment *sg,
+                            const struct lft_elem *elems, bool macro) {
+    const struct product *p = ctx->prod;
+    int variant = sg->by_uom ? (p->uom_type << 1) | (p->unit_price == p->actual_unit_price) : 0;
+
+    pthread_mutex_lock(&lft_cache_lock);
+    struct lft_render *r = sg->renders;
+    for (; r; r = r->next) {
+        if (r->variant == variant && r->lbl_w == ctx->lbl_w_mm && r->lbl_h == ctx->lbl_h_mm &&
+            prn_state_same(&r->in, &ctx->prn) &&
+            (!sg->has_bitmap || (r->imgs == ctx->imgs && (!r->imgs || r->img_epoch == r->imgs->epoch))))
+            break;
+    }
+    if (r) lft_seg_hits++;
+    pthread_mutex_unlock(&lft_cache_lock);
+
+    if (r) {                    // renders are immutable until the program is freed
+        long supp = (long)ctx->prn.suppressed + r->suppressed;
+        struct prn_macro *m = ctx->macro;
+        if (m && m->len == r->len && m->hash == r->hash) {
+            job_emit(ctx, (uint8_t[]){ GS, '^', 1, 0, 0 }, 5);
+            atomic_fetch_add(&prn_macro_runs, 1);
+            atomic_fetch_add(&prn_macro_saved, r->len - 5);
+        } else if (m && macro && r->len <= m->cap) {
+            job_emit(ctx, (uint8_t[]){ GS, ':' }, 2);
+            job_emit(ctx, r->bytes, r->len);
+            job_emit(ctx, (uint8_t[]){ GS, ':' }, 2);
+            m->len = r->len;
+            m->hash = r->hash;
+            atomic_fetch_add(&prn_macro_defines, 1);
         } else {
-            fprintf(stderr, "Warning: scale RD_WEIGHT returned no data.\n");
-            kg = 0.0;
+            job_emit(ctx, r->bytes, r->len);
+        }
+        ctx->prn = r->out;
+        ctx->prn.suppressed = supp > 0 ? supp : 0;
+        return;
+    }
+
+    struct prn_tracker in = ctx->prn;
+    unsigned img_epoch = ctx->imgs ? ctx->imgs->epoch : 0;
+    size_t start = ctx->len;
+    int flushes = ctx->stats.flushes;
+    for (int i = 0; i < sg->count; i++)
+        lft_render_static(ctx, &elems[sg->first + i]);
+
+    // Only a render that stayed whole in the buffer can be replayed
+    if (ctx->stats.flushes != flushes || ctx->len < start)
+        return;
+
+    r = calloc(1, sizeof(*r));
+    if (!r) return;
+    r->len = ctx->len - start;
+    r->bytes = malloc(r->len ? r->len : 1);
+    if (!r->bytes) {
+        free(r);
+        return;
+    }
+    memcpy(r->bytes, ctx->buf + start, r->len);
+    r->hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < r->len; i++)
+        r->hash = (r->hash ^ r->bytes[i]) * 0x100000001b3ULL;
+    r->variant = variant;
+    r->lbl_w = ctx->lbl_w_mm;
+    r->lbl_h = ctx->lbl_h_mm;
+    r->in = in;
+    r->out = ctx->prn;
+    r->imgs = ctx->imgs;
+    r->img_epoch = img_epoch;
+    r->suppressed = (long)ctx->prn.suppressed - (long)in.suppressed;
+
+    pthread_mutex_lock(&lft_cache_lock);
+    lft_seg_renders++;
+    if (sg->nrenders < LFT_SEG_RENDERS) {
+        r->next = sg->renders;
+        sg->renders = r;
+        sg->nrenders++;
+        r = NULL;
+    } else if (sg->has_bitmap && ctx->imgs) {
+        // Replace one that names images this port no longer holds; only
+        // this port (busy here) could have matched it
+        for (struct lft_render **rp = &sg->renders; *rp; rp = &(*rp)->next) {
+            struct lft_render *old = *rp;
+            if (old->imgs == ctx->imgs && old->img_epoch != ctx->imgs->epoch) {
+                r->next = old->next;
+                *rp = r;
+                r = old;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lft_cache_lock);
+    if (r) {
+        free(r->bytes);
+        free(r);
+    }
+}
+
+// The segment worth keeping as the printer's macro: the one with the
+// largest cached render that fits (NULL if none is worth a GS ^)
+static const struct lft_segment *lft_macro_segment(const struct render_context *ctx,
+                                                   const struct lft_program *prog) {
+    if (!ctx->macro) return NULL;
+    const struct lft_segment *best = NULL;
+    size_t best_len = 16;
+    pthread_mutex_lock(&lft_cache_lock);
+    for (int i = 0; i < prog->nsegs; i++)
+        for (const struct lft_render *r = prog->segs[i].renders; r; r = r->next)
+            if (r->len > best_len && r->len <= ctx->macro->cap) {
+                best = &prog->segs[i];
+                best_len = r->len;
+            }
+    pthread_mutex_unlock(&lft_cache_lock);
+    return best;
+}
+
+// Make the label's ~d images resident before it starts, while the
+// printer is still in standard mode. Images already there just count
+// as used, so the LRU keeps them. ~c raw codes forget everything, so
+// images after one are sent inline and not uploaded.
+static void lft_load_images(struct render_context *ctx, const struct lft_program *prog) {
+    struct prn_images *im = ctx->imgs;
+    if (!im) return;
+    im->job++;
+    for (int i = 0; i < prog->count; i++) {
+        const struct lft_elem *e = &prog->elems[i];
+        if (e->op == OP_RAW) break;
+        if (e->op != OP_BITMAP || e->u.bitmap.xmag != 1 || e->u.bitmap.ymag != 1 ||
+            !CheckPrintStatus(ctx, e->status))
+            continue;
+        int k = prn_image_find(im, e->u.bitmap.key);
+        if (k >= 0) {
+            im->slot[k].used = im->job;
+            continue;
+        }
+        int bpr, rows, w_dots;
+        uint8_t *raster = bitmap_raster(e->u.bitmap.angle, 1, 1, e->u.bitmap.w, e->u.bitmap.h,
+                                        e->u.bitmap.data, e->u.bitmap.len, &bpr, &rows, &w_dots);
+        if (raster) {
+            prn_image_upload(ctx, e->u.bitmap.key, raster, bpr, rows);
+            free(raster);
         }
     }
+}
 
-    // Override only for weighing items
-    current_gross_weight = kg;     // Data ID 71
-    weight_or_quantity   = kg;     // Data ID 72
+// ─── Product master ───────────────────────────────────────────────
+// Every PLU's record (the same {"data": {...}, "barcodes": [...]} shape
+// as config.json) parsed once into a struct product and indexed by PLU
+// number in an open-addressing hash table. MODE:PRINT_PLU takes a
+// reference to one product in place of reading a JSON file. The
+// catalog is loaded from the plu_master table at startup, or replaced
+// from a bulk JSON file, an import or an update.
+//
+// A live catalog is never modified. Writers, which all run on the
+// catalog lane, build a new one (MODE:PLU_UPDATE copies the live table
+// and swaps in the changed products), then publish it by swapping
+// plu_live under plu_lock. Readers hold that lock only for the lookup.
+// The writer frees the old table; products still in use by a job live
+// on until that job's product_put().
+
+struct plu_slot {
+    long plu;
+    struct product *prod;       // NULL = empty slot
+};
+
+struct plu_catalog {
+    struct plu_slot *slots;
+    size_t mask, count;
+};
+
+static pthread_mutex_t plu_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct plu_catalog *plu_live;
+static unsigned long plu_prints, plu_misses;
+
+int plu_stats(char *out, size_t cap) {
+    pthread_mutex_lock(&plu_lock);
+    int n = snprintf(out, cap, " plus=%zu plu_prints=%lu plu_misses=%lu",
+                     plu_live ? plu_live->count : 0, plu_prints, plu_misses);
+    pthread_mutex_unlock(&plu_lock);
+    return n;
 }
 
-    // ================================================================
+static size_t plu_hash(long plu) {
+    uint64_t h = (uint64_t)plu * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32);
+}
 
-// ─── STEP: Read slot from param and fetch LFT from SQLite DB ──────
-int slot = atoi(lft_path);  // lft_path is actually a slot string
+static void plu_catalog_free(struct plu_catalog *cat) {
+    if (!cat) return;
+    for (size_t i = 0; cat->slots && i <= cat->mask; i++)
+        product_put(cat->slots[i].prod);
+    free(cat->slots);
+    free(cat);
+}
 
-sqlite3 *db;
-sqlite3_stmt *stmt;
-int rc = sqlite3_open(LFT_DB_PATH, &db);
-if (rc != SQLITE_OK) {
-    fprintf(stderr, "Error: cannot open LFT database: %s\n", sqlite3_errmsg(db));
-    return 2;
+// Empty catalog with room for about n records
+static struct plu_catalog *plu_catalog_new(size_t n) {
+    struct plu_catalog *cat = calloc(1, sizeof(*cat));
+    if (!cat) return NULL;
+    size_t cap = 16;
+    while (cap < 2 * n) cap *= 2;       // load factor <= 0.5
+    cat->slots = calloc(cap, sizeof(*cat->slots));
+    if (!cat->slots) {
+        free(cat);
+        return NULL;
+    }
+    cat->mask = cap - 1;
+    return cat;
 }
 
-const char *sql = "SELECT content FROM lft_files WHERE slot = ?";
-sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-sqlite3_bind_int(stmt, 1, slot);
+static struct plu_slot *plu_probe(const struct plu_catalog *cat, long plu) {
+    size_t i = plu_hash(plu) & cat->mask;
+    while (cat->slots[i].prod && cat->slots[i].plu != plu)
+        i = (i + 1) & cat->mask;
+    return &cat->slots[i];
+}
 
-rc = sqlite3_step(stmt);
-if (rc != SQLITE_ROW) {
-    fprintf(stderr, "Error: no LFT file found for slot %d\n", slot);
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    return 2;
+// Add a product (the catalog takes the reference); a repeated PLU
+// replaces the earlier one. False if the table is full.
+static bool plu_insert(struct plu_catalog *cat, long plu, struct product *prod) {
+    if (cat->count + 1 > (cat->mask + 1) / 2) {
+        size_t cap = 2 * (cat->mask + 1);
+        struct plu_slot *old = cat->slots, *ns = calloc(cap, sizeof(*ns));
+        if (!ns) {
+            product_put(prod);
+            return false;
+        }
+        size_t omask = cat->mask;
+        cat->slots = ns;
+        cat->mask = cap - 1;
+        for (size_t i = 0; i <= omask; i++)
+            if (old[i].prod) *plu_probe(cat, old[i].plu) = old[i];
+        free(old);
+    }
+    struct plu_slot *sl = plu_probe(cat, plu);
+    if (!sl->prod) cat->count++;
+    else product_put(sl->prod);
+    sl->plu = plu;
+    sl->prod = prod;
+    return true;
 }
 
-const void *blob = sqlite3_column_blob(stmt, 0);
-int blob_size = sqlite3_column_bytes(stmt, 0);
+// Parse a record and add it (ownership of rec passes to the catalog)
+static bool plu_add(struct plu_catalog *cat, long plu, struct json_object *rec) {
+    struct product *prod = product_new(rec);
+    return prod && plu_insert(cat, plu, prod);
+}
 
-// Write blob to temp file
-const char *temp_lft_path = "/tmp/server_selected.lft";
-FILE *f = fopen(temp_lft_path, "wb");
-if (!f) {
-    perror("Error opening temp LFT file");
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    return 2;
+// New catalog sharing every product of src, with room for extra more
+static struct plu_catalog *plu_catalog_copy(const struct plu_catalog *src, size_t extra) {
+    struct plu_catalog *cat = plu_catalog_new((src ? src->count : 0) + extra);
+    for (size_t i = 0; cat && src && i <= src->mask; i++) {
+        const struct plu_slot *sl = &src->slots[i];
+        if (sl->prod && !plu_insert(cat, sl->plu, product_get(sl->prod))) {
+            plu_catalog_free(cat);
+            cat = NULL;
+        }
+    }
+    return cat;
 }
-fwrite(blob, 1, blob_size, f);
-fclose(f);
 
-sqlite3_finalize(stmt);
-sqlite3_close(db);
+// PLU number of a record: data.plu_id (string or number)
+static bool plu_of(struct json_object *rec, long *plu) {
+    struct json_object *d = NULL, *v = NULL;
+    if (!json_object_object_get_ex(rec, "data", &d) ||
+        !json_object_object_get_ex(d, "plu_id", &v))
+        return false;
+    const char *s = json_object_get_string(v);
+    char *end;
+    errno = 0;
+    *plu = s ? strtol(s, &end, 10) : 0;
+    return s && end != s && errno == 0;
+}
 
-// Reopen file for reading label commands
-f = fopen(temp_lft_path, "r");
-if (!f) {
-    perror("Error reopening temp LFT file");
-    return 2;
+// Make cat the live catalog and free the one it replaces
+static void plu_catalog_install(struct plu_catalog *cat) {
+    pthread_mutex_lock(&plu_lock);
+    struct plu_catalog *old = plu_live;
+    plu_live = cat;
+    pthread_mutex_unlock(&plu_lock);
+    plu_catalog_free(old);
 }
 
-    
-    const char *portname = "/dev/ttyUSB0";
-    int fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
-    if (fd < 0) {
-        perror("opening serial port");
-        fclose(f);
-        return 3;
+// Reference to the live product of a PLU, or NULL
+static struct product *plu_lookup(long plu) {
+    pthread_mutex_lock(&plu_lock);
+    struct product *prod = plu_live ? plu_probe(plu_live, plu)->prod : NULL;
+    if (prod) {
+        product_get(prod);
+        plu_prints++;
+    } else {
+        plu_misses++;
     }
+    pthread_mutex_unlock(&plu_lock);
+    return prod;
+}
 
-    struct termios tty;
-    if (tcgetattr(fd, &tty) != 0) {
-        perror("tcgetattr");
-        close(fd);
-        fclose(f);
-        return 4;
+// Load plu_master(plu, record) into a new live catalog; returns the
+// number of PLUs, or -1. A missing table is an empty catalog.
+long plu_load_db(void) {
+    pthread_mutex_lock(&lft_db.lock);
+    if (!lft_db_ready()) {
+        pthread_mutex_unlock(&lft_db.lock);
+        return -1;
+    }
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(lft_db.db, "SELECT plu, record FROM plu_master",
+                           -1, &st, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Product master: %s\n", sqlite3_errmsg(lft_db.db));
+        pthread_mutex_unlock(&lft_db.lock);
+        plu_catalog_install(plu_catalog_new(0));
+        return 0;
     }
-    cfsetospeed(&tty, B115200);
-    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;
-    tty.c_cflag &= ~PARENB;
-    tty.c_cflag &= ~CSTOPB;
-    tty.c_cflag &= ~CRTSCTS;
-    tty.c_cflag |= CLOCAL | CREAD;
-    tcsetattr(fd, TCSANOW, &tty);
-
-uint8_t init_seq[] = { ESC, '@' };
-    write_all(fd, init_seq, sizeof(init_seq));
-
-    char line[512];
-    while (fgets(line, sizeof(line), f)) {
-        if (line[0]=='#' || line[0]=='@' || line[0]=='\n')
-            continue;
 
+    struct plu_catalog *cat = plu_catalog_new(0);
+    long bad = 0;
+    int rc;
+    while (cat && (rc = sqlite3_step(st)) == SQLITE_ROW) {
+        const char *txt = (const char *)sqlite3_column_text(st, 1);
+        struct json_object *rec = txt ? json_tokener_parse(txt) : NULL;
+        if (!rec) { bad++; continue; }
+        if (!plu_add(cat, (long)sqlite3_column_int64(st, 0), rec)) {
+            plu_catalog_free(cat);
+            cat = NULL;
+        }
+    }
+    sqlite3_finalize(st);
+    pthread_mutex_unlock(&lft_db.lock);
 
- // -------- ~S: define label size & page window in mm --------------------------------------------------
+    if (!cat) {
+        fprintf(stderr, "Product master: out of memory\n");
+        return -1;
+    }
+    if (bad) fprintf(stderr, "Product master: %ld unparsable record(s) skipped\n", bad);
+    long n = cat->count;
+    plu_catalog_install(cat);
+    return n;
+}
 
-        if (strncmp(line,"~S",2)==0) {
-            float w,h,g; int no;
-            if (sscanf(line+3,"%f,%f,%f,%d",&w,&h,&g,&no)>=2) {
-                lbl_width_mm  = w;
-                lbl_height_mm = h;
-                uint16_t x_d = (uint16_t)(w*DOTS_PER_MM + 0.5f);
-                uint16_t y_d = (uint16_t)(h*DOTS_PER_MM + 0.5f);
+// Load a JSON array of product records into a new live catalog;
+// returns the number of PLUs, or -1
+long plu_load_json(const char *path) {
+    struct json_object *root = read_json_file(path);
+    if (!root) return -1;
+    if (!json_object_is_type(root, json_type_array)) {
+        fprintf(stderr, "Product master: %s is not a JSON array\n", path);
+        json_object_put(root);
+        return -1;
+    }
 
-                // FS L: label size
-                write_all(fd, (uint8_t[]){ FS,'L',
-                    lo(x_d),hi(x_d), lo(y_d),hi(y_d)
-                }, 6);
-                // ESC L: enter page mode
-                write_all(fd, (uint8_t[]){ ESC,'S' }, 2);
-                // ESC W: set window = entire label
-                write_all(fd, (uint8_t[]){ ESC,'W',
-                    0,0, 0,0,
-                    lo(x_d),hi(x_d), lo(y_d),hi(y_d)
-                },10);
-                // no hardware offset: y=0.0 → top
-                lbl_x_offset = 0.0f;
-                lbl_y_offset = 0.0f;
-            }
+    size_t n = json_object_array_length(root);
+    struct plu_catalog *cat = plu_catalog_new(n);
+    long bad = 0;
+    for (size_t i = 0; cat && i < n; i++) {
+        struct json_object *rec = json_object_array_get_idx(root, i);
+        long plu;
+        if (!plu_of(rec, &plu)) { bad++; continue; }
+        if (!plu_add(cat, plu, json_object_get(rec))) {
+            plu_catalog_free(cat);
+            cat = NULL;
         }
- // ------- ~s: line spacing (mm) ----------------------------------------------------------------------------
- 
-	else if (strncmp(line, "~s", 2) == 0) {
-	    float sp_mm;
-	    // parse spacing in mm
-	    if (sscanf(line + 3, "%f", &sp_mm) == 1) {
-		// convert mm to dots
-		int n = (int)(sp_mm * DOTS_PER_MM + 0.5f);
-		// ESC 3 n
-		uint8_t cmd[3] = { 0x1B, '3', (uint8_t)n };
-		write_all(fd, cmd, sizeof(cmd));
-	    }
-	}
-
- // ------ ~A: clear area ------------------------------------------------------------------------------------
- 
-        else if (strncmp(line, "~A", 2) == 0) {
-    float x,y,dx,dy; char mode;
-    if (sscanf(line+3, "%f,%f,%f,%f,%c", &x,&y,&dx,&dy,&mode) >= 5) {
-        // 1) Compute in dots
-        int x0 = (int)((x + lbl_x_offset) * DOTS_PER_MM + 0.5f);
-        int y0 = (int)((y + lbl_y_offset) * DOTS_PER_MM + 0.5f);
-        int dx0 = (int)(dx * DOTS_PER_MM + 0.5f);
-        int dy0 = (int)(dy * DOTS_PER_MM + 0.5f);
-
-        // 2) ESC W: set page‐mode window to just that rectangle
-        uint8_t win_cmd[10] = {
-            ESC, 'W',
-            lo(x0), hi(x0),
-            lo(y0), hi(y0),
-            lo(dx0), hi(dx0),
-            lo(dy0), hi(dy0)
-        };
-        write_all(fd, win_cmd, sizeof(win_cmd));
-
-        // 3) CAN: clear *all* data in that window
-        uint8_t can = 0x18;
-        write_all(fd, &can, 1);
+    }
+    json_object_put(root);      // records live on in their products
 
-        // 4) Restore the window to full‐label (your existing ESC W)
-        uint16_t full_x = (uint16_t)(lbl_width_mm  * DOTS_PER_MM + 0.5f);
-        uint16_t full_y = (uint16_t)(lbl_height_mm * DOTS_PER_MM + 0.5f);
-        uint8_t fullwin[10] = {
-            ESC, 'W',
-            0,0, 0,0,
-            lo(full_x), hi(full_x),
-            lo(full_y), hi(full_y)
-        };
-        write_all(fd, fullwin, sizeof(fullwin));
+    if (!cat) {
+        fprintf(stderr, "Product master: out of memory\n");
+        return -1;
     }
+    if (bad) fprintf(stderr, "Product master: %ld record(s) without data.plu_id skipped\n", bad);
+    long count = cat->count;
+    plu_catalog_install(cat);
+    return count;
 }
-        
-// ------- ~T Fixed Text ----------------------------------------------------------------------------
 
-else if (strncmp(line, "~T", 2) == 0) {
-    float x, y, xm, ym, spacing;
-    int angle, font, len, offset, lines;
-    char justify, mode_str[4] = "", prnstatus = '1';
-    char raw[512], decoded[512];
+// ─── Product import ───────────────────────────────────────────────
+// MODE:PLU_IMPORT streams a catalog file (a JSON array of records, or a
+// CSV whose header names the data fields) into plu_master_new, in
+// transactions of PLU_IMPORT_BATCH rows, while building the matching
+// in-memory catalog. Only when every row is in does one transaction
+// rename the new table over plu_master; the new catalog goes live right
+// after. A failed import leaves both the table and the catalog as they
+// were. Imports run on the catalog lane, one at a time.
+
+#define PLU_IMPORT_BATCH 1000
+
+struct plu_import {
+    sqlite3 *db;
+    sqlite3_stmt *ins;
+    struct plu_catalog *cat;
+    long rows, skipped, in_batch;
+    bool one_txn;               // no intermediate commits (MODE:PLU_UPDATE)
+};
+
+static bool plu_exec(sqlite3 *db, const char *sql) {
+    char *err = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) == SQLITE_OK) return true;
+    fprintf(stderr, "Product import: %s: %s\n", sql, err ? err : "?");
+    sqlite3_free(err);
+    return false;
+}
 
-    char *p = line + 3;
+// Store one record (ownership passes to the catalog)
+static bool plu_import_row(struct plu_import *im, struct json_object *rec) {
+    long plu;
+    if (!rec || !plu_of(rec, &plu)) {
+        im->skipped++;
+        if (rec) json_object_put(rec);
+        return true;
+    }
 
-    // Trim trailing whitespace/newlines
-    for (int i = strlen(p) - 1; i >= 0 && isspace((unsigned char)p[i]); --i)
-        p[i] = '\0';
+    const char *txt = json_object_to_json_string_ext(rec, JSON_C_TO_STRING_PLAIN);
+    sqlite3_bind_int64(im->ins, 1, plu);
+    sqlite3_bind_text(im->ins, 2, txt, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(im->ins);
+    sqlite3_reset(im->ins);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Product import: PLU %ld: %s\n", plu, sqlite3_errmsg(im->db));
+        json_object_put(rec);
+        return false;
+    }
+    if (!plu_add(im->cat, plu, rec)) return false;
+    im->rows++;
 
-    // Extract print status (last char)
-    char *c = strrchr(p, ',');
-    if (c && strlen(c + 1) == 1 && isdigit((unsigned char)*(c + 1))) {
-        prnstatus = *(c + 1);
-        *c = '\0';
+    if (!im->one_txn && ++im->in_batch == PLU_IMPORT_BATCH) {
+        im->in_batch = 0;
+        return plu_exec(im->db, "COMMIT") && plu_exec(im->db, "BEGIN");
     }
+    return true;
+}
 
-    // Manually extract last 6 fields (mode, spacing, lines, justify, offset, len)
-    char *fields[13];
-    int field_count = 0;
+// Growable text buffer for one record or CSV field set
+struct plu_text {
+    char  *s;
+    size_t len, cap;
+};
+
+static bool plu_text_put(struct plu_text *t, char c) {
+    if (t->len + 1 >= t->cap) {
+        size_t ncap = t->cap ? 2 * t->cap : 4096;
+        char *ns = realloc(t->s, ncap);
+        if (!ns) return false;
+        t->s = ns;
+        t->cap = ncap;
+    }
+    t->s[t->len++] = c;
+    t->s[t->len] = '\0';
+    return true;
+}
 
-    for (char *token = p; token && field_count < 13; ) {
-        // Handle escaped comma
-        char *comma = token;
-        int escaped = 0;
+// JSON array, one element at a time: only the record being read is
+// held as text, so the file size does not matter
+static bool plu_import_json(FILE *f, struct plu_import *im) {
+    struct plu_text t = { 0 };
+    int c, depth = 0;
+    bool in_str = false, esc = false, ok = false;
+
+    while ((c = getc_unlocked(f)) != EOF && isspace(c)) ;
+    if (c != '[') {
+        fprintf(stderr, "Product import: expected a JSON array\n");
+        return false;
+    }
+    while ((c = getc_unlocked(f)) != EOF) {
+        if (depth == 0) {               // between records
+            if (isspace(c) || c == ',') continue;
+            if (c == ']') { ok = true; break; }
+            if (c != '{') {
+                fprintf(stderr, "Product import: array element is not an object\n");
+                break;
+            }
+        }
+        if (!plu_text_put(&t, c)) break;
+        if (in_str) {
+            if (esc) esc = false;
+            else if (c == '\\') esc = true;
+            else if (c == '"') in_str = false;
+            continue;
+        }
+        if (c == '"') in_str = true;
+        else if (c == '{' || c == '[') depth++;
+        else if ((c == '}' || c == ']') && --depth == 0) {
+            if (!plu_import_row(im, json_tokener_parse(t.s))) break;
+            t.len = 0;
+        }
+    }
+    if (!ok && c == EOF) fprintf(stderr, "Product import: unexpected end of file\n");
+    free(t.s);
+    return ok;
+}
 
-        while (*comma) {
-            if (*comma == '\\' && comma[1] == ',') {
-                comma += 2; // skip escaped comma
-                escaped = 1;
+#define PLU_CSV_MAX_COLS 128
+
+// One CSV record (RFC 4180 quoting). Fields are NUL-separated in t;
+// returns the field count, 0 at end of file, -1 on error.
+static int plu_csv_record(FILE *f, struct plu_text *t, char **fields) {
+    size_t off[PLU_CSV_MAX_COLS];
+    int c, n = 0;
+    bool quoted = false, any = false;
+    t->len = 0;
+    size_t start = 0;
+
+    while ((c = getc_unlocked(f)) != EOF) {
+        any = true;
+        if (quoted) {
+            if (c == '"') {
+                int d = getc_unlocked(f);
+                if (d == '"') { if (!plu_text_put(t, '"')) return -1; continue; }
+                quoted = false;
+                c = d;
+                if (c == EOF) break;
+            } else {
+                if (!plu_text_put(t, c)) return -1;
                 continue;
             }
-            if (*comma == ',') break;
-            comma++;
         }
-
-        if (*comma == ',') {
-            *comma = '\0';
-            fields[field_count++] = token;
-            token = comma + 1;
-        } else {
-            fields[field_count++] = token;
-            break;
+        if (c == '"') { quoted = true; continue; }
+        if (c == '\r') continue;
+        if (c == ',' || c == '\n') {
+            if (!plu_text_put(t, '\0')) return -1;
+            if (n < PLU_CSV_MAX_COLS) off[n++] = start;
+            start = t->len;
+            if (c == '\n') break;
+            continue;
         }
+        if (!plu_text_put(t, c)) return -1;
     }
+    if (!any) return 0;
+    if (c == EOF) {                     // last line without a newline
+        if (!plu_text_put(t, '\0')) return -1;
+        if (n < PLU_CSV_MAX_COLS) off[n++] = start;
+    }
+    for (int i = 0; i < n; i++) fields[i] = t->s + off[i];
+    return n;
+}
 
-    if (field_count < 13) continue;
-
-    // Now decode the text field
-    char *s = fields[6], *d = decoded;
-    while (*s) {
-        if (s[0] == '\\') {
-            if (s[1] == 'n') { *d++ = '\n'; s += 2; }
-            else if (s[1] == ',') { *d++ = ','; s += 2; }
-            else if (s[1] == '\\') { *d++ = '\\'; s += 2; }
-            else { *d++ = *s++; }
-        } else {
-            *d++ = *s++;
+// CSV with a header row of data keys (plu_id, plu_name, ...); a
+// "barcodes" column may hold the record's barcodes array as JSON
+static bool plu_import_csv(FILE *f, struct plu_import *im) {
+    struct plu_text hdr = { 0 }, row = { 0 };
+    char *cols[PLU_CSV_MAX_COLS], *vals[PLU_CSV_MAX_COLS];
+    bool ok = false;
+
+    int ncols = plu_csv_record(f, &hdr, cols);
+    if (ncols <= 0) {
+        fprintf(stderr, "Product import: missing CSV header\n");
+        goto out;
+    }
+    for (;;) {
+        int n = plu_csv_record(f, &row, vals);
+        if (n == 0) { ok = true; break; }
+        if (n < 0) break;
+        if (n == 1 && vals[0][0] == '\0') continue;     // blank line
+
+        struct json_object *rec = json_object_new_object();
+        struct json_object *data = json_object_new_object();
+        if (!rec || !data) {
+            if (rec) json_object_put(rec);
+            if (data) json_object_put(data);
+            break;
+        }
+        json_object_object_add(rec, "data", data);
+        for (int i = 0; i < n && i < ncols; i++) {
+            if (strcmp(cols[i], "barcodes") == 0) {
+                struct json_object *bc = vals[i][0] ? json_tokener_parse(vals[i]) : NULL;
+                if (bc) json_object_object_add(rec, "barcodes", bc);
+            } else {
+                json_object_object_add(data, cols[i], json_object_new_string(vals[i]));
+            }
         }
+        if (!plu_import_row(im, rec)) break;
     }
-    *d = '\0';
-
-    // Assign other parsed fields
-    x = atof(fields[0]);
-    y = atof(fields[1]);
-    angle = atoi(fields[2]);
-    font = atoi(fields[3]);
-    xm = atof(fields[4]);
-    ym = atof(fields[5]);
-    len = atoi(fields[7]);
-    offset = atoi(fields[8]);
-    justify = fields[9][0];
-    lines = atoi(fields[10]);
-    spacing = atof(fields[11]);
-    strncpy(mode_str, fields[12], 3); mode_str[3] = '\0';
-
-    if (!CheckPrintStatus(prnstatus)) continue;
-
-    send_text(fd, x, y, font, xm, ym, decoded, len, offset, justify, lines, spacing, angle, mode_str);
+out:
+    free(hdr.s);
+    free(row.s);
+    return ok;
 }
 
+// Import a catalog file; the reply line says how it went
+void plu_import(const char *path, char *reply, size_t cap) {
+    struct plu_import im = { 0 };
+    struct timespec t0, t1;
+    bool ok = false, staged = false;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
 
-
-// ----------- ~V Variable Text ----------------------------------------------------------------------------------
-
-else if (strncmp(line, "~V", 2) == 0) {
-    float x, y, xm, ym, spacing;
-    int angle, font, len, offset, lines;
-    char justify, mode_str[4] = "", prnstatus = '1';
-    char id[32] = "", raw[512] = "", decoded[512] = "", actual[512] = "";
-    char *p = line + 3;
-
-    // Strip print status (last char if digit)
-    char *last_comma = strrchr(p, ',');
-    if (last_comma && strlen(last_comma + 1) == 1 && isdigit((unsigned char)*(last_comma + 1))) {
-        prnstatus = *(last_comma + 1);
-        *last_comma = '\0';
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Product import: fopen");
+        snprintf(reply, cap, "Error: cannot open %s\n", path);
+        return;
     }
+    size_t plen = strlen(path);
+    bool csv = plen > 4 && strcasecmp(path + plen - 4, ".csv") == 0;
 
-    // Split fields
-    char *fields[14];
-    int i = 0;
-    char *token = strtok(p, ",");
-    while (token && i < 14) {
-        fields[i++] = token;
-        token = strtok(NULL, ",");
-    }
-    if (i < 13) continue;
-
-    // Parse fields
-    x = atof(fields[0]);
-    y = atof(fields[1]);
-    angle = atoi(fields[2]);
-    font = atoi(fields[3]);
-    xm = atof(fields[4]);
-    ym = atof(fields[5]);
-    strncpy(id, fields[6], sizeof(id)-1);
-    id[sizeof(id)-1] = '\0';
-    strncpy(raw, fields[7], sizeof(raw)-1);
-    raw[sizeof(raw)-1] = '\0';
-    len = atoi(fields[8]);
-    offset = atoi(fields[9]);
-    justify = fields[10][0];
-    lines = atoi(fields[11]);
-    spacing = atof(fields[12]);
-    strncpy(mode_str, fields[13], 3); mode_str[3] = '\0';
-
-    if (!CheckPrintStatus(prnstatus)) continue;
-
-    // Escape decoding (e.g. \n, \, etc.)
-    char *s = raw, *d = decoded;
-    while (*s) {
-        if (*s == '\\') {
-            if (s[1] == 'n') { *d++ = '\n'; s += 2; }
-            else if (s[1] == ',') { *d++ = ','; s += 2; }
-            else if (s[1] == '\\') { *d++ = '\\'; s += 2; }
-            else { *d++ = *s++; }
-        } else {
-            *d++ = *s++;
+    if (sqlite3_open_v2(LFT_DB_PATH, &im.db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Product import: %s\n", sqlite3_errmsg(im.db));
+        goto out;
+    }
+    sqlite3_busy_timeout(im.db, 5000);
+    if (!plu_exec(im.db, "PRAGMA synchronous=NORMAL") ||
+        !plu_exec(im.db, "DROP TABLE IF EXISTS plu_master_new") ||
+        !plu_exec(im.db, "CREATE TABLE plu_master_new (plu INTEGER PRIMARY KEY, record TEXT NOT NULL)"))
+        goto out;
+    staged = true;
+    if (sqlite3_prepare_v2(im.db, "INSERT OR REPLACE INTO plu_master_new VALUES (?, ?)",
+                           -1, &im.ins, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Product import: %s\n", sqlite3_errmsg(im.db));
+        goto out;
+    }
+    if (!(im.cat = plu_catalog_new(0)) || !plu_exec(im.db, "BEGIN"))
+        goto out;
+
+    ok = csv ? plu_import_csv(f, &im) : plu_import_json(f, &im);
+    if (ok) ok = plu_exec(im.db, "COMMIT");
+    else sqlite3_exec(im.db, "ROLLBACK", NULL, NULL, NULL);
+
+    // Swap the tables in one transaction, then the live catalog
+    if (ok) {
+        ok = plu_exec(im.db, "BEGIN IMMEDIATE");
+        if (ok && !(plu_exec(im.db, "DROP TABLE IF EXISTS plu_master") &&
+                    plu_exec(im.db, "ALTER TABLE plu_master_new RENAME TO plu_master") &&
+                    plu_exec(im.db, "COMMIT"))) {
+            sqlite3_exec(im.db, "ROLLBACK", NULL, NULL, NULL);
+            ok = false;
         }
     }
-    *d = '\0';
+    if (ok) {
+        staged = false;
+        plu_catalog_install(im.cat);
+        im.cat = NULL;
+    }
 
-    // ✅ Actual value fetch
-    actual[0] = '\0';
-    if (isdigit((unsigned char)id[0]) && GetVariableText(atoi(id), actual) == 0) {
-        // success
-    } else if (json_root) {
-        struct json_object *datao, *valo;
-        if (json_object_object_get_ex(json_root, "data", &datao) &&
-            json_object_object_get_ex(datao, id, &valo)) {
-            snprintf(actual, sizeof(actual), "%s", json_object_get_string(valo));
-        } else {
-            strcpy(actual, decoded); // fallback
-        }
+out:
+    if (staged) sqlite3_exec(im.db, "DROP TABLE IF EXISTS plu_master_new", NULL, NULL, NULL);
+    sqlite3_finalize(im.ins);
+    sqlite3_close(im.db);
+    plu_catalog_free(im.cat);
+    fclose(f);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    if (ok) {
+        snprintf(reply, cap, "OK:PLU_IMPORTED rows=%ld skipped=%ld ms=%.0f rows_per_s=%.0f\n",
+                 im.rows, im.skipped, ms, ms > 0 ? im.rows * 1000.0 / ms : 0.0);
+        printf("Product import: %s", reply + 3);
     } else {
-        strcpy(actual, decoded); // fallback
+        snprintf(reply, cap, "Error: import failed after %ld rows, catalog unchanged\n", im.rows);
     }
-
-    // Finally send
-    send_text(fd, x, y, font, xm, ym, actual, len, offset, justify, lines, spacing, angle, mode_str);
 }
 
+// Add or replace the records of a JSON file (one record or an array)
+// in plu_master and the live catalog. The catalog is copied, changed and
+// swapped in whole, so prints never see a half-applied update.
+void plu_update(const char *path, char *reply, size_t cap) {
+    struct plu_import im = { .one_txn = true };
+    struct json_object *root = read_json_file(path);
+    bool ok = false;
+    if (!root) {
+        snprintf(reply, cap, "Error: cannot read %s\n", path);
+        return;
+    }
+    bool many = json_object_is_type(root, json_type_array);
+    size_t n = many ? json_object_array_length(root) : 1;
 
+    if (sqlite3_open_v2(LFT_DB_PATH, &im.db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Product update: %s\n", sqlite3_errmsg(im.db));
+        goto out;
+    }
+    sqlite3_busy_timeout(im.db, 5000);
+    if (!plu_exec(im.db, "CREATE TABLE IF NOT EXISTS plu_master (plu INTEGER PRIMARY KEY, record TEXT NOT NULL)"))
+        goto out;
+    if (sqlite3_prepare_v2(im.db, "INSERT OR REPLACE INTO plu_master VALUES (?, ?)",
+                           -1, &im.ins, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Product update: %s\n", sqlite3_errmsg(im.db));
+        goto out;
+    }
+    // Only the catalog lane replaces plu_live, so it is stable here
+    if (!(im.cat = plu_catalog_copy(plu_live, n)) || !plu_exec(im.db, "BEGIN IMMEDIATE"))
+        goto out;
+
+    ok = true;
+    for (size_t i = 0; ok && i < n; i++) {
+        struct json_object *rec = many ? json_object_array_get_idx(root, i) : root;
+        ok = plu_import_row(&im, rec ? json_object_get(rec) : NULL);
+    }
+    if (ok) ok = plu_exec(im.db, "COMMIT");
+    else sqlite3_exec(im.db, "ROLLBACK", NULL, NULL, NULL);
+    if (ok) {
+        plu_catalog_install(im.cat);
+        im.cat = NULL;
+    }
 
-// ------ Barcode ~B handler (JSON-driven) ------------------------------------------------------------------
-
-else if (strncmp(line, "~B", 2) == 0) {
-    float x, y, module_width_mm, bar_height_mm;
-    int angle, font, offset, data_length;
-    char justify = 'N', hri = 'N', mode = 'W';
+out:
+    sqlite3_finalize(im.ins);
+    sqlite3_close(im.db);
+    plu_catalog_free(im.cat);
+    json_object_put(root);
+    if (ok)
+        snprintf(reply, cap, "OK:PLU_UPDATED rows=%ld skipped=%ld\n", im.rows, im.skipped);
+    else
+        snprintf(reply, cap, "Error: update failed, catalog unchanged\n");
+}
 
-    // Parse full barcode line — we ignore .LFT barcode data + type
-    if (sscanf(line + 3,
-        "%f,%f,%d,%d,%f,%f,%*[^,],%d,%d,%c,%*[^,],%c,%c,%*[^,\r\n]",
-        &x, &y,
-        &angle, &font,
-        &module_width_mm, &bar_height_mm,
-        &data_length, &offset,
-        &justify, &hri, &mode
-    ) != 11) {
-        fprintf(stderr, "Invalid ~B line format: %s\n", line);
-        continue;
+// ~V text for the job's product: its data ID, else the record's data
+// key, else the LFT's own text
+static void lft_var_text(const struct render_context *ctx, const struct lft_text *t,
+                         char *actual, size_t cap) {
+    actual[0] = '\0';
+    if (t->data_id && GetVariableText(ctx, t->data_id, actual) == 0)
+        return;
+    struct json_object *datao, *valo;
+    if (json_object_object_get_ex(ctx->prod->rec, "data", &datao) &&
+        json_object_object_get_ex(datao, t->id, &valo)) {
+        snprintf(actual, cap, "%s", json_object_get_string(valo));
+    } else {
+        snprintf(actual, cap, "%s", t->text); // fallback
     }
+}
 
+// ~B data for the job's barcode entry, truncated to the element's length;
+// the entry, or NULL if there is nothing to print
+static const struct bc_record *lft_barcode_data(const struct render_context *ctx,
+                                                const struct lft_elem *e,
+                                                char *pattern, size_t cap) {
     // Get barcode from JSON using selected barcode number
-    int data_id = gui_data_id;
-    if (data_id < 1 || data_id > num_json_barcodes) {
+    int data_id = ctx->barcode_no, data_length = e->u.barcode.len;
+    if (data_id < 1 || data_id > ctx->prod->nbarcodes) {
         fprintf(stderr, "Invalid barcode number: %d\n", data_id);
-        continue;
+        return NULL;
     }
 
-    char bdata[128] = {0}, btype[16] = {0}, bname[16] = {0};
-    char fld1[16] = {0}, cond1[8] = {0}, shift1[4] = {0};
-    char fld2[16] = {0}, cond2[8] = {0}, shift2[4] = {0};
-
-    LoadJSONBarcodeRecord(data_id,
-        bdata, btype, bname,
-        fld1, cond1, shift1,
-        fld2, cond2, shift2
-    );
+    const struct bc_record *bc = bc_record_get(ctx->prod, data_id);
 
-    // Build actual barcode data
-    strncpy(barcode_data, bdata, sizeof(barcode_data)-1);
-    barcode_data[sizeof(barcode_data)-1] = '\0';
-
-    char pattern[256] = {0};
-    if (GetBarcodeData(pattern, btype) != 0) {
+    // Build actual barcode data from the entry's compiled format
+    if (GetBarcodeData(ctx, pattern, cap, bc->fmt) != 0) {
         fprintf(stderr, "Error building barcode %d\n", data_id);
-        continue;
+        return NULL;
     }
 
     // Truncate to requested length
@@ -2418,222 +5468,506 @@ else if (strncmp(line, "~B", 2) == 0) {
     }
 
     printf("Barcode[%d] pattern: %s (type=%s, HRI=%c, len=%d)\n",
-           data_id, pattern, btype, hri, data_length);
+           data_id, pattern, bc->type, e->u.barcode.hri, data_length);
+    return bc;
+}
 
-    // Send barcode to printer
-    send_barcode(fd, x, y, module_width_mm, bar_height_mm,
-                 pattern, btype, hri, bname,
-                 angle, justify,
-                 fld1, cond1, shift1,
-                 fld2, cond2, shift2);
+// Whether a barcode entry's field label prints for this product
+static bool bc_field_shown(const struct product *prod, const struct bc_field *fd) {
+    bool show = fd->cond == BC_ALWAYS ||
+                (fd->cond == BC_IF_WEIGHT && prod->weight_or_quantity > 0) ||
+                (fd->cond == BC_IF_QTY && prod->quantity > 0);
+    return show && fd->text[0];
+}
 
-    // ─── Optional field labels below barcode ─────────────────
-    int modw = (int)(module_width_mm * DOTS_PER_MM + 0.5f);
+// ─── Software raster: elements ────────────────────────────────────
 
-    int should_print(const char *cond, float weight_or_quantity, int quantity) {
-        if (strcmp(cond, "No") == 0 || strcmp(cond, "Any") == 0) return 1;
-        if (strcmp(cond, "Weight") == 0 && weight_or_quantity > 0.0f) return 1;
-        if (strcmp(cond, "Quantity") == 0 && quantity > 0) return 1;
-        return 0;
-    }
+// Size the framebuffer to the current label (at most MAX_DOTS wide)
+static void raster_label(struct render_context *ctx) {
+    int w = (int)(ctx->lbl_w_mm * DOTS_PER_MM + 0.5f);
+    int h = (int)(ctx->lbl_h_mm * DOTS_PER_MM + 0.5f);
+    if (!raster_size(ctx->fb, w < MAX_DOTS ? w : MAX_DOTS, h) && w > 0 && h > 0)
+        fprintf(stderr, "Error: no memory for a %dx%d raster, label left blank\n", w, h);
+}
 
-    int compute_shift(const char *sh, float x, float module_width_mm, const char *pattern) {
-        int n = sh[1] - '0';
-        int modw = (int)(module_width_mm * DOTS_PER_MM + 0.5f);
-        if (sh[0] == 'L')
-            return (int)(x * DOTS_PER_MM) - n * modw;
-        else
-            return (int)((x + module_width_mm * strlen(pattern) / (float)DOTS_PER_MM) * DOTS_PER_MM) + n * modw;
-    }
+static void raster_text(struct render_context *ctx, const struct lft_text *t, const char *text) {
+    struct text_layout tl;
+    if (!text || t->lines < 1 ||
+        !text_layout(ctx, &tl, t->x, t->y, t->font, t->xm, t->ym, text, t->len, t->offset,
+                     t->justify, t->lines, t->spacing, t->angle))
+        return;
+    bool bold = strchr(t->mode, 'E'), ul = strchr(t->mode, 'U'), inv = strchr(t->mode, 'I');
 
-    if (should_print(cond1, weight_or_quantity, quantity) && fld1[0]) {
-        int sx = compute_shift(shift1, x, module_width_mm, pattern);
-        set_absolute_position(fd, sx / (float)DOTS_PER_MM, y + bar_height_mm + 2.0f);
-        write_all(fd, (const uint8_t*)fld1, strlen(fld1));
+    struct raster s = { 0 };
+    const char *line = tl.text;
+    for (int i = 0; i < t->lines && line; i++) {
+        const char *e = strchr(line, '\n');
+        int n = e ? (int)(e - line) : (int)strlen(line);
+        int wx, wy, ww, wh;
+        text_line_window(&tl, i, n, &wx, &wy, &ww, &wh);
+        if (n && raster_size(&s, tl.char_w * n, tl.char_h)) {
+            raster_glyphs(&s, 0, 0, line, n, tl.esc_m, tl.xmag, tl.ymag, bold, ul, inv);
+            raster_blit(ctx->fb, &s, wx, wy, ww, wh, tl.esc_t, 0, 0, inv);
+        }
+        line = e ? e + 1 : NULL;
     }
+    free(s.bits);
+}
 
-    if (should_print(cond2, weight_or_quantity, quantity) && fld2[0]) {
-        int sx = compute_shift(shift2, x, module_width_mm, pattern);
-        set_absolute_position(fd, sx / (float)DOTS_PER_MM, y + bar_height_mm + 4.0f);
-        write_all(fd, (const uint8_t*)fld2, strlen(fld2));
+// FS R: a frame lwidth dots wide inside the corners, white in mode I
+static void raster_rect(struct render_context *ctx, const struct lft_elem *e) {
+    int b[5];
+    rect_box(ctx, e->u.rect.x, e->u.rect.y, e->u.rect.dx, e->u.rect.dy, e->u.rect.th,
+             (int)e->u.rect.angle, b);
+    int lw = (uint8_t)b[4] ? (uint8_t)b[4] : 1;
+    bool black = e->u.rect.mode != 'I';
+    raster_fill(ctx->fb, b[0], b[1], b[2] + 1, b[1] + lw, black);
+    raster_fill(ctx->fb, b[0], b[3] + 1 - lw, b[2] + 1, b[3] + 1, black);
+    raster_fill(ctx->fb, b[0], b[1], b[0] + lw, b[3] + 1, black);
+    raster_fill(ctx->fb, b[2] + 1 - lw, b[1], b[2] + 1, b[3] + 1, black);
+}
+
+// FS c: a ring of the given thickness inside the radius
+static void raster_circle(struct render_context *ctx, const struct lft_elem *e) {
+    int xc = (int)((e->u.circle.x + ctx->x_off) * DOTS_PER_MM + 0.5f);
+    int yc = (int)((e->u.circle.y + ctx->y_off) * DOTS_PER_MM + 0.5f);
+    int r = (uint8_t)(int)(e->u.circle.r * DOTS_PER_MM + 0.5f);
+    int th = (uint8_t)(int)(e->u.circle.t * DOTS_PER_MM + 0.5f);
+    int ri = r - (th ? th : 1);
+    bool black = e->u.circle.mode != 'I';
+    for (int dy = -r; dy <= r; dy++) {
+        int a = (int)sqrt((double)(r * r - dy * dy));
+        if (ri < 0 || dy * dy > ri * ri) {
+            raster_span(ctx->fb, yc + dy, xc - a, xc + a + 1, black);
+            continue;
+        }
+        int b = (int)sqrt((double)(ri * ri - dy * dy));
+        raster_span(ctx->fb, yc + dy, xc - a, xc - b, black);
+        raster_span(ctx->fb, yc + dy, xc + b + 1, xc + a + 1, black);
     }
 }
 
+// GS v 0 in the ~d's window; print modes do not apply to raster images
+static void raster_bitmap(struct render_context *ctx, const struct lft_elem *e) {
+    int bpr, rows, w_dots;
+    uint8_t *img = bitmap_raster(e->u.bitmap.angle, e->u.bitmap.xmag, e->u.bitmap.ymag,
+                                 e->u.bitmap.w, e->u.bitmap.h, e->u.bitmap.data, e->u.bitmap.len,
+                                 &bpr, &rows, &w_dots);
+    if (!img) return;
+    int wx, wy, ww, wh;
+    bitmap_window(ctx, e->u.bitmap.x, e->u.bitmap.y, e->u.bitmap.angle, w_dots, rows,
+                  &wx, &wy, &ww, &wh);
+    int angle = e->u.bitmap.angle;
+    int dir = angle == 90 ? 1 : angle == 180 ? 2 : angle == 270 ? 3 : 0;
+
+    // The magnification byte as send_bitmap_data sends it: GS v 0 m 1
+    // doubles the width, 2 the height, 3 both; other values print 1:1
+    int m = ((e->u.bitmap.ymag - 1) << 4) | (e->u.bitmap.xmag - 1);
+    int mx = m == 1 || m == 3 ? 2 : 1, my = m == 2 || m == 3 ? 2 : 1;
+    struct raster s = { .w = bpr * 8, .h = rows, .bpr = bpr, .bits = img };
+    struct raster big = { 0 };
+    if ((mx > 1 || my > 1) && raster_size(&big, s.w * mx, s.h * my)) {
+        for (int y = 0; y < s.h; y++)
+            for (int x = 0; x < s.w; x++)
+                if (img[(size_t)y * bpr + (x >> 3)] & (0x80 >> (x & 7)))
+                    raster_fill(&big, x * mx, y * my, (x + 1) * mx, (y + 1) * my, true);
+        raster_blit(ctx->fb, &big, wx, wy, ww, wh, dir, 0, 0, false);
+    } else {
+        raster_blit(ctx->fb, &s, wx, wy, ww, wh, dir, 0, 0, false);
+    }
+    free(big.bits);
+    free(img);
+}
 
-// ------ ~R Rectangle ------------------------------------------------------------------
+// Bars on the baseline send_barcode positions, HRI in Font B (GS f 1)
+// above and/or below, then the entry's field labels in Font A
+static void raster_barcode(struct render_context *ctx, const struct lft_elem *e,
+                           const char *pattern, const struct bc_record *bc) {
+    float x = e->u.barcode.x, y = e->u.barcode.y, mw = e->u.barcode.mw, bh = e->u.barcode.bh;
+    char hri_pos = e->u.barcode.hri;
+    struct bc_place bp;
+    barcode_place(ctx, &bp, x, y, mw, bh, pattern, e->u.barcode.angle, e->u.barcode.justify);
+
+    uint8_t mod[3200];
+    char hri[264];
+    int n = barcode_modules(pattern, mod, sizeof(mod), hri, sizeof(hri));
+    if (!n) {
+        fprintf(stderr, "Barcode data not encodable: %s\n", pattern);
+        return;
+    }
+    int modw = bp.module_w > 0 ? bp.module_w : 1;
+    bool above = hri_pos == 'A' || hri_pos == '2', below = hri_pos == 'B' || hri_pos == '2';
+    int hri_h = 17 + 2, hri_w = 9 * (int)strlen(hri), bars_w = n * modw;
+    int top = above ? hri_h : 0;
+
+    struct raster s = { 0 };
+    if (raster_size(&s, bars_w > hri_w ? bars_w : hri_w, top + bp.bar_h + (below ? hri_h : 0))) {
+        for (int i = 0; i < n; i++)
+            if (mod[i]) raster_fill(&s, i * modw, top, (i + 1) * modw, top + bp.bar_h, true);
+        if (above)
+            raster_glyphs(&s, (bars_w - hri_w) / 2, 0, hri, strlen(hri), 1, 1, 1, false, false, false);
+        if (below)
+            raster_glyphs(&s, (bars_w - hri_w) / 2, top + bp.bar_h + 2, hri, strlen(hri), 1, 1, 1,
+                          false, false, false);
+        int lw = (int)(ctx->lbl_w_mm * DOTS_PER_MM), lh = (int)(ctx->lbl_h_mm * DOTS_PER_MM);
+        raster_blit(ctx->fb, &s, 0, 0, lw, lh, bp.esc_t, bp.xpos, bp.ypos - bp.bar_h - top, false);
+
+        // Field labels, at the spot send_barcode's caller means in dots
+        int fmodw = (int)(mw * DOTS_PER_MM + 0.5f);
+        for (int f = 0; f < 2; f++) {
+            const struct bc_field *fd = &bc->fld[f];
+            if (!bc_field_shown(ctx->prod, fd)) continue;
+            int sx = fd->left
+                ? (int)(x * DOTS_PER_MM) - fd->shift * fmodw
+                : (int)((x + mw * strlen(pattern) / (float)DOTS_PER_MM) * DOTS_PER_MM) + fd->shift * fmodw;
+            int sy = (int)((y + bh + (f ? 4.0f : 2.0f)) * DOTS_PER_MM + 0.5f);
+            int len = strlen(fd->text);
+            if (raster_size(&s, 12 * len, 24)) {
+                raster_glyphs(&s, 0, 0, fd->text, len, 0, 1, 1, false, false, false);
+                raster_blit(ctx->fb, &s, 0, 0, lw, lh, bp.esc_t, sx, sy, false);
+            }
+        }
+    }
+    free(s.bits);
+}
 
+// Draw a static element into the framebuffer (~I still goes to the printer)
+static void raster_static(struct render_context *ctx, const struct lft_elem *e) {
+    if (e->op == OP_INTENSITY) {
+        lft_render_static(ctx, e);
+        return;
+    }
+    if (e->op == OP_CLEAR) {    // CAN clears the area
+        raster_fill(ctx->fb, e->u.clear.x, e->u.clear.y, e->u.clear.x + e->u.clear.dx,
+                    e->u.clear.y + e->u.clear.dy, false);
+        return;
+    }
+    if (!CheckPrintStatus(ctx, e->status)) return;
+    switch (e->op) {
+    case OP_TEXT:   raster_text(ctx, &e->u.text, e->u.text.text); break;
+    case OP_RECT:   raster_rect(ctx, e); break;
+    case OP_CIRCLE: raster_circle(ctx, e); break;
+    case OP_BITMAP: raster_bitmap(ctx, e); break;
+    default:        break;      // ~s only feeds ESC 3, which text sets itself
+    }
+}
 
-else if (strncmp(line, "~R", 2) == 0) {
-    float x = 0, y = 0, angle = 0, dx = 0, dy = 0, th = 0;
-    char mode = 'W', status = '1';  // Default printstatus = '1'
+// Put the program's static layer into the freshly sized framebuffer:
+// a kept frame for this label size and item type, or draw it and keep
+// it. False if the program's layer cannot be drawn ahead (the elements
+// are then drawn in order).
+static bool raster_frame(struct render_context *ctx, struct lft_program *prog) {
+    if (!prog->frame_ok || !ctx->fb->bits || !ctx->fb->w) return false;
+    const struct product *p = ctx->prod;
+    int variant = prog->frame_by_uom ? (p->uom_type << 1) | (p->unit_price == p->actual_unit_price) : 0;
+    struct raster *fb = ctx->fb;
+    size_t size = (size_t)fb->bpr * fb->h;
+
+    pthread_mutex_lock(&lft_cache_lock);
+    struct raster_frame *f = prog->frames;
+    for (; f; f = f->next)
+        if (f->variant == variant && f->lbl_w == ctx->lbl_w_mm && f->lbl_h == ctx->lbl_h_mm)
+            break;
+    pthread_mutex_unlock(&lft_cache_lock);
+    if (f) {                    // frames are immutable until the program is freed
+        memcpy(fb->bits, f->bits, size);
+        atomic_fetch_add(&raster_frame_hits, 1);
+        return true;
+    }
 
-    // Parse the line with safe fallback
-    int count = sscanf(line + 3, "%f,%f,%f,%f,%f,%f,%c,%c",
-                       &x, &y, &angle, &dx, &dy, &th, &mode, &status);
+    for (int i = 0; i < prog->count; i++) {
+        const struct lft_elem *e = &prog->elems[i];
+        if (lft_op_static(e->op) && e->op != OP_INTENSITY) raster_static(ctx, e);
+    }
+    f = malloc(sizeof(*f) + size);
+    if (!f) return true;
+    f->variant = variant;
+    f->lbl_w = ctx->lbl_w_mm;
+    f->lbl_h = ctx->lbl_h_mm;
+    memcpy(f->bits, fb->bits, size);
+    pthread_mutex_lock(&lft_cache_lock);
+    if (prog->nframes < LFT_SEG_RENDERS) {
+        f->next = prog->frames;
+        prog->frames = f;
+        prog->nframes++;
+        f = NULL;
+    }
+    pthread_mutex_unlock(&lft_cache_lock);
+    free(f);
+    return true;
+}
 
-    if (count >= 7) {
-        send_rectangle(fd, x, y, dx, dy, th, (int)angle, mode, status);
+// Whether a job can be drawn here: ~Y and ~e are timed against the
+// printer, and QR codes are left to its encoder
+static bool raster_usable(const struct render_context *ctx, const struct lft_program *prog) {
+    for (int i = 0; i < prog->count; i++) {
+        const struct lft_elem *e = &prog->elems[i];
+        if (e->op == OP_DELAY || e->op == OP_READ) return false;
+        if (e->op == OP_BARCODE && ctx->barcode_no >= 1 && ctx->barcode_no <= ctx->prod->nbarcodes &&
+            !strcmp(bc_record_get(ctx->prod, ctx->barcode_no)->type, "QRCODE"))
+            return false;
     }
+    return true;
 }
 
-// ------ ~C Circle ------------------------------------------------------------------
+// Print one label of a slot for a product
+static int print_product(const struct product *prod, const char *lft_path, int barcode_no,
+                         struct printer_port *pp) {
+// ================================================================
+// Only override JSON weight_or_quantity if item is a WEIGHING item.
+// The product is shared and read-only, so a weighed item prints from
+// a copy that carries this job's scale reading.
+// ================================================================
+struct product weighed;
+if (prod->uom_type == WEIGH) {
+    struct weight_sample ws;
+    long long age_ms;
+
+    // Latest reading from the sampler; go to the scale only if it is stale.
+    // The scale lane owns the port, so hold its device lock for that trip.
+    if (!sample_snapshot(&weight_cache, &ws, &age_ms) || age_ms > weight_max_age_ms()) {
+        pthread_mutex_lock(&scale_lane.io_lock);
+        if (scale_read_weight(&ws) <= 0)
+            fprintf(stderr, "Warning: scale RD_WEIGHT returned no data.\n");
+        pthread_mutex_unlock(&scale_lane.io_lock);
+    }
 
-else if (strncmp(line, "~C", 2) == 0) {
-    float x, y, r, t;
-    char mode = 'W', printstatus = '1';
-    int num = sscanf(line + 3, "%f,%f,%f,%f,%c,%c", &x, &y, &r, &t, &mode, &printstatus);
-    if (num >= 5) {
-        send_circle(fd, x, y, r, t, mode, printstatus);
+    // Override only for weighing items (zero if the scale did not answer)
+    weighed = *prod;
+    weighed.current_gross_weight = ws.valid ? fx_from_double(ws.gross, FX_WEIGHT) : 0;  // Data ID 71
+    weighed.weight_or_quantity   = ws.valid ? fx_from_double(ws.net, FX_WEIGHT)   : 0;  // Data ID 72
+    if (ws.valid && ws.fields >= 3) {
+        weighed.current_net_weight  = fx_from_double(ws.net, FX_WEIGHT);                // Data ID 69
+        weighed.current_tare_weight = fx_from_double(ws.tare, FX_WEIGHT);               // Data ID 70
     }
+    prod = &weighed;
 }
 
-// ------ ~c Escape Codes ------------------------------------------------------------------
-
-else if (strncmp(line, "~c", 2) == 0) {
-    // ~c – Send raw ESC/POS codes (comma-separated integers)
-    uint8_t esc_bytes[64];
-    int value, n = 0;
-    const char *p = line + 3;
+// ─── STEP: Read slot from param and get its compiled LFT ──────────
+int slot = atoi(lft_path);  // lft_path is actually a slot string
 
-    while (*p && n < 64) {
-        if (sscanf(p, "%d", &value) == 1) {
-            esc_bytes[n++] = (uint8_t)value;
-        }
+// Built on first use or after an edit; the row is only read if the DB changed
+struct lft_program *prog = lft_load(slot);
+if (!prog) {
+    return 2;
+}
 
-        // Skip to next comma
-        while (*p && *p != ',') p++;
-        if (*p == ',') p++;
+    int fd = printer_open(pp);
+    if (fd < 0) {
+        lft_program_put(prog);
+        return 3;
     }
 
-    if (n > 0) {
-        write_all(fd, esc_bytes, n);
+    tcflush(fd, TCIFLUSH);      // stale replies from earlier jobs would confuse ~e
+    struct render_context *ctx = &pp->ctx;
+    job_begin(ctx, fd, prod, barcode_no);
+    bool raster = raster_slot(pp->raster_slots, slot);
+    if (raster && !raster_usable(ctx, prog)) {
+        raster = false;
+        atomic_fetch_add(&raster_fallbacks, 1);
+    }
+    ctx->fb = raster ? &pp->raster : NULL;
+    ctx->imgs = !raster && pp->images.budget ? &pp->images : NULL;
+    ctx->macro = !raster && pp->macro.cap ? &pp->macro : NULL;
+
+    // Full reset only when the previous job may have left modes behind
+    bool raw_codes = false, in_page_mode = false;
+    if (!pp->state_known) {
+        uint8_t init_seq[] = { ESC, '@' };
+        prn_write_opaque(ctx, init_seq, sizeof(init_seq));
+        prn_images_forget(ctx->imgs);
+        pp->macro.len = 0;      // ESC/POS keeps macros over ESC @; not assumed
+    }
+    pp->state_known = false;
+    lft_load_images(ctx, prog);
+    const struct lft_segment *macro_sg = lft_macro_segment(ctx, prog);
+    bool framed = false;        // static layer already in the framebuffer
+    if (raster) {
+        raster_label(ctx);
+        atomic_fetch_add(&raster_jobs, 1);
     }
-}
 
-// ------ ~d Bitmap Data  ------------------------------------------------------------------
+    int si = 0;                 // next static segment
+    for (int ei = 0; ei < prog->count; ei++) {
+        const struct lft_elem *e = &prog->elems[ei];
 
-else if (strncmp(line, "~d", 2) == 0) {
-    float x, y, width, height;
-    int angle, xmag, ymag;
-    char type, mode[4] = "W", prnstatus = '1';
-    char *fields[11];
-    int i = 0;
+        if (raster && lft_op_static(e->op)) {
+            if (e->op == OP_INTENSITY || !framed) raster_static(ctx, e);
+            continue;
+        }
 
-    char *p = line + 3;
-    char *token = strtok(p, ",");
-    while (token && i < 11) {
-        fields[i++] = token;
-        token = strtok(NULL, ",");
-    }
-    if (i < 9) continue;
-
-    x = atof(fields[0]);
-    y = atof(fields[1]);
-    angle = atoi(fields[2]);
-    xmag = atoi(fields[3]);
-    ymag = atoi(fields[4]);
-    width = atof(fields[5]);
-    height = atof(fields[6]);
-    type = fields[7][0];
-    strncpy(mode, fields[8], 3);
-    mode[3] = '\0';
-    if (i > 9 && isdigit(fields[9][0])) prnstatus = fields[9][0];
-
-    if (!CheckPrintStatus(prnstatus)) continue;
-
-    int img_w = (int)(width * DOTS_PER_MM + 0.5f) * xmag;
-    int img_h = (int)(height * DOTS_PER_MM + 0.5f) * ymag;
-    int bytes_per_row = (img_w + 7) / 8;
-    int total_bytes = bytes_per_row * img_h;
-
-    int first = fgetc(f);
-    ungetc(first, f);
-
-    FILE *imgfp = NULL;
-    if (first == '\\') {
-        FILE *tmpfp = tmpfile();
-        if (!tmpfp) continue;
-        decode_escaped_binary(f, tmpfp, total_bytes);
-        rewind(tmpfp);
-        imgfp = tmpfp;
-    } else {
-        imgfp = f;
-    }
+        // ~T, ~R, ~C, ~d, ~A, ~s, ~I: whole run from the segment cache
+        if (lft_op_static(e->op)) {
+            struct lft_segment *sg = &prog->segs[si++];
+            lft_run_segment(ctx, sg, prog->elems, sg == macro_sg);
+            ei = sg->first + sg->count - 1;
+            continue;
+        }
 
-    send_bitmap_data(fd, x, y, angle, xmag, ymag, width, height, type, mode, imgfp);
+        switch (e->op) {
 
-    if (imgfp != f) fclose(imgfp);
-}
+ // -------- ~S: define label size & page window in mm --------------------------------------------------
 
+        case OP_SIZE: {
+                uint16_t x_d = e->u.size.w, y_d = e->u.size.h;
+                ctx->lbl_w_mm = e->u.size.w_mm;
+                ctx->lbl_h_mm = e->u.size.h_mm;
 
-// ------ ~Y Delay  ------------------------------------------------------------------
+                // FS L: label size
+                prn_write_fixed(ctx, (uint8_t[]){ FS,'L',
+                    lo(x_d),hi(x_d), lo(y_d),hi(y_d)
+                }, 6);
+                // ESC L: enter page mode
+                prn_write_opaque(ctx, (uint8_t[]){ ESC,'S' }, 2);
+                in_page_mode = true;
+                // ESC W: set window = entire label
+                prn_window(ctx, 0, 0, x_d, y_d, false);
+                // no hardware offset: y=0.0 → top
+                ctx->x_off = 0.0f;
+                ctx->y_off = 0.0f;
+                if (raster) {
+                    raster_label(ctx);
+                    framed = raster_frame(ctx, prog);
+                }
+            break;
+        }
+// ----------- ~V Variable Text ----------------------------------------------------------------------------------
 
-else if (strncmp(line, "~Y", 2) == 0) {
-    // ~Y – Delay in milliseconds (5–5000 ms)
-    int delay_ms;
-    if (sscanf(line + 3, "%d", &delay_ms) == 1) {
-        if (delay_ms < 5) delay_ms = 5;
-        else if (delay_ms > 5000) delay_ms = 5000;
-        usleep(delay_ms * 1000);
+case OP_VAR: {
+    const struct lft_text *t = &e->u.text;
+    char actual[512];
+    if (!CheckPrintStatus(ctx, e->status)) break;
+    lft_var_text(ctx, t, actual, sizeof(actual));
+
+    // Finally send
+    if (raster) {
+        raster_text(ctx, t, actual);
+        break;
     }
+    send_text(ctx, t->x, t->y, t->font, t->xm, t->ym, actual, t->len, t->offset,
+              t->justify, t->lines, t->spacing, t->angle, t->mode);
+    break;
 }
 
-// ------ ~I Intensity  ------------------------------------------------------------------
+// ------ Barcode ~B handler (JSON-driven) ------------------------------------------------------------------
+
+case OP_BARCODE: {
+    float x = e->u.barcode.x, y = e->u.barcode.y;
+    float module_width_mm = e->u.barcode.mw, bar_height_mm = e->u.barcode.bh;
+    int angle = e->u.barcode.angle;
+    char justify = e->u.barcode.justify, hri = e->u.barcode.hri;
+
+    char pattern[256];
+    const struct bc_record *bc = lft_barcode_data(ctx, e, pattern, sizeof(pattern));
+    if (!bc) break;
+    if (raster) {
+        raster_barcode(ctx, e, pattern, bc);
+        break;
+    }
+
+    // Send barcode to printer
+    send_barcode(ctx, x, y, module_width_mm, bar_height_mm,
+                 pattern, bc->type, hri, angle, justify);
 
-else if (strncmp(line, "~I", 2) == 0) {
-    int level;
-    // parse level after “~I,”
-    if (sscanf(line + 3, "%d", &level) == 1) {
-        // clamp to 60–140%
-        if (level < 60) level = 60;
-        if (level > 140) level = 140;
-        // DC2 '∼' n  ← this is 0x12, 0x7E, level
-        uint8_t cmd[3] = { 0x12, 0x7E, (uint8_t)level };
-        write_all(fd, cmd, sizeof(cmd));
+    // ─── Optional field labels below barcode ─────────────────
+    int modw = (int)(module_width_mm * DOTS_PER_MM + 0.5f);
+    for (int f = 0; f < 2; f++) {
+        const struct bc_field *fd = &bc->fld[f];
+        if (!bc_field_shown(prod, fd)) continue;
+
+        int sx = fd->left
+            ? (int)(x * DOTS_PER_MM) - fd->shift * modw
+            : (int)((x + module_width_mm * strlen(pattern) / (float)DOTS_PER_MM) * DOTS_PER_MM) + fd->shift * modw;
+        set_absolute_position(ctx, sx / (float)DOTS_PER_MM, y + bar_height_mm + (f ? 4.0f : 2.0f));
+        prn_write(ctx, (const uint8_t*)fd->text, strlen(fd->text));
     }
+    break;
 }
 
-// ------ ~e Read Response  ------------------------------------------------------------------
+// ------ ~c Escape Codes ------------------------------------------------------------------
 
-else if (strncmp(line, "~e", 2) == 0) {
-    char mode = '\0';
-    char expected[128] = {0};
-    int timeout_ms = 0;
+case OP_RAW:
+    prn_write_opaque(ctx, e->u.raw.bytes, e->u.raw.n);
+    prn_images_forget(ctx->imgs);
+    if (ctx->macro) ctx->macro->len = 0;
+    raw_codes = true;       // may change anything; reset before the next job
+    break;
 
-    // parse:  single-char mode, up to 127-byte expected string, integer timeout
-    if (sscanf(line + 3, " %c , %127[^,] , %d",
-               &mode, expected, &timeout_ms) >= 3) {
-        // invoke helper
-        bool got = send_read_response(fd, expected, timeout_ms);
-        // optional debug:
-        // fprintf(stderr, "~e: waited %dms for \"%s\" → %s\n",
-        //         timeout_ms, expected, got ? "OK" : "TIMEOUT");
-    }
-}
+// ------ ~Y Delay  ------------------------------------------------------------------
+
+case OP_DELAY:
+    job_flush(ctx);    // the delay is between what was sent and what follows
+    usleep(e->u.delay_ms * 1000);
+    break;
+
+// ------ ~e Read Response  ------------------------------------------------------------------
 
+case OP_READ: {
+    // the printer must have everything before it can answer
+    job_flush(ctx);
+    bool got = send_read_response(ctx, e->u.read.expected, e->u.read.timeout_ms);
+    // optional debug:
+    // fprintf(stderr, "~e: waited %dms for \"%s\" → %s\n",
+    //         e->u.read.timeout_ms, e->u.read.expected, got ? "OK" : "TIMEOUT");
+    (void)got;
+    break;
+}
 
  // ------- ~P: print & exit page mode ------------------------------------------------------------
- 
-         else if (strncmp(line,"~P",2)==0){
-            int copies; char dir;
-            if (sscanf(line+3,"%d,%c",&copies,&dir)!=2) copies=1;
+
+        case OP_PRINT:
+            if (raster) raster_emit(ctx);
             // streaming print direction if you like:
-            write_all(fd, (uint8_t[]){ ESC,'{', (uint8_t)(dir=='U'?1:0) },3);
-            for(int i=0;i<copies;i++)
-                write_all(fd, (uint8_t[]){ GS,0x0C },2);  // GS FF
-            write_all(fd, (uint8_t[]){ ESC,'S' },2);       // ESC S
-        }
+            prn_write_fixed(ctx, (uint8_t[]){ ESC,'{', (uint8_t)(e->u.print.dir=='U'?1:0) },3);
+            for(int i=0;i<e->u.print.copies;i++)
+                prn_write_fixed(ctx, (uint8_t[]){ GS,0x0C },2);  // GS FF
+            prn_write_opaque(ctx, (uint8_t[]){ ESC,'S' },2);  // ESC S
+            in_page_mode = false;
+            job_flush(ctx);
+            break;
 
+        default:
+            break;
+        }
    }
+    if (raster) raster_emit(ctx);   // drawn after the last ~P: in the page buffer, as page mode leaves it
+
+	bool sent = job_end(ctx);
+	printf("Print job: %zu bytes in %d write(s), %.2f ms flushing, %zu redundant bytes suppressed\n",
+	       ctx->stats.bytes, ctx->stats.flushes, ctx->stats.flush_ms, ctx->prn.suppressed);
+
+	lft_program_put(prog);
+	if (!sent)
+	    printer_close(pp);          // reopened (and reset) by the next job
+	else
+	    pp->state_known = !in_page_mode && !raw_codes;
+	return sent ? 0 : 5;
+}
 
-    if (!json_root) {
-    json_object_put(json_root);
-    json_root = NULL;
+// Print with the product data of a JSON file
+int convert_label(const char *config_path, const char *lft_path, int barcode_no,
+                  struct printer_port *pp) {
+    struct json_object *root = read_json_file(config_path);
+    struct product *prod = root ? product_new(root) : NULL;
+    if (!prod) {
+        fprintf(stderr, "Error: failed to parse JSON in %s\n", config_path);
+        return 1;
+    }
+    int rc = print_product(prod, lft_path, barcode_no, pp);
+    product_put(prod);
+    return rc;
 }
 
-	fclose(f);
-	close(fd);
-	return 0;
+// Print with the product data of a PLU from the product master
+int print_plu(long plu, const char *lft_path, int barcode_no, struct printer_port *pp) {
+    struct product *prod = plu_lookup(plu);
+    if (!prod) {
+        fprintf(stderr, "Error: PLU %ld not in product master\n", plu);
+        return 1;
+    }
+    int rc = print_product(prod, lft_path, barcode_no, pp);
+    product_put(prod);
+    return rc;
 }
 
 // ------------- End Of The Driver Code -----------------------------------------------------------------